@@ -3,14 +3,21 @@
 uniform sampler2D u_bgtexture;
 uniform sampler2D u_texture;
 uniform sampler2D u_texture2;
+uniform sampler2D u_particles;
+uniform bool u_showDensity;
+uniform bool u_showParticles;
 uniform vec2 u_solution;
 uniform float u_targetDensity;
 uniform float u_sampleRadius;
 uniform float u_time;
+uniform vec4 u_phaseTints[4];
+uniform int u_phaseCount;
 
 out vec4 fragColor;
 vec2 texcoord;
 
+vec4 liquidColor();
+vec3 phaseTint();
 vec4 hsvToRgb(vec4 c);
 vec4 lerp(vec4 a, vec4 b, float t);
 vec2 getVelocity(vec2 texcoord, vec2 delta);
@@ -21,6 +28,25 @@ vec2 getVelocitySmoothed(vec2 texcoord, vec2 delta);
 void main()
 {
     texcoord = gl_FragCoord.xy / u_solution;
+    vec3 color = texture(u_bgtexture, texcoord).rgb;
+
+    if (u_showDensity) {
+        vec4 liquid = clamp(liquidColor(), 0.0, 1.0);
+        if (u_phaseCount > 1)
+            liquid.rgb = mix(liquid.rgb, phaseTint(), 0.35);
+        color = mix(color, liquid.rgb, liquid.a);
+    }
+
+    if (u_showParticles) {
+        vec4 particle = texture(u_particles, texcoord);
+        color = mix(color, particle.rgb, particle.a);
+    }
+
+    fragColor = vec4(color, 1.0);
+}
+
+vec4 liquidColor()
+{
     float density = texture2D(u_texture, texcoord).r;
     float err = abs(density - u_targetDensity);
     float deltaDensity = getDeltaDensity(texcoord);
@@ -30,20 +56,28 @@ void main()
     vec4 whiteColor = vec4(255, 255, 255, 255) / 255.0;
 
     if (err < 0.01) {
-        fragColor = lerp(whiteColor, vec4(startColor.xyz, density), err / 0.01);
-        return;
+        return lerp(whiteColor, vec4(startColor.xyz, density), err / 0.01);
     }
 
     if (density < u_targetDensity - 0.01) {
-        fragColor = vec4(0, 0, 0, 0);
-        return;
+        return vec4(0, 0, 0, 0);
     }
 
     vec2 dir = length(velocity) == 0.0 ? vec2(0, 0) : normalize(velocity);
     vec2 refractedUV = texcoord - dir * deltaDensity * 0.1;
     startColor = texture(u_bgtexture, refractedUV) + startColor * 0.1;
 
-    fragColor = startColor;
+    return startColor;
+}
+
+vec3 phaseTint()
+{
+    // green was splatted as density times phase / 3, so the ratio is the local mean phase
+    vec4 splat = texture(u_texture, texcoord);
+    float phase = splat.r > 0.0 ? clamp(splat.g / splat.r, 0.0, 1.0) * 3.0 : 0.0;
+    int lower = int(floor(phase));
+    int upper = min(lower + 1, 3);
+    return mix(u_phaseTints[lower].rgb, u_phaseTints[upper].rgb, phase - float(lower));
 }
 
 vec4 hsvToRgb(vec4 c) {
@@ -0,0 +1,177 @@
+#include "checkpoint.h"
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <type_traits>
+
+static_assert(std::is_trivially_copyable_v<Parameters>, "Parameters is stored in checkpoints as raw bytes");
+
+static size_t alignUp(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+std::vector<char> Checkpoint::serialize(const ParticleSystem &particleSystem)
+{
+    size_t count = particleSystem.particlePosition.size();
+    CheckpointHeader header;
+    header.particleCount = count;
+    header.stepCounter = particleSystem.stepCounter;
+    header.rngState = particleSystem.rngState;
+    header.particleRadius = particleSystem.particleRadius;
+    header.forceStrengthOriginal = particleSystem.forceStrengthOriginal;
+
+    const void *arrays[CheckpointHeader::arrayCount] = {
+        particleSystem.particlePosition.data(),
+        // without stored predictions the positions stand in, which is what the solver read
+        particleSystem.params.reducedMemory ? particleSystem.particlePosition.data() : particleSystem.particlePositionPredicted.data(),
+        particleSystem.particleVelocity.data(),
+        particleSystem.particleDensity.data(),
+        particleSystem.particlePhase.data()};
+    size_t sizes[CheckpointHeader::arrayCount] = {count * sizeof(Vector2f), count * sizeof(Vector2f), count * sizeof(Vector2f), count * sizeof(float), count * sizeof(uint8_t)};
+
+    // Parameters sits in its own block so a layout change only invalidates the parameters
+    header.parametersOffset = sizeof(CheckpointHeader);
+    size_t offset = alignUp(header.parametersOffset + sizeof(Parameters), alignment);
+    for (int i = 0; i < CheckpointHeader::arrayCount; ++i)
+    {
+        header.arrayOffsets[i] = offset;
+        offset = alignUp(offset + sizes[i], alignment);
+    }
+
+    std::vector<char> bytes(offset, 0);
+    std::memcpy(bytes.data(), &header, sizeof(header));
+    std::memcpy(bytes.data() + header.parametersOffset, &particleSystem.params, sizeof(Parameters));
+    for (int i = 0; i < CheckpointHeader::arrayCount; ++i)
+    {
+        if (sizes[i] > 0)
+            std::memcpy(bytes.data() + header.arrayOffsets[i], arrays[i], sizes[i]);
+    }
+    return bytes;
+}
+
+bool Checkpoint::writeFile(const std::vector<char> &bytes, const std::string &path)
+{
+    // write next to the target and rename, so a crash never leaves a torn checkpoint
+    std::string tempPath = path + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        if (!file.write(bytes.data(), bytes.size()))
+        {
+            std::cerr << "Failed to write checkpoint " << tempPath << std::endl;
+            return false;
+        }
+    }
+    std::remove(path.c_str());
+    if (std::rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        std::cerr << "Failed to move checkpoint to " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool Checkpoint::saveAsync(const ParticleSystem &particleSystem, const std::string &path)
+{
+    if (isSaving())
+        return false;
+    wait();
+    // the snapshot is copied on the calling thread, only the file io runs in the background
+    pending = std::async(std::launch::async, [bytes = serialize(particleSystem), path]()
+                         { return writeFile(bytes, path); });
+    return true;
+}
+
+bool Checkpoint::save(const ParticleSystem &particleSystem, const std::string &path)
+{
+    wait();
+    return writeFile(serialize(particleSystem), path);
+}
+
+bool Checkpoint::isSaving() const
+{
+    return pending.valid() && pending.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+}
+
+bool Checkpoint::wait()
+{
+    if (!pending.valid())
+        return true;
+    return pending.get();
+}
+
+bool Checkpoint::load(ParticleSystem &particleSystem, const std::string &path, bool keepDomain)
+{
+    MappedFile file;
+    if (!file.open(path))
+    {
+        std::cerr << "Failed to open checkpoint " << path << std::endl;
+        return false;
+    }
+
+    CheckpointHeader header;
+    if (file.size() < sizeof(header))
+    {
+        std::cerr << "Checkpoint " << path << " is truncated" << std::endl;
+        return false;
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.magic, "FLCK", 4) != 0 || header.version != version || header.headerSize != sizeof(header))
+    {
+        std::cerr << "Checkpoint " << path << " has an unsupported format" << std::endl;
+        return false;
+    }
+
+    size_t count = header.particleCount;
+    size_t sizes[CheckpointHeader::arrayCount] = {count * sizeof(Vector2f), count * sizeof(Vector2f), count * sizeof(Vector2f), count * sizeof(float), count * sizeof(uint8_t)};
+    for (int i = 0; i < CheckpointHeader::arrayCount; ++i)
+    {
+        if (header.arrayOffsets[i] + sizes[i] > file.size())
+        {
+            std::cerr << "Checkpoint " << path << " is truncated" << std::endl;
+            return false;
+        }
+    }
+
+    // arrays are copied straight out of the mapping, there is nothing to parse
+    auto positions = reinterpret_cast<const Vector2f *>(file.data() + header.arrayOffsets[0]);
+    auto predicted = reinterpret_cast<const Vector2f *>(file.data() + header.arrayOffsets[1]);
+    auto velocities = reinterpret_cast<const Vector2f *>(file.data() + header.arrayOffsets[2]);
+    auto densities = reinterpret_cast<const float *>(file.data() + header.arrayOffsets[3]);
+    auto phases = reinterpret_cast<const uint8_t *>(file.data() + header.arrayOffsets[4]);
+    particleSystem.particlePosition.assign(positions, positions + count);
+    particleSystem.particlePositionPredicted.assign(predicted, predicted + count);
+    particleSystem.particleVelocity.assign(velocities, velocities + count);
+    particleSystem.particleDensity.assign(densities, densities + count);
+    particleSystem.particlePhase.assign(phases, phases + count);
+    particleSystem.particleCellIndices.assign(count, {-1, -1});
+
+    Parameters &params = particleSystem.params;
+    if (header.parametersSize == sizeof(Parameters) && header.parametersOffset + sizeof(Parameters) <= file.size())
+    {
+        unsigned width = params.windowWidth;
+        unsigned height = params.windowHeight;
+        std::memcpy(&params, file.data() + header.parametersOffset, sizeof(Parameters));
+        if (keepDomain)
+        {
+            params.windowWidth = width;
+            params.windowHeight = height;
+        }
+    }
+    else
+    {
+        std::cerr << "Checkpoint " << path << " was written with different parameters, keeping the current ones" << std::endl;
+    }
+    particleSystem.stepCounter = header.stepCounter;
+    particleSystem.rngState = header.rngState;
+    particleSystem.particleRadius = header.particleRadius;
+    particleSystem.forceStrengthOriginal = header.forceStrengthOriginal;
+
+    particleSystem.particleAsleep.assign(count, 0);
+    particleSystem.applyMemoryMode();
+    particleSystem.resetParticleIds();
+    particleSystem.updateCellSizes();
+    particleSystem.updateParticleCells();
+    return true;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <cstdint>
+#include <future>
+#include <string>
+#include <vector>
+#include "particle_system.h"
+
+struct CheckpointHeader
+{
+    char magic[4] = {'F', 'L', 'C', 'K'};
+    static constexpr int arrayCount = 5;
+    uint32_t version = 2;
+    uint32_t headerSize = sizeof(CheckpointHeader);
+    uint32_t parametersSize = sizeof(Parameters);
+    uint64_t parametersOffset = 0;
+    uint64_t particleCount = 0;
+    uint64_t stepCounter = 0;
+    uint64_t rngState = 0;
+    float particleRadius = 0.0f;
+    float forceStrengthOriginal = 0.0f;
+    // byte offsets of position, predicted position, velocity, density and phase
+    uint64_t arrayOffsets[arrayCount] = {};
+};
+
+class Checkpoint
+{
+    // binary snapshot of a ParticleSystem: the header followed by the raw SoA arrays,
+    // written on a background thread and loaded back through a memory mapping
+public:
+    static constexpr uint32_t version = 2;
+    static constexpr size_t alignment = 64;
+
+    ~Checkpoint() { wait(); }
+    bool saveAsync(const ParticleSystem &particleSystem, const std::string &path);
+    bool save(const ParticleSystem &particleSystem, const std::string &path);
+    bool isSaving() const;
+    bool wait();
+    static bool load(ParticleSystem &particleSystem, const std::string &path, bool keepDomain);
+
+private:
+    std::future<bool> pending;
+
+    static std::vector<char> serialize(const ParticleSystem &particleSystem);
+    static bool writeFile(const std::vector<char> &bytes, const std::string &path);
+};
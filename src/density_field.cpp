@@ -0,0 +1,292 @@
+#include "density_field.h"
+#include <cmath>
+#include <algorithm>
+#include <omp.h>
+
+// segments per marching squares case, as pairs of edges:
+// 0 top, 1 right, 2 bottom, 3 left. cases 5 and 10 are saddles resolved at runtime
+static const int caseSegments[16][4] = {
+    {-1, -1, -1, -1}, {3, 0, -1, -1}, {0, 1, -1, -1}, {3, 1, -1, -1},
+    {1, 2, -1, -1}, {3, 0, 1, 2}, {0, 2, -1, -1}, {3, 2, -1, -1},
+    {2, 3, -1, -1}, {0, 2, -1, -1}, {0, 1, 2, 3}, {1, 2, -1, -1},
+    {1, 3, -1, -1}, {0, 1, -1, -1}, {3, 0, -1, -1}, {-1, -1, -1, -1}};
+
+void DensityField::resize(sf::Vector2u domain, float cellSize)
+{
+    this->cellSize = cellSize;
+    cols = static_cast<int>(domain.x / cellSize) + 2;
+    rows = static_cast<int>(domain.y / cellSize) + 2;
+    values.assign(cols * rows, 0.0f);
+    extractedValues.assign(cols * rows, 0.0f);
+
+    tileCols = (cols - 1 + tileSize - 1) / tileSize;
+    tileRows = (rows - 1 + tileSize - 1) / tileSize;
+    tileSegments.assign(tileCols * tileRows, {});
+    tileDirty.assign(tileCols * tileRows, 1);
+    tileStale.assign(tileCols * tileRows, 1);
+    splatPositions.clear();
+    splatPhases.clear();
+    splatStamps.clear();
+    splatRadius = 0.0f;
+    meshDirty = true;
+}
+
+void DensityField::update(const ParticleSystem &particleSystem, float isoLevel)
+{
+    if (isoLevel != this->isoLevel)
+    {
+        this->isoLevel = isoLevel;
+        std::fill(tileDirty.begin(), tileDirty.end(), 1);
+    }
+    splat(particleSystem);
+
+    // a tile needs a new contour when any of its nodes (shared edges included) moved enough
+    dirtyTileCount = 0;
+    for (int t = 0; t < tileCols * tileRows; ++t)
+    {
+        int tx = t % tileCols * tileSize;
+        int ty = t / tileCols * tileSize;
+        for (int y = ty; y <= std::min(ty + tileSize, rows - 1) && !tileDirty[t]; ++y)
+        {
+            for (int x = tx; x <= std::min(tx + tileSize, cols - 1); ++x)
+            {
+                int i = x + y * cols;
+                if (std::abs(values[i] - extractedValues[i]) > tolerance)
+                {
+                    tileDirty[t] = 1;
+                    break;
+                }
+            }
+        }
+        if (tileDirty[t])
+            dirtyTileCount++;
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < tileCols * tileRows; ++t)
+    {
+        if (tileDirty[t])
+            extractTile(t);
+    }
+
+    // nodes on tile borders are shared, so commit them only after every tile is extracted
+    for (int t = 0; t < tileCols * tileRows; ++t)
+    {
+        if (!tileDirty[t])
+            continue;
+        int tx = t % tileCols * tileSize;
+        int ty = t / tileCols * tileSize;
+        for (int y = ty; y <= std::min(ty + tileSize, rows - 1); ++y)
+        {
+            for (int x = tx; x <= std::min(tx + tileSize, cols - 1); ++x)
+                extractedValues[x + y * cols] = values[x + y * cols];
+        }
+        tileDirty[t] = 0;
+        meshDirty = true;
+    }
+}
+
+void DensityField::splat(const ParticleSystem &particleSystem)
+{
+    // gather form of the splat: every node sums the particles within the sample radius through the
+    // solver grid, so threads never write to the same node. only the tiles near a particle that
+    // moved since the last splat are sampled again, a settled fluid costs one pass over the positions.
+    // a particle weighs its phase's mass over its phase's rest density, so every phase reaches the
+    // iso level of the base fluid at its own rest density, as in the solver's multiphase density
+    const StepConstants constants = particleSystem.makeStepConstants(0.0f);
+    float weight[Parameters::maxPhases];
+    for (int phase = 0; phase < Parameters::maxPhases; ++phase)
+        weight[phase] = constants.phaseTargetDensity[phase] > 0.0f ? constants.phaseMass[phase] * constants.targetDensity / constants.phaseTargetDensity[phase] : 0.0f;
+    const auto &positions = particleSystem.particlePosition;
+    const auto &phases = particleSystem.particlePhase;
+    const auto &ids = particleSystem.particleId;
+    const size_t count = positions.size();
+    if (phases.size() != count || ids.size() != count)
+        return;
+    uint32_t idCount = 0;
+    for (uint32_t id : ids)
+        idCount = std::max(idCount, id + 1);
+    if (splatStamps.size() < idCount)
+    {
+        splatPositions.resize(idCount);
+        splatPhases.resize(idCount);
+        splatStamps.resize(idCount, 0);
+    }
+
+    // particles are matched by id, so the swap-removes and reorders of the solver's arrays cost
+    // nothing. the values only depend on where the particles are, so a moved particle marks the
+    // tiles around its old and new place, an emitted or drained one those around its one place
+    const uint32_t previous = splatStamp++;
+    const bool resample = constants.radius != splatRadius || !std::equal(weight, weight + Parameters::maxPhases, splatWeight);
+    if (resample)
+    {
+        std::fill(tileStale.begin(), tileStale.end(), 1);
+        splatRadius = constants.radius;
+        std::copy(weight, weight + Parameters::maxPhases, splatWeight);
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        const uint32_t id = ids[i];
+        const bool sampled = splatStamps[id] == previous;
+        if (!resample && (!sampled || splatPositions[id] != positions[i] || splatPhases[id] != phases[i]))
+        {
+            if (sampled)
+                markStale(splatPositions[id], constants);
+            markStale(positions[i], constants);
+        }
+        splatPositions[id] = positions[i];
+        splatPhases[id] = phases[i];
+        splatStamps[id] = splatStamp;
+    }
+    // the ids that were sampled and are gone now
+    for (uint32_t id = 0; id < splatStamps.size() && !resample; ++id)
+    {
+        if (splatStamps[id] == previous)
+            markStale(splatPositions[id], constants);
+    }
+
+    staleTileCount = 0;
+    for (char stale : tileStale)
+        staleTileCount += stale;
+#pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < tileCols * tileRows; ++t)
+    {
+        if (!tileStale[t])
+            continue;
+        // a tile samples its own nodes, the last row and column of tiles also the grid's far edge
+        const int tx = t % tileCols * tileSize;
+        const int ty = t / tileCols * tileSize;
+        const int x1 = t % tileCols == tileCols - 1 ? cols : tx + tileSize;
+        const int y1 = t / tileCols == tileRows - 1 ? rows : ty + tileSize;
+        for (int y = ty; y < y1; ++y)
+        {
+            for (int x = tx; x < x1; ++x)
+            {
+                Vector2f pos(x * cellSize, y * cellSize);
+                float density = 0.0f;
+                particleSystem.forEachNeighbor(pos, constants, [&](int neighbor, Vector2f shift)
+                                               {
+                                                   float distance = (pos - positions[neighbor] - shift).length();
+                                                   density += QuadraticKernel::density(distance, constants) * weight[phases[neighbor]]; });
+                values[x + y * cols] = density;
+            }
+        }
+        tileStale[t] = 0;
+    }
+}
+
+void DensityField::markStale(Vector2f pos, const StepConstants &constants)
+{
+    // the tiles owning the nodes within the sample radius of pos
+    const Vector2f reach(constants.radius, constants.radius);
+    const Vector2f low = pos - reach;
+    const Vector2f high = pos + reach;
+    // across a periodic seam the nodes on the far side see the particle too
+    const int shiftsX = constants.periodicX && (low.x < 0.0f || high.x > constants.width);
+    const int shiftsY = constants.periodicY && (low.y < 0.0f || high.y > constants.height);
+    for (int sy = -shiftsY; sy <= shiftsY; ++sy)
+    {
+        for (int sx = -shiftsX; sx <= shiftsX; ++sx)
+        {
+            const Vector2f shift(sx * constants.width, sy * constants.height);
+            const int x0 = std::max(static_cast<int>(std::ceil((low.x + shift.x) / cellSize)), 0) / tileSize;
+            const int y0 = std::max(static_cast<int>(std::ceil((low.y + shift.y) / cellSize)), 0) / tileSize;
+            const int x1 = std::min(static_cast<int>(std::floor((high.x + shift.x) / cellSize)) / tileSize, tileCols - 1);
+            const int y1 = std::min(static_cast<int>(std::floor((high.y + shift.y) / cellSize)) / tileSize, tileRows - 1);
+            for (int y = y0; y <= y1; ++y)
+            {
+                for (int x = x0; x <= x1; ++x)
+                    tileStale[x + y * tileCols] = 1;
+            }
+        }
+    }
+}
+
+void DensityField::extractTile(int tile)
+{
+    vector<sf::Vertex> &segments = tileSegments[tile];
+    segments.clear();
+    int tx = tile % tileCols * tileSize;
+    int ty = tile / tileCols * tileSize;
+    sf::Color color(255, 255, 255, 160);
+
+    for (int y = ty; y < std::min(ty + tileSize, rows - 1); ++y)
+    {
+        for (int x = tx; x < std::min(tx + tileSize, cols - 1); ++x)
+        {
+            float v[4] = {value(x, y), value(x + 1, y), value(x + 1, y + 1), value(x, y + 1)};
+            int c = (v[0] >= isoLevel) | (v[1] >= isoLevel) << 1 | (v[2] >= isoLevel) << 2 | (v[3] >= isoLevel) << 3;
+            if (c == 0 || c == 15)
+                continue;
+
+            int edges[4] = {caseSegments[c][0], caseSegments[c][1], caseSegments[c][2], caseSegments[c][3]};
+            if ((c == 5 || c == 10) && (v[0] + v[1] + v[2] + v[3]) / 4.0f >= isoLevel)
+            {
+                // saddle with the centre inside: the two inside corners are connected
+                int connected[2][4] = {{0, 1, 2, 3}, {3, 0, 1, 2}};
+                std::copy(connected[c == 10], connected[c == 10] + 4, edges);
+            }
+
+            for (int e : edges)
+            {
+                if (e < 0)
+                    break;
+                int a = e;
+                int b = (e + 1) % 4;
+                float t = (isoLevel - v[a]) / (v[b] - v[a]);
+                // corner positions in cell units: 0 (0,0), 1 (1,0), 2 (1,1), 3 (0,1)
+                Vector2f pa(a == 1 || a == 2, a >= 2);
+                Vector2f pb(b == 1 || b == 2, b >= 2);
+                Vector2f p = pa + (pb - pa) * t;
+                segments.push_back(sf::Vertex{Vector2f(x + p.x, y + p.y) * cellSize, color});
+            }
+        }
+    }
+}
+
+float DensityField::sample(Vector2f pos) const
+{
+    float fx = std::clamp(pos.x / cellSize, 0.0f, cols - 1.001f);
+    float fy = std::clamp(pos.y / cellSize, 0.0f, rows - 1.001f);
+    int x = static_cast<int>(fx);
+    int y = static_cast<int>(fy);
+    float tx = fx - x;
+    float ty = fy - y;
+    float top = value(x, y) + (value(x + 1, y) - value(x, y)) * tx;
+    float bottom = value(x, y + 1) + (value(x + 1, y + 1) - value(x, y + 1)) * tx;
+    return top + (bottom - top) * ty;
+}
+
+const sf::VertexArray &DensityField::getMesh()
+{
+    if (meshDirty)
+    {
+        mesh.clear();
+        for (auto &segments : tileSegments)
+        {
+            for (auto &vertex : segments)
+                mesh.append(vertex);
+        }
+        meshDirty = false;
+    }
+    return mesh;
+}
+
+sf::Image DensityField::toImage(float maxDensity) const
+{
+    sf::Image image({(unsigned)cols, (unsigned)rows});
+    for (int y = 0; y < rows; ++y)
+    {
+        for (int x = 0; x < cols; ++x)
+        {
+            auto v = static_cast<std::uint8_t>(std::clamp(value(x, y) / maxDensity, 0.0f, 1.0f) * 255);
+            image.setPixel({(unsigned)x, (unsigned)y}, sf::Color(v, v, v));
+        }
+    }
+    return image;
+}
+
+bool DensityField::saveImage(const std::string &path, float maxDensity) const
+{
+    return toImage(maxDensity).saveToFile(path);
+}
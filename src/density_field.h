@@ -0,0 +1,52 @@
+#pragma once
+#include <SFML/Graphics.hpp>
+#include <vector>
+#include <string>
+#include "particle_system.h"
+
+class DensityField
+{
+    // coarse scalar density grid sampled from the particles on the cpu, re-sampled per tile
+    // that a particle moved near, with a marching squares iso-contour that is rebuilt per dirty tile
+public:
+    static constexpr int tileSize = 8; // cells per tile side
+
+    vector<float> values;
+    int cols = 0; // nodes per row
+    int rows = 0;
+    float cellSize = 10.0f;
+    float isoLevel = 0.1f;
+    float tolerance = 0.002f; // change needed for a tile to be re-extracted
+    size_t dirtyTileCount = 0;
+    size_t staleTileCount = 0; // re-sampled by the last update
+
+    void resize(sf::Vector2u domain, float cellSize);
+    void update(const ParticleSystem &particleSystem, float isoLevel);
+    float sample(Vector2f pos) const;
+    const sf::VertexArray &getMesh();
+    sf::Image toImage(float maxDensity) const;
+    bool saveImage(const std::string &path, float maxDensity) const;
+
+private:
+    int tileCols = 0;
+    int tileRows = 0;
+    vector<float> extractedValues; // values the current tile meshes were built from
+    vector<vector<sf::Vertex>> tileSegments;
+    vector<char> tileDirty;
+    vector<char> tileStale;          // the particles near the tile's nodes moved since they were sampled
+    // per particle id, the particles the values were sampled from. an id whose stamp is not the last
+    // splat's was not sampled
+    vector<Vector2f> splatPositions;
+    vector<uint8_t> splatPhases;
+    vector<uint32_t> splatStamps;
+    uint32_t splatStamp = 0;
+    float splatRadius = 0.0f;
+    float splatWeight[Parameters::maxPhases] = {}; // per phase, see splat
+    sf::VertexArray mesh{sf::PrimitiveType::Lines};
+    bool meshDirty = true;
+
+    void splat(const ParticleSystem &particleSystem);
+    void markStale(Vector2f pos, const StepConstants &constants);
+    void extractTile(int tile);
+    float value(int x, int y) const { return values[x + y * cols]; }
+};
@@ -0,0 +1,534 @@
+#include "distributed.h"
+#include "headless.h"
+#include <SFML/Graphics/Image.hpp>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <omp.h>
+#include <sstream>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char **environ;
+#endif
+
+namespace
+{
+    struct ParticleRecord
+    {
+        Vector2f position;
+        Vector2f positionPredicted;
+        Vector2f velocity;
+        float density;
+        uint8_t phase;
+    };
+
+    template <class T>
+    void append(std::vector<char> &bytes, const T &value)
+    {
+        const char *p = reinterpret_cast<const char *>(&value);
+        bytes.insert(bytes.end(), p, p + sizeof(T));
+    }
+
+    double secondsSince(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+DistributedRank::DistributedRank(const Parameters &params, Transport &transport)
+    : particleSystem(params), params(particleSystem.params), transport(transport)
+{
+}
+
+void DistributedRank::initialize()
+{
+    sf::Image particleImage;
+    particleSystem.particleRadius = particleImage.loadFromFile("assets/textures/particle.png") ? particleImage.getSize().x / 2.0f : 8.0f;
+    // both adapt to local state, which would let the ranks drift apart
+    params.enableSleeping = false;
+    params.enableAdjustingForce = false;
+
+    const int size = transport.size;
+    stripEdges.resize(size + 1);
+    for (int r = 0; r <= size; ++r)
+        stripEdges[r] = static_cast<float>(params.windowWidth) * r / size;
+
+    // every rank builds the same initial block and keeps its own part of it
+    particleSystem.initParticles(params.particleCount);
+    for (int i = 0; i < static_cast<int>(particleSystem.particlePosition.size()); ++i)
+    {
+        if (ownerOf(particleSystem.particlePosition[i].x) != transport.rank)
+            particleSystem.removeParticle(i);
+    }
+    particleSystem.compactParticles();
+    ownedCount = static_cast<int>(particleSystem.particlePosition.size());
+
+    // with a periodic x axis the outer strips are neighbours too, with two ranks the same rank is both
+    neighbors.clear();
+    auto addNeighbor = [this](int rank)
+    {
+        neighbors.emplace_back();
+        neighbors.back().rank = rank;
+    };
+    if (size > 1)
+    {
+        if (transport.rank > 0 || params.periodicX)
+            addNeighbor((transport.rank + size - 1) % size);
+        if (transport.rank < size - 1 || params.periodicX)
+            addNeighbor((transport.rank + 1) % size);
+    }
+    // stable, so with two ranks the shared neighbour still pairs left with left and right with right
+    exchangeOrder.clear();
+    for (int i = 0; i < static_cast<int>(neighbors.size()); ++i)
+        exchangeOrder.push_back(i);
+    std::stable_sort(exchangeOrder.begin(), exchangeOrder.end(), [this](int a, int b)
+                     { return neighbors[a].rank < neighbors[b].rank; });
+    particleSystem.phaseHook = [this](TelemetryPhase phase)
+    {
+        if (!transportFailed && !refreshHalo(phase))
+            transportFailed = true;
+    };
+}
+
+int DistributedRank::ownerOf(float x) const
+{
+    int owner = static_cast<int>(std::upper_bound(stripEdges.begin(), stripEdges.end(), x) - stripEdges.begin()) - 1;
+    return std::clamp(owner, 0, transport.size - 1);
+}
+
+bool DistributedRank::migrate()
+{
+    // the halo of the last substep goes, along with the particles that left the strip
+    const int count = static_cast<int>(particleSystem.particlePosition.size());
+    for (int i = ownedCount; i < count; ++i)
+        particleSystem.removeParticle(i);
+    for (Neighbor &neighbor : neighbors)
+        neighbor.out.clear();
+    for (int i = 0; i < ownedCount && !neighbors.empty(); ++i)
+    {
+        int owner = ownerOf(particleSystem.particlePosition[i].x);
+        if (owner == transport.rank)
+            continue;
+        // a particle that skipped a strip is passed on again by the neighbour next substep
+        Neighbor *target = nullptr;
+        for (Neighbor &neighbor : neighbors)
+        {
+            if (neighbor.rank == owner)
+                target = &neighbor;
+        }
+        if (target == nullptr)
+            target = owner < transport.rank ? &neighbors.front() : &neighbors.back();
+        append(target->out, ParticleRecord{particleSystem.particlePosition[i], particleSystem.predictedPosition(i),
+                                           particleSystem.particleVelocity[i], particleSystem.particleDensity[i], particleSystem.particlePhase[i]});
+        particleSystem.removeParticle(i);
+    }
+    particleSystem.compactParticles();
+
+    if (!exchangeAll())
+        return false;
+
+    for (Neighbor &neighbor : neighbors)
+    {
+        size_t records = neighbor.in.size() / sizeof(ParticleRecord);
+        for (size_t k = 0; k < records; ++k)
+        {
+            ParticleRecord record;
+            std::memcpy(&record, neighbor.in.data() + k * sizeof(ParticleRecord), sizeof(record));
+            particleSystem.addParticle(record.position, record.velocity, record.phase);
+            if (!particleSystem.params.reducedMemory)
+                particleSystem.particlePositionPredicted.back() = record.positionPredicted;
+            particleSystem.particleDensity.back() = record.density;
+        }
+    }
+    ownedCount = static_cast<int>(particleSystem.particlePosition.size());
+    return true;
+}
+
+bool DistributedRank::sendHalo(float timeStep)
+{
+    // a pair across an edge closes in by the move and the prediction of both particles before its
+    // densities are taken, so the band takes the fastest particle on either side of the edge
+    float maxSpeedSquared = 0.0f;
+    for (int i = 0; i < ownedCount; ++i)
+        maxSpeedSquared = std::max(maxSpeedSquared, particleSystem.particleVelocity[i].lengthSquared());
+    const float maxSpeed = std::sqrt(maxSpeedSquared);
+    for (Neighbor &neighbor : neighbors)
+    {
+        neighbor.out.clear();
+        append(neighbor.out, maxSpeed);
+    }
+    if (!exchangeAll())
+        return false;
+    for (Neighbor &neighbor : neighbors)
+    {
+        float neighborSpeed;
+        if (neighbor.in.size() != sizeof(neighborSpeed))
+        {
+            std::cerr << "Rank " << transport.rank << ": no max speed from rank " << neighbor.rank << std::endl;
+            return false;
+        }
+        std::memcpy(&neighborSpeed, neighbor.in.data(), sizeof(neighborSpeed));
+        neighbor.haloWidth = params.densitySampleRadius + 2.0f * (maxSpeed + neighborSpeed) * timeStep;
+    }
+
+    const float left = stripEdges[transport.rank];
+    const float right = stripEdges[transport.rank + 1];
+    Neighbor *leftNeighbor = transport.rank > 0 || params.periodicX ? &neighbors.front() : nullptr;
+    Neighbor *rightNeighbor = transport.rank < transport.size - 1 || params.periodicX ? &neighbors.back() : nullptr;
+    for (Neighbor &neighbor : neighbors)
+    {
+        neighbor.sent.clear();
+        neighbor.out.clear();
+    }
+    for (int i = 0; i < ownedCount && !neighbors.empty(); ++i)
+    {
+        const float x = particleSystem.particlePosition[i].x;
+        ParticleRecord record{particleSystem.particlePosition[i], particleSystem.predictedPosition(i),
+                              particleSystem.particleVelocity[i], particleSystem.particleDensity[i], particleSystem.particlePhase[i]};
+        if (leftNeighbor && x - left < leftNeighbor->haloWidth)
+        {
+            leftNeighbor->sent.push_back(i);
+            append(leftNeighbor->out, record);
+        }
+        if (rightNeighbor && right - x < rightNeighbor->haloWidth)
+        {
+            rightNeighbor->sent.push_back(i);
+            append(rightNeighbor->out, record);
+        }
+    }
+
+    if (!exchangeAll())
+        return false;
+
+    // coordinates stay global, a periodic axis is wrapped by the local neighbour search
+    for (Neighbor &neighbor : neighbors)
+    {
+        neighbor.haloStart = static_cast<int>(particleSystem.particlePosition.size());
+        neighbor.haloCount = static_cast<int>(neighbor.in.size() / sizeof(ParticleRecord));
+        for (int k = 0; k < neighbor.haloCount; ++k)
+        {
+            ParticleRecord record;
+            std::memcpy(&record, neighbor.in.data() + k * sizeof(ParticleRecord), sizeof(record));
+            particleSystem.addParticle(record.position, record.velocity, record.phase);
+            if (!particleSystem.params.reducedMemory)
+                particleSystem.particlePositionPredicted.back() = record.positionPredicted;
+            particleSystem.particleDensity.back() = record.density;
+        }
+    }
+    return true;
+}
+
+bool DistributedRank::refreshHalo(TelemetryPhase phase)
+{
+    // the halo particles lack neighbours on the far side, so their own results are replaced by the owner's
+    for (Neighbor &neighbor : neighbors)
+    {
+        neighbor.out.clear();
+        for (int index : neighbor.sent)
+        {
+            if (phase == PhaseDensity)
+                append(neighbor.out, particleSystem.particleDensity[index]);
+            else
+                append(neighbor.out, particleSystem.particleVelocity[index]);
+        }
+    }
+    if (!exchangeAll())
+        return false;
+    for (Neighbor &neighbor : neighbors)
+    {
+        size_t elementSize = phase == PhaseDensity ? sizeof(float) : sizeof(Vector2f);
+        if (neighbor.in.size() != neighbor.haloCount * elementSize)
+        {
+            std::cerr << "Rank " << transport.rank << ": halo from rank " << neighbor.rank << " changed size" << std::endl;
+            return false;
+        }
+        char *target = phase == PhaseDensity ? reinterpret_cast<char *>(&particleSystem.particleDensity[neighbor.haloStart])
+                                             : reinterpret_cast<char *>(&particleSystem.particleVelocity[neighbor.haloStart]);
+        if (neighbor.haloCount > 0)
+            std::memcpy(target, neighbor.in.data(), neighbor.in.size());
+    }
+    return true;
+}
+
+bool DistributedRank::exchangeAll()
+{
+    // in ascending peer order on every rank, which orders all the pairs the same way everywhere.
+    // going left then right would make a cycle of ranks each waiting for the next on a periodic axis
+    auto start = std::chrono::steady_clock::now();
+    for (int index : exchangeOrder)
+    {
+        Neighbor &neighbor = neighbors[index];
+        if (!transport.exchange(neighbor.rank, neighbor.out, neighbor.in))
+            return false;
+    }
+    exchangeSeconds += secondsSince(start);
+    return true;
+}
+
+bool DistributedRank::run(const DistributedOptions &options)
+{
+    // the ranks share the machine's cores instead of each starting a thread per core
+    omp_set_num_threads(std::max(1, omp_get_num_procs() / transport.size));
+    initialize();
+    if (!transport.barrier())
+        return false;
+
+    const float timeStep = Headless::getTimeStep(params);
+    double haloSum = 0.0;
+    int substeps = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int step = 0; step < options.steps; ++step)
+    {
+        for (int i = 0; i < params.stepCount; ++i)
+        {
+            if (!migrate() || !sendHalo(timeStep))
+                return false;
+            particleSystem.updateParticles(timeStep);
+            if (transportFailed)
+                return false;
+            haloSum += particleSystem.particlePosition.size() - ownedCount;
+            substeps++;
+        }
+    }
+
+    RankResult result;
+    result.stepSeconds = secondsSince(start);
+    result.exchangeSeconds = exchangeSeconds;
+    result.ownedParticles = ownedCount;
+    result.meanHaloParticles = substeps > 0 ? static_cast<float>(haloSum / substeps) : 0.0f;
+    result.bytesSent = transport.bytesSent;
+    return report(options, result);
+}
+
+bool DistributedRank::report(const DistributedOptions &options, const RankResult &result)
+{
+    if (transport.rank != 0)
+    {
+        std::vector<char> bytes;
+        append(bytes, result);
+        return transport.send(0, bytes);
+    }
+
+    std::vector<RankResult> results(transport.size);
+    results[0] = result;
+    for (int peer = 1; peer < transport.size; ++peer)
+    {
+        std::vector<char> bytes;
+        if (!transport.receive(peer, bytes) || bytes.size() != sizeof(RankResult))
+            return false;
+        std::memcpy(&results[peer], bytes.data(), sizeof(RankResult));
+    }
+
+    // the slowest rank sets the pace, everyone waits for it at every exchange
+    int particles = 0;
+    double seconds = 0.0, exchange = 0.0, halo = 0.0;
+    uint64_t bytes = 0;
+    for (int r = 0; r < transport.size; ++r)
+    {
+        const RankResult &rr = results[r];
+        std::cout << "rank " << r << ": " << rr.ownedParticles << " particles, " << rr.meanHaloParticles << " halo, "
+                  << rr.stepSeconds << " s, " << rr.exchangeSeconds << " s exchanging" << std::endl;
+        particles += rr.ownedParticles;
+        seconds = std::max(seconds, rr.stepSeconds);
+        exchange += rr.exchangeSeconds / transport.size;
+        halo += rr.meanHaloParticles;
+        bytes += rr.bytesSent;
+    }
+    int substeps = options.steps * params.stepCount;
+    double substepsPerSecond = seconds > 0.0 ? substeps / seconds : 0.0;
+    std::cout << transport.size << " ranks over " << options.transport << ": " << particles << " particles, "
+              << substepsPerSecond << " substeps/s" << std::endl;
+    if (particles != params.particleCount)
+        std::cerr << "Particle count changed from " << params.particleCount << " to " << particles << std::endl;
+
+    bool writeHeader = !std::ifstream(options.outputPath).good();
+    std::ofstream out(options.outputPath, std::ios::app);
+    if (!out)
+    {
+        std::cerr << "Failed to open " << options.outputPath << std::endl;
+        return false;
+    }
+    if (writeHeader)
+        out << "ranks,transport,particles,substeps,seconds,substeps_per_second,exchange_fraction,halo_particles,bytes_per_substep\n";
+    out << transport.size << ',' << options.transport << ',' << particles << ',' << substeps << ',' << seconds << ','
+        << substepsPerSecond << ',' << (seconds > 0.0 ? exchange / seconds : 0.0) << ',' << halo << ','
+        << (substeps > 0 ? bytes / substeps : 0) << '\n';
+    return true;
+}
+
+int runDistributedRank(const Parameters &params, const DistributedOptions &options)
+{
+    std::unique_ptr<Transport> transport;
+    if (options.transport == "tcp")
+    {
+        auto tcp = std::make_unique<TcpTransport>();
+        if (!tcp->open(options.basePort, options.rank, options.ranks))
+            return 1;
+        transport = std::move(tcp);
+    }
+    else if (options.transport == "shm")
+    {
+        auto shm = std::make_unique<SharedMemoryTransport>();
+        if (!shm->open(options.session, options.rank, options.ranks))
+            return 1;
+        transport = std::move(shm);
+    }
+    else
+    {
+        std::cerr << "Unknown transport " << options.transport << std::endl;
+        return 1;
+    }
+    DistributedRank rank(params, *transport);
+    return rank.run(options) ? 0 : 1;
+}
+
+namespace
+{
+#ifdef _WIN32
+    using Process = HANDLE;
+#else
+    using Process = pid_t;
+#endif
+
+    bool spawnProcess(const std::vector<std::string> &arguments, Process &process)
+    {
+#ifdef _WIN32
+        char path[MAX_PATH];
+        GetModuleFileNameA(NULL, path, MAX_PATH);
+        std::string commandLine = std::string("\"") + path + "\"";
+        for (const std::string &argument : arguments)
+            commandLine += " \"" + argument + "\"";
+        STARTUPINFOA startup{};
+        startup.cb = sizeof(startup);
+        PROCESS_INFORMATION info{};
+        if (!CreateProcessA(path, commandLine.data(), NULL, NULL, FALSE, 0, NULL, NULL, &startup, &info))
+            return false;
+        CloseHandle(info.hThread);
+        process = info.hProcess;
+        return true;
+#else
+        std::string path = "/proc/self/exe";
+        std::vector<char *> argv;
+        argv.push_back(path.data());
+        std::vector<std::string> copies = arguments;
+        for (std::string &argument : copies)
+            argv.push_back(argument.data());
+        argv.push_back(nullptr);
+        return posix_spawn(&process, path.c_str(), nullptr, nullptr, argv.data(), environ) == 0;
+#endif
+    }
+
+    int waitProcess(Process process)
+    {
+#ifdef _WIN32
+        WaitForSingleObject(process, INFINITE);
+        DWORD code = 1;
+        GetExitCodeProcess(process, &code);
+        CloseHandle(process);
+        return static_cast<int>(code);
+#else
+        int status = 0;
+        if (waitpid(process, &status, 0) < 0)
+            return 1;
+        return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+#endif
+    }
+
+    int currentProcessId()
+    {
+#ifdef _WIN32
+        return static_cast<int>(GetCurrentProcessId());
+#else
+        return static_cast<int>(getpid());
+#endif
+    }
+}
+
+int DistributedLauncher::launch(const DistributedOptions &options)
+{
+    // a fresh session name and port range per run, so leftovers of an earlier run cannot interfere
+    std::string session = "fluid_" + std::to_string(currentProcessId()) + "_" + std::to_string(runIndex);
+    unsigned short basePort = static_cast<unsigned short>(options.basePort + runIndex * 16);
+    runIndex++;
+    SharedMemoryTransport::remove(session);
+
+    std::vector<Process> processes;
+    bool failed = false;
+    for (int rank = 0; rank < options.ranks; ++rank)
+    {
+        std::vector<std::string> childArguments = arguments;
+        for (const std::string &argument : {std::string("--ranks"), std::to_string(options.ranks),
+                                            std::string("--rank"), std::to_string(rank),
+                                            std::string("--transport"), options.transport,
+                                            std::string("--session"), session,
+                                            std::string("--port"), std::to_string(basePort),
+                                            std::string("--steps"), std::to_string(options.steps),
+                                            std::string("--distributed-out"), options.outputPath})
+            childArguments.push_back(argument);
+        Process process;
+        if (!spawnProcess(childArguments, process))
+        {
+            std::cerr << "Failed to start rank " << rank << std::endl;
+            failed = true;
+            break;
+        }
+        processes.push_back(process);
+    }
+    // a rank that failed to start leaves the others to time out in the transport
+    for (Process process : processes)
+        failed |= waitProcess(process) != 0;
+    SharedMemoryTransport::remove(session);
+    return failed ? 1 : 0;
+}
+
+int DistributedLauncher::benchmark(DistributedOptions options, int maxRanks)
+{
+    // the same scene on 1 to maxRanks ranks, the speedup is against the single rank run
+    struct Row
+    {
+        int ranks;
+        double substepsPerSecond;
+        double exchangeFraction;
+    };
+    std::vector<Row> rows;
+    for (int ranks = 1; ranks <= maxRanks; ++ranks)
+    {
+        options.ranks = ranks;
+        if (launch(options) != 0)
+        {
+            std::cerr << "Run with " << ranks << " ranks failed" << std::endl;
+            return 1;
+        }
+        // rank 0 appended its row last
+        std::ifstream in(options.outputPath);
+        std::string line, last;
+        while (std::getline(in, line))
+        {
+            if (!line.empty())
+                last = line;
+        }
+        std::vector<std::string> fields;
+        std::stringstream stream(last);
+        for (std::string field; std::getline(stream, field, ',');)
+            fields.push_back(field);
+        if (fields.size() < 7)
+            return 1;
+        rows.push_back({ranks, std::stod(fields[5]), std::stod(fields[6])});
+    }
+
+    std::cout << "ranks  substeps/s  speedup  efficiency  exchange" << std::endl;
+    for (const Row &row : rows)
+    {
+        double speedup = rows[0].substepsPerSecond > 0.0 ? row.substepsPerSecond / rows[0].substepsPerSecond : 0.0;
+        char text[128];
+        std::snprintf(text, sizeof(text), "%5d  %10.1f  %7.2f  %9.0f%%  %7.0f%%", row.ranks, row.substepsPerSecond, speedup,
+                      speedup / row.ranks * 100.0, row.exchangeFraction * 100.0);
+        std::cout << text << std::endl;
+    }
+    return 0;
+}
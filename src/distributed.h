@@ -0,0 +1,83 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "particle_system.h"
+#include "transport.h"
+
+struct DistributedOptions
+{
+    int ranks = 1;
+    int rank = -1;                 // -1 in the launcher, which starts one process per rank
+    std::string transport = "shm"; // shm or tcp
+    std::string session;           // shared memory name, handed to the ranks by the launcher
+    unsigned short basePort = 47000;
+    int steps = 300;
+    std::string outputPath = "distributed_scaling.csv"; // rank 0 appends one row per run
+};
+
+struct RankResult
+{
+    int ownedParticles = 0;
+    float meanHaloParticles = 0.0f;
+    double stepSeconds = 0.0;     // the whole substep loop
+    double exchangeSeconds = 0.0; // of which spent in the transport
+    uint64_t bytesSent = 0;
+};
+
+class DistributedRank
+{
+    // one vertical strip of the domain in its own process. every substep the particles that left
+    // the strip migrate to the neighbour that owns them, then the ones that can come within a sample
+    // radius of the neighbour's particles during the step are copied to it as halo particles. the halo densities and velocities are refreshed
+    // from their owners in the middle of the step through phaseHook, so the owned particles see the
+    // same neighbours as in a single process
+public:
+    DistributedRank(const Parameters &params, Transport &transport);
+    bool run(const DistributedOptions &options);
+
+    ParticleSystem particleSystem;
+    Parameters &params;
+    Transport &transport;
+    std::vector<float> stripEdges; // rank r owns x in [stripEdges[r], stripEdges[r + 1])
+    int ownedCount = 0;            // the owned particles come first, the halo follows them
+
+private:
+    struct Neighbor
+    {
+        int rank = -1;
+        std::vector<int> sent; // owned indices copied to the neighbour's halo, in message order
+        int haloStart = 0;     // where the neighbour's copies sit in our arrays
+        int haloCount = 0;
+        float haloWidth = 0.0f; // of the band of owned particles copied to the neighbour
+        std::vector<char> out;
+        std::vector<char> in;
+    };
+    std::vector<Neighbor> neighbors; // left then right, either may be missing at a wall
+    std::vector<int> exchangeOrder;  // indices into neighbors
+    bool transportFailed = false;
+    double exchangeSeconds = 0.0;
+
+    void initialize();
+    int ownerOf(float x) const;
+    bool migrate();
+    bool sendHalo(float timeStep);
+    bool refreshHalo(TelemetryPhase phase);
+    bool exchangeAll();
+    bool report(const DistributedOptions &options, const RankResult &result);
+};
+
+class DistributedLauncher
+{
+    // starts the ranks as child processes of this executable and waits for them. the children
+    // get the launcher's own arguments plus their rank, so they share its parameters
+public:
+    explicit DistributedLauncher(std::vector<std::string> arguments) : arguments(std::move(arguments)) {}
+    int launch(const DistributedOptions &options);
+    int benchmark(DistributedOptions options, int maxRanks);
+
+private:
+    std::vector<std::string> arguments; // without the executable and the distributed options
+    int runIndex = 0;
+};
+
+int runDistributedRank(const Parameters &params, const DistributedOptions &options);
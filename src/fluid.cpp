@@ -14,6 +14,7 @@ void Main::run()
     initialize();
     while (window.isOpen())
     {
+        uint64_t allocations = AllocationCounter::count();
         processEvents();
         debugClock.restart();
         if (!paused)
@@ -24,11 +25,11 @@ void Main::run()
         float frameTime = updateTime + renderTime;
         currentFps = 1000.f / (frameTime);
 
-        frameTimesHistory.push(frameTime);
-        if (frameTimesHistory.size() > 120)
-            frameTimesHistory.pop();
+        frameTimesHistory[frameCount % frameTimesHistory.size()] = frameTime;
 
         frameCount++;
+        frameArena.reset();
+        frameAllocations = AllocationCounter::count() - allocations;
     }
 }
 
@@ -46,85 +47,145 @@ void Main::initialize()
     // get OpnGL version
     std::cout << "OpenGL version: " << glGetString(GL_VERSION) << std::endl;
     particleBuffer = sf::RenderTexture({params.windowWidth, params.windowHeight});
-    postBuffer = sf::RenderTexture({params.windowWidth, params.windowHeight});
-    densityBuffer = sf::RenderTexture({params.windowWidth, params.windowHeight});
-    densityBuffer2 = sf::RenderTexture({params.windowWidth, params.windowHeight});
-    backgroundBuffer = sf::RenderTexture({params.windowWidth, params.windowHeight});
+    // ring of density frames, the slot at densityBufferIndex is the current one
+    densityBuffers.clear();
+    densityBuffers.reserve(std::max(params.densityHistorySize, 2));
+    for (int i = 0; i < std::max(params.densityHistorySize, 2); ++i)
+        densityBuffers.emplace_back(sf::Vector2u{params.windowWidth, params.windowHeight});
+    backgroundLayer = layerCache.addLayer({params.windowWidth, params.windowHeight}, [this](sf::RenderTarget &target)
+                                          { paintBackground(target); });
     window.setFramerateLimit(params.targetFps);
 
+    // route ImGui through operator new so the allocation counter sees it too
+    ImGui::SetAllocatorFunctions([](size_t size, void *)
+                                 { return ::operator new(size); },
+                                 [](void *p, void *)
+                                 { ::operator delete(p); });
     ImGui::SFML::Init(window);
     ImGui::GetIO().IniFilename = nullptr; // disable saving .ini file
     ImGui::GetIO().LogFilename = nullptr; // disable logging to file
 
+    params.particleCount = MemoryBudget::estimate(params).fit(params.particleCount);
     particleSystem.initParticles(params.particleCount);
     particleTexture.loadFromFile("assets/textures/particle.png");
     densityTexture.loadFromFile("assets/textures/density.png");
     densityTexture.setSmooth(true);
 
     particleSystem.particleRadius = particleTexture.getSize().x / 2.0f;
+    if (!obstaclePath.empty())
+        particleSystem.obstacles.loadImage(obstaclePath);
+    if (loadCheckpointOnStart)
+        loadCheckpoint();
+    if (playOnStart)
+        openPlayback();
+    if (metricsPort != 0 && !metrics.start(metricsPort))
+        std::cerr << "Continuing without the metrics server" << std::endl;
     densityShader.loadFromFile("assets/shaders/density.frag", sf::Shader::Type::Fragment);
 
+    densityField.resize({params.windowWidth, params.windowHeight}, params.densityFieldCellSize);
     rebuildGrid();
+    mouseCircle.setOutlineColor(sf::Color::Green);
+    mouseCircle.setOutlineThickness(1.0f);
+    mouseCircle.setFillColor(sf::Color(24, 140, 24, 48));
+    neighborMarker.setFillColor(sf::Color(255, 255, 255, 128));
+    sourceMarker.setFillColor(sf::Color::Transparent);
+    sourceMarker.setOutlineThickness(1.5f);
     timer.start();
 }
 
 void Main::update()
 {
+    if (player.isOpen())
+    {
+        updatePlayback();
+        return;
+    }
     for (int step = 0; step < params.stepCount; ++step)
     {
-        particleSystem.updateParticles(params.timeScale * (renderTime + updateTime) / 100.0f / params.stepCount);
+        float timeStep = params.timeScale * (renderTime + updateTime) / 100.0f / params.stepCount;
+        if (params.enableWatchdog)
+            watchdog.step(particleSystem, timeStep);
+        else
+            particleSystem.updateParticles(timeStep);
+        metrics.publish(particleSystem, &watchdog);
     }
+    if (gridDivisions != particleSystem.cellDivisions)
+        rebuildGrid();
+    // emitters and sinks change the count, keep the slider on the real one
+    if (!particleSystem.emitters.empty() || !particleSystem.sinks.empty())
+        params.particleCount = static_cast<int>(particleSystem.particlePosition.size());
+    if (recorder.isRecording())
+        recorder.recordFrame(particleSystem);
+}
+
+void Main::resetParticles()
+{
+    particleSystem.initParticles(params.particleCount);
+    watchdog.reset();
 }
 
 void Main::render()
 {
     ImGui::SFML::Update(window, deltaClock.restart());
+    if (!paused)
+        densityBufferIndex = (densityBufferIndex + 1) % densityBuffers.size();
     particleBuffer.clear(sf::Color::Transparent);
-    densityBuffer.clear(sf::Color::Transparent);
+    densityBuffer().clear(sf::Color::Transparent);
     renderParticles();
-    particleBuffer.display();
-    densityBuffer.display();
-
-    backgroundBuffer.clear(params.backgroundColor);
-    postBuffer.clear(sf::Color::Transparent);
     if (params.debugMode)
-        debugEffects();
-    postEffects();
-    backgroundBuffer.display();
-    postBuffer.display();
+        visualizeNeighbors();
+    particleBuffer.display();
+    densityBuffer().display();
+    layerCache.update();
 
     window.resetGLStates();
     showGui();
-    window.clear();
-    window.draw(sf::Sprite(postBuffer.getTexture()));
+    // the composite pass covers the whole window, so no clear is needed
+    postEffects();
+    if (params.showContour)
+    {
+        densityField.update(particleSystem, params.targetDensity);
+        window.draw(densityField.getMesh());
+    }
+    drawObstacles();
+    drawBodies();
+    drawSources();
+    if (params.debugMode)
+        debugEffects();
     ImGui::SFML::Render(window);
     window.display();
 }
 
 void Main::renderParticles()
 {
-    particleVertices.clear();
-    densityVertices.clear();
+    // the arrays are resized in place instead of appended to, so they keep their storage between frames
+    size_t count = particleSystem.particlePosition.size();
+    densityVertices.resize(count * 6);
+    particleVertices.resize(params.showParticles ? count * 6 : 0);
 
-    for (size_t i = 0; i < particleSystem.particlePosition.size(); ++i)
+    const bool multiphase = params.phaseCount > 1;
+    for (size_t i = 0; i < count; ++i)
     {
 
         Vector2f &p = particleSystem.particlePosition[i];
         int s = params.densitySampleRadius;
         float d = densityTexture.getSize().x;
-        sf::Color dColor = sf::Color::White;
-        densityVertices.append(sf::Vertex{p + Vector2f(-s, -s), dColor, Vector2f(0, 0)});
-        densityVertices.append(sf::Vertex{p + Vector2f(s, -s), dColor, Vector2f(d, 0)});
-        densityVertices.append(sf::Vertex{p + Vector2f(-s, s), dColor, Vector2f(0, d)});
-        densityVertices.append(sf::Vertex{p + Vector2f(s, -s), dColor, Vector2f(d, 0)});
-        densityVertices.append(sf::Vertex{p + Vector2f(s, s), dColor, Vector2f(d, d)});
-        densityVertices.append(sf::Vertex{p + Vector2f(-s, s), dColor, Vector2f(0, d)});
+        // green carries the phase weighted by density, the shader divides it by red to find the mix
+        const int phase = multiphase ? particleSystem.particlePhase[i] : 0;
+        sf::Color dColor = multiphase ? sf::Color(255, phase * 255 / (Parameters::maxPhases - 1), 255) : sf::Color::White;
+        sf::Vertex *density = &densityVertices[i * 6];
+        density[0] = sf::Vertex{p + Vector2f(-s, -s), dColor, Vector2f(0, 0)};
+        density[1] = sf::Vertex{p + Vector2f(s, -s), dColor, Vector2f(d, 0)};
+        density[2] = sf::Vertex{p + Vector2f(-s, s), dColor, Vector2f(0, d)};
+        density[3] = sf::Vertex{p + Vector2f(s, -s), dColor, Vector2f(d, 0)};
+        density[4] = sf::Vertex{p + Vector2f(s, s), dColor, Vector2f(d, d)};
+        density[5] = sf::Vertex{p + Vector2f(-s, s), dColor, Vector2f(0, d)};
 
         if (!params.showParticles)
             continue;
 
         sf::Color pColor = lerpColor(
-            sf::Color::Cyan,
+            multiphase ? params.phases[phase].tint : sf::Color::Cyan,
             sf::Color::Red,
             std::atan(particleSystem.particleVelocity[i].length() / 20.0f) * 2 / 3.14159f);
         if (params.debugMode)
@@ -139,18 +200,19 @@ void Main::renderParticles()
             }
         }
         s = particleTexture.getSize().x / 2;
-        particleVertices.append(sf::Vertex{p + Vector2f(-s, -s), pColor, Vector2f(0, 0)});
-        particleVertices.append(sf::Vertex{p + Vector2f(s, -s), pColor, Vector2f(2 * s, 0)});
-        particleVertices.append(sf::Vertex{p + Vector2f(-s, s), pColor, Vector2f(0, 2 * s)});
-        particleVertices.append(sf::Vertex{p + Vector2f(s, -s), pColor, Vector2f(2 * s, 0)});
-        particleVertices.append(sf::Vertex{p + Vector2f(s, s), pColor, Vector2f(2 * s, 2 * s)});
-        particleVertices.append(sf::Vertex{p + Vector2f(-s, s), pColor, Vector2f(0, 2 * s)});
+        sf::Vertex *particle = &particleVertices[i * 6];
+        particle[0] = sf::Vertex{p + Vector2f(-s, -s), pColor, Vector2f(0, 0)};
+        particle[1] = sf::Vertex{p + Vector2f(s, -s), pColor, Vector2f(2 * s, 0)};
+        particle[2] = sf::Vertex{p + Vector2f(-s, s), pColor, Vector2f(0, 2 * s)};
+        particle[3] = sf::Vertex{p + Vector2f(s, -s), pColor, Vector2f(2 * s, 0)};
+        particle[4] = sf::Vertex{p + Vector2f(s, s), pColor, Vector2f(2 * s, 2 * s)};
+        particle[5] = sf::Vertex{p + Vector2f(-s, s), pColor, Vector2f(0, 2 * s)};
     }
 
     sf::RenderStates states;
     states.blendMode = sf::BlendAdd;
     states.texture = &densityTexture;
-    densityBuffer.draw(densityVertices, states);
+    densityBuffer().draw(densityVertices, states);
 
     states.texture = &particleTexture;
     states.blendMode = sf::BlendAlpha;
@@ -160,66 +222,133 @@ void Main::renderParticles()
 
 void Main::postEffects()
 {
-    // layers:
-    // 0. background (grid)
-    // 1. density (densityBuffer) using densityShader
+    // single composite pass over the cached layers:
+    // 0. background (grid), cached in layerCache
+    // 1. density (densityBuffer) shaded as liquid
     // 2. particles (particleBuffer)
 
+    // while paused the frame is redrawn in place, so compare it with itself
+    sf::RenderTexture &previousDensity = densityBuffer(paused ? 0 : 1);
+    densityShader.setUniform("u_targetDensity", params.targetDensity);
+    densityShader.setUniform("u_sampleRadius", params.densitySampleRadius);
+    densityShader.setUniform("u_texture", densityBuffer().getTexture());
+    densityShader.setUniform("u_bgtexture", layerCache.getTexture(backgroundLayer));
+    densityShader.setUniform("u_texture2", previousDensity.getTexture());
+    densityShader.setUniform("u_particles", particleBuffer.getTexture());
+    densityShader.setUniform("u_showDensity", params.showDensity);
+    densityShader.setUniform("u_showParticles", params.showParticles);
+    densityShader.setUniform("u_solution", Vector2f(params.windowWidth, params.windowHeight));
+    sf::Glsl::Vec4 phaseTints[Parameters::maxPhases];
+    for (int i = 0; i < Parameters::maxPhases; ++i)
+        phaseTints[i] = sf::Glsl::Vec4(params.phases[i].tint);
+    densityShader.setUniformArray("u_phaseTints", phaseTints, Parameters::maxPhases);
+    densityShader.setUniform("u_phaseCount", params.phaseCount);
+    densityShader.setUniform("u_time", timer.getElapsedTime().asSeconds());
+
+    sf::RenderStates states;
+    states.blendMode = sf::BlendNone;
+    states.shader = &densityShader;
+    window.draw(sf::Sprite(layerCache.getTexture(backgroundLayer)), states);
+}
+
+void Main::paintBackground(sf::RenderTarget &target)
+{
+    target.clear(params.backgroundColor);
     if (params.showGrid)
-        backgroundBuffer.draw(gridVertices);
+        target.draw(gridVertices);
+}
 
-    sf::Sprite backgroundSprite(backgroundBuffer.getTexture());
-    postBuffer.draw(backgroundSprite);
+void Main::debugEffects()
+{
+    if (mouseCircle.getRadius() != params.densitySampleRadius)
+        mouseCircle.setRadius(params.densitySampleRadius);
+    Vector2i mousePos = sf::Mouse::getPosition(window);
+    mouseCircle.setPosition(Vector2f(mousePos) - Vector2f(params.densitySampleRadius, params.densitySampleRadius));
+    window.draw(mouseCircle);
+}
 
-    if (params.showDensity)
+void Main::drawObstacles()
+{
+    if (!particleSystem.obstacles.hasSolid())
+        return;
+    // the texture is one pixel per grid node, smoothing makes the stretched edges soft
+    particleSystem.prepareObstacles();
+    const ObstacleField &obstacles = particleSystem.obstacles;
+    if (obstacles.version != obstacleTextureVersion)
     {
-        sf::Sprite densitySprite(densityBuffer.getTexture());
-        densityShader.setUniform("u_targetDensity", params.targetDensity);
-        densityShader.setUniform("u_sampleRadius", params.densitySampleRadius);
-        densityShader.setUniform("u_texture", sf::Shader::CurrentTexture);
-        densityShader.setUniform("u_bgtexture", backgroundBuffer.getTexture());
-        densityShader.setUniform("u_texture2", densityBuffer2.getTexture());
-        densityShader.setUniform("u_solution", Vector2f(params.windowWidth, params.windowHeight));
-        densityShader.setUniform("u_time", timer.getElapsedTime().asSeconds());
-        postBuffer.draw(densitySprite, &densityShader);
-        if (!paused)
-        {
-            densityBuffer2.clear(sf::Color::Transparent);
-            densityBuffer2.draw(densitySprite);
-            densityBuffer2.display();
-        }
+        (void)obstacleTexture.loadFromImage(obstacles.toImage(params.backgroundColor * 5));
+        obstacleTexture.setSmooth(true);
+        obstacleTextureVersion = obstacles.version;
     }
+    sf::Sprite sprite(obstacleTexture);
+    sprite.setScale({obstacles.cellSize, obstacles.cellSize});
+    sprite.setPosition({-obstacles.cellSize * 0.5f, -obstacles.cellSize * 0.5f});
+    window.draw(sprite);
+}
 
-    if (params.showParticles)
+void Main::drawBodies()
+{
+    // a triangle fan per body, circles are drawn as 24-gons
+    constexpr int circleSegments = 24;
+    size_t triangles = 0;
+    for (const RigidBody &body : particleSystem.rigidBodies.bodies)
+        triangles += body.shape == BodyShape::Circle ? circleSegments : body.vertices.size();
+    bodyVertices.resize(triangles * 3);
+    size_t v = 0;
+    const sf::Color fill(230, 190, 120);
+    const sf::Color rim(150, 105, 50);
+    for (const RigidBody &body : particleSystem.rigidBodies.bodies)
     {
-        sf::Sprite particleSprite(particleBuffer.getTexture());
-        postBuffer.draw(particleSprite);
+        size_t corners = body.shape == BodyShape::Circle ? circleSegments : body.vertices.size();
+        for (size_t i = 0; i < corners; ++i)
+        {
+            Vector2f a, b;
+            if (body.shape == BodyShape::Circle)
+            {
+                float step = 2.0f * 3.14159f / circleSegments;
+                a = body.toWorld(Vector2f(std::cos(i * step), std::sin(i * step)) * body.radius);
+                b = body.toWorld(Vector2f(std::cos((i + 1) * step), std::sin((i + 1) * step)) * body.radius);
+            }
+            else
+            {
+                a = body.toWorld(body.vertices[i]);
+                b = body.toWorld(body.vertices[(i + 1) % corners]);
+            }
+            // the first segment of a circle is darker so the rotation shows
+            bodyVertices[v++] = sf::Vertex{body.position, i == 0 && body.shape == BodyShape::Circle ? rim : fill};
+            bodyVertices[v++] = sf::Vertex{a, rim};
+            bodyVertices[v++] = sf::Vertex{b, rim};
+        }
     }
+    window.draw(bodyVertices);
 }
 
-void Main::debugEffects()
+void Main::drawSources()
 {
-    sf::CircleShape mouseCircle(params.densitySampleRadius);
-    mouseCircle.setOutlineColor(sf::Color::Green);
-    mouseCircle.setOutlineThickness(1.0f);
-    mouseCircle.setFillColor(sf::Color(24, 140, 24, 48));
-    Vector2i mousePos = sf::Mouse::getPosition(window);
-    mouseCircle.setPosition(Vector2f(mousePos) - Vector2f(params.densitySampleRadius, params.densitySampleRadius));
-    postBuffer.draw(mouseCircle);
-
-    visualizeNeighbors();
+    sourceMarker.setOutlineColor(sf::Color(80, 220, 255));
+    for (const Emitter &emitter : particleSystem.emitters)
+    {
+        sourceMarker.setRadius(emitter.spread);
+        sourceMarker.setPosition(emitter.position - Vector2f(emitter.spread, emitter.spread));
+        window.draw(sourceMarker);
+    }
+    sourceMarker.setOutlineColor(sf::Color(255, 90, 90));
+    for (const Sink &sink : particleSystem.sinks)
+    {
+        sourceMarker.setRadius(sink.radius);
+        sourceMarker.setPosition(sink.position - Vector2f(sink.radius, sink.radius));
+        window.draw(sourceMarker);
+    }
 }
 
 void Main::visualizeNeighbors()
 {
-    auto neighbors = particleSystem.getParticlesWithRadius(mousePosition);
+    auto neighbors = particleSystem.getParticlesWithRadius(mousePosition, &frameArena);
     neighborCount = neighbors.size();
     for (int particleIndex : neighbors)
     {
-        sf::CircleShape circle(10);
-        circle.setPosition(particleSystem.particlePosition[particleIndex] - Vector2f(10, 10));
-        circle.setFillColor(sf::Color(255, 255, 255, 128));
-        particleBuffer.draw(circle);
+        neighborMarker.setPosition(particleSystem.particlePosition[particleIndex] - Vector2f(10, 10));
+        particleBuffer.draw(neighborMarker);
     }
 }
 
@@ -238,9 +367,29 @@ void Main::showGui()
         ImGui::Text("Mouse Position: (%.1f, %.1f )", mousePosition.x, mousePosition.y);
         ImGui::Text("Mouse Density: %.4f", particleSystem.getDensityAt(mousePosition));
         ImGui::Text("Neighbor Count: %d", neighborCount);
+        ImGui::Text("Sleeping particles: %d", particleSystem.stepStats.sleepingParticles);
+        if (!particleSystem.taskGraph.empty())
+            ImGui::Text("Task graph: %d tasks, %.0f%% busy on %d threads", particleSystem.taskGraph.taskCount(),
+                        particleSystem.taskGraph.utilization() * 100.0f, particleSystem.taskGraph.threadCount);
+        ImGui::Text("Load imbalance: %.2f measured, %.2f estimated", particleSystem.telemetry.last.loadImbalance,
+                    particleSystem.telemetry.last.partitionImbalance);
+        if (!particleSystem.particlePosition.empty())
+            ImGui::Text("Particle memory: %.1f MB, %zu bytes per particle", particleSystem.reservedBytes() / 1048576.0,
+                        particleSystem.reservedBytes() / particleSystem.particlePosition.size());
+        ImGui::Text("Heap allocations: %llu last frame, arena %zu / %zu KB", (unsigned long long)frameAllocations,
+                    frameArena.highWater / 1024, frameArena.capacity() / 1024);
+        ImGui::Text("Watchdog: dt x%.3f, %d rollbacks", watchdog.timeStepScale, watchdog.rollbackCount);
+        if (watchdog.lastReason[0])
+            ImGui::Text("Last rollback: %s", watchdog.lastReason);
+        if (params.showContour)
+            ImGui::Text("Contour Tiles: %zu sampled, %zu dirty", densityField.staleTileCount, densityField.dirtyTileCount);
         ImGui::Checkbox("Show Frame Time", &params.showFrameTime);
+        ImGui::Checkbox("Show Telemetry", &params.showTelemetry);
     }
-    ImGui::SliderInt("Particle Count", &params.particleCount, 64, 4096);
+    // up to what the memory budget holds, the particles past the capacity are reserved when added
+    const int maxParticleCount = std::clamp(MemoryBudget::estimate(params).maxParticles(), 64, 1 << 24);
+    if (ImGui::SliderInt("Particle Count", &params.particleCount, 64, maxParticleCount, "%d", ImGuiSliderFlags_Logarithmic))
+        particleSystem.setParticleCount(params.particleCount);
     ImGui::SliderFloat("Time Scale", &params.timeScale, 0.1f, 2.0f);
     ImGui::SliderInt("Step Count", &params.stepCount, 1, 6);
     ImGui::SliderFloat("Target Density", &params.targetDensity, 0.1f, 1.0f);
@@ -260,6 +409,14 @@ void Main::showGui()
     }
     ImGui::Checkbox("Enable Gravity", &params.enableGravity);
     ImGui::Checkbox("Enable Adjusting Force", &params.enableAdjustingForce);
+    ImGui::Checkbox("Enable Watchdog", &params.enableWatchdog);
+    ImGui::Checkbox("Enable Sleeping", &params.enableSleeping);
+    ImGui::Checkbox("Enable Task Graph", &params.enableTaskGraph);
+    ImGui::Combo("Work Balance", &params.workBalance, "Index\0Particles\0Pairs\0");
+    ImGui::Combo("Cell Divisions", &params.cellDivisions, "Auto\0" "1\0" "2\0" "3\0");
+    ImGui::Checkbox("Enable Tiling", &params.enableTiling);
+    if (ImGui::Checkbox("Reduced Memory", &params.reducedMemory))
+        particleSystem.applyMemoryMode();
 
     static float color[3] = {params.backgroundColor.r / 255.0f, params.backgroundColor.g / 255.0f, params.backgroundColor.b / 255.0f};
     if (ImGui::ColorEdit3("Background Color", color))
@@ -274,33 +431,165 @@ void Main::showGui()
         if (ImGui::Checkbox("Show Grid", &params.showGrid))
             rebuildGrid();
         ImGui::Checkbox("Show Liquid Effects", &params.showDensity);
+        ImGui::Checkbox("Show Surface Contour", &params.showContour);
+        ImGui::TreePop();
+    }
+
+    if (ImGui::TreeNode("Obstacles"))
+    {
+        ImGui::Text("%zu shapes (O places a circle)", particleSystem.obstacles.shapes.size());
+        ImGui::SliderFloat("Obstacle Radius", &params.obstacleRadius, 10.0f, 150.0f);
+        ImGui::Checkbox("Boundary Density", &params.enableBoundaryDensity);
+        ImGui::Checkbox("Periodic X", &params.periodicX);
+        ImGui::SameLine();
+        ImGui::Checkbox("Periodic Y", &params.periodicY);
+        if (ImGui::Button("Remove Obstacles"))
+            particleSystem.obstacles.clear();
+        ImGui::TreePop();
+    }
+
+    if (ImGui::TreeNode("Phases"))
+    {
+        // phase 0 is the base fluid set by the sliders above, Reset spreads the phases over the block
+        if (ImGui::SliderInt("Phase Count", &params.phaseCount, 1, Parameters::maxPhases))
+        {
+            for (uint8_t &phase : particleSystem.particlePhase)
+                phase = std::min<uint8_t>(phase, static_cast<uint8_t>(params.phaseCount - 1));
+        }
+        ImGui::SliderInt("Spawn Phase", &params.spawnPhase, 0, params.phaseCount - 1);
+        for (int i = 1; i < params.phaseCount; ++i)
+        {
+            ImGui::PushID(i);
+            ImGui::Text("Phase %d", i);
+            ImGui::SliderFloat("Density Scale", &params.phases[i].densityScale, 0.25f, 4.0f);
+            ImGui::SliderFloat("Mass Scale", &params.phases[i].massScale, 0.25f, 4.0f);
+            ImGui::SliderFloat("Viscosity Scale", &params.phases[i].viscosityScale, 0.0f, 10.0f);
+            ImGui::PopID();
+        }
+        ImGui::TreePop();
+    }
+
+    if (ImGui::TreeNode("Bodies"))
+    {
+        ImGui::Text("%zu bodies (B circle, N box, M pentagon)", particleSystem.rigidBodies.bodies.size());
+        ImGui::Text("%d particle contacts", particleSystem.rigidBodies.contacts);
+        ImGui::SliderFloat("Body Size", &params.bodySize, 10.0f, 150.0f);
+        ImGui::SliderFloat("Body Density", &params.bodyDensity, 0.001f, 0.1f, "%.3f");
+        if (ImGui::Button("Remove Bodies"))
+            particleSystem.rigidBodies.clear();
+        ImGui::TreePop();
+    }
+
+    if (ImGui::TreeNode("Sources"))
+    {
+        ImGui::Text("%zu emitters (E), %zu sinks (D)", particleSystem.emitters.size(), particleSystem.sinks.size());
+        if (ImGui::SliderFloat("Emitter Rate", &params.emitterRate, 1.0f, 100.0f))
+        {
+            for (Emitter &emitter : particleSystem.emitters)
+                emitter.rate = params.emitterRate;
+        }
+        if (ImGui::SliderFloat("Sink Radius", &params.sinkRadius, 10.0f, 120.0f))
+        {
+            for (Sink &sink : particleSystem.sinks)
+                sink.radius = params.sinkRadius;
+        }
+        if (ImGui::Button("Remove Sources"))
+        {
+            particleSystem.emitters.clear();
+            particleSystem.sinks.clear();
+        }
         ImGui::TreePop();
     }
 
     if (ImGui::Button("Reset"))
-        particleSystem.initParticles(params.particleCount);
+        resetParticles();
     ImGui::SameLine();
     if (ImGui::Button("Step"))
         update();
     ImGui::SameLine();
     ImGui::Checkbox("Paused", &paused);
 
+    if (ImGui::Button("Save Checkpoint"))
+        saveCheckpoint();
+    ImGui::SameLine();
+    if (ImGui::Button("Load Checkpoint"))
+        loadCheckpoint();
+    if (checkpoint.isSaving())
+    {
+        ImGui::SameLine();
+        ImGui::Text("Saving...");
+    }
+
+    if (ImGui::Button(recorder.isRecording() ? "Stop Recording" : "Record"))
+    {
+        if (recorder.isRecording())
+            recorder.stop();
+        else
+            recorder.start(trajectoryPath, params);
+    }
+    ImGui::SameLine();
+    if (ImGui::Button(player.isOpen() ? "Stop Playback" : "Play Recording"))
+    {
+        if (player.isOpen())
+            closePlayback();
+        else
+            openPlayback();
+    }
+    if (recorder.isRecording())
+        ImGui::Text("Recorded %llu frames, %.2f MB", (unsigned long long)recorder.framesWritten, recorder.bytesWritten / 1048576.0f);
+    if (player.isOpen())
+        showPlaybackGui();
+
     ImGui::End();
 
     if (params.showFrameTime)
     {
+        int count = static_cast<int>(std::min<size_t>(frameCount, frameTimesHistory.size()));
         float average = 0;
-        for (int i = 0; i < frameTimesHistory.size(); ++i)
+        for (int i = 0; i < count; ++i)
         {
-            average += (&frameTimesHistory.front())[i];
+            average += frameTimesHistory[i];
         }
-        average /= frameTimesHistory.size();
+        average /= std::max(count, 1);
+        // once the ring is full the oldest entry is the one after the newest
+        int oldest = count == static_cast<int>(frameTimesHistory.size()) ? frameCount % frameTimesHistory.size() : 0;
         ImGui::Begin("Frame Time");
         ImGui::Text("FPS: %.1f", currentFps);
         ImGui::Text("Average frame time: %.1f", average);
-        ImGui::PlotLines("Frame times", &frameTimesHistory.front(), frameTimesHistory.size(), 0, nullptr, 0.0f, 100.0f, sf::Vector2f(300, 100));
+        ImGui::PlotLines("Frame times", frameTimesHistory.data(), count, oldest, nullptr, 0.0f, 100.0f, sf::Vector2f(300, 100));
         ImGui::End();
     }
+
+    if (params.showTelemetry)
+        showTelemetry();
+}
+
+void Main::showTelemetry()
+{
+    const TelemetryFrame &t = particleSystem.telemetry.last;
+    float neighbors[TelemetryFrame::binCount];
+    float densityErrors[TelemetryFrame::binCount];
+    float cells[TelemetryFrame::binCount];
+    for (int i = 0; i < TelemetryFrame::binCount; ++i)
+    {
+        neighbors[i] = t.neighborHistogram[i];
+        densityErrors[i] = t.densityErrorHistogram[i];
+        cells[i] = t.cellOccupancyHistogram[i];
+    }
+
+    ImGui::Begin("Telemetry");
+    ImGui::Text("Step %llu, %d particles", (unsigned long long)t.step, t.particleCount);
+    ImGui::Text("Kinetic energy: %.1f, max speed: %.1f", t.kineticEnergy, t.maxSpeed);
+    ImGui::Text("Clamps: %d force, %d velocity", t.forceClamps, t.velocityClamps);
+    ImGui::Text("Mean neighbors: %.1f, mean density error: %.1f%%", t.meanNeighbors, t.meanDensityError * 100.0f);
+    ImGui::Text("Grid: %d cells per radius, %.2f particles tested per neighbor", t.cellDivisions, t.candidatesPerNeighbor);
+    ImGui::Text("Occupied cells: %d, %.1f particles per cell", t.occupiedCells, t.occupiedCells ? (float)t.particleCount / t.occupiedCells : 0.0f);
+    for (int i = 0; i < PhaseCount; ++i)
+        ImGui::Text("%-10s %8.0f us", telemetryPhaseNames[i], t.phaseTime[i]);
+    ImGui::PlotHistogram("Neighbors (x4)", neighbors, TelemetryFrame::binCount, 0, nullptr, 0.0f, FLT_MAX, sf::Vector2f(300, 60));
+    ImGui::PlotHistogram("Density error", densityErrors, TelemetryFrame::binCount, 0, "-100% .. +300%", 0.0f, FLT_MAX, sf::Vector2f(300, 60));
+    ImGui::PlotHistogram("Particles per cell", cells, TelemetryFrame::binCount, 0, nullptr, 0.0f, FLT_MAX, sf::Vector2f(300, 60));
+    ImGui::End();
 }
 
 void Main::processEvents()
@@ -320,10 +609,10 @@ void Main::processEvents()
             sf::FloatRect visibleArea({0, 0}, {(float)width, (float)height});
             window.setView(sf::View(visibleArea));
             particleBuffer.resize({width, height});
-            postBuffer.resize({width, height});
-            densityBuffer.resize({width, height});
-            densityBuffer2.resize({width, height});
-            backgroundBuffer.resize({width, height});
+            for (auto &buffer : densityBuffers)
+                buffer.resize({width, height});
+            layerCache.resize({(unsigned)width, (unsigned)height});
+            densityField.resize({(unsigned)width, (unsigned)height}, params.densityFieldCellSize);
             particleSystem.updateCellSizes();
             particleSystem.updateParticleCells();
             rebuildGrid();
@@ -345,7 +634,45 @@ void Main::processEvents()
                 paused = true;
                 break;
                 case sf::Keyboard::Key::R:
-                particleSystem.initParticles(params.particleCount);
+                resetParticles();
+                break;
+                case sf::Keyboard::Key::C:
+                particleSystem.clearParticles();
+                params.particleCount = 0;
+                watchdog.reset();
+                break;
+                case sf::Keyboard::Key::E:
+                {
+                    Emitter emitter{mousePosition, Vector2f(0.0f, 0.0f), params.emitterRate};
+                    emitter.phase = particleSystem.spawnPhase();
+                    particleSystem.emitters.push_back(emitter);
+                }
+                break;
+                case sf::Keyboard::Key::O:
+                particleSystem.obstacles.addCircle(mousePosition, params.obstacleRadius);
+                break;
+                case sf::Keyboard::Key::D:
+                particleSystem.sinks.push_back(Sink{mousePosition, params.sinkRadius});
+                break;
+                case sf::Keyboard::Key::B:
+                particleSystem.rigidBodies.addCircle(mousePosition, params.bodySize * 0.5f, params.bodyDensity);
+                break;
+                case sf::Keyboard::Key::N:
+                particleSystem.rigidBodies.addBox(mousePosition, Vector2f(params.bodySize, params.bodySize * 0.5f) * 0.5f, params.bodyDensity);
+                break;
+                case sf::Keyboard::Key::M:
+                {
+                    std::vector<Vector2f> pentagon(5);
+                    for (int i = 0; i < 5; ++i)
+                        pentagon[i] = Vector2f(std::cos(i * 1.2566f), std::sin(i * 1.2566f)) * (params.bodySize * 0.5f);
+                    particleSystem.rigidBodies.addPolygon(mousePosition, std::move(pentagon), params.bodyDensity);
+                }
+                break;
+                case sf::Keyboard::Key::F5:
+                saveCheckpoint();
+                break;
+                case sf::Keyboard::Key::F9:
+                loadCheckpoint();
                 break;
                 default:
                 break;
@@ -354,6 +681,8 @@ void Main::processEvents()
     }
     
     mousePosition = Vector2f(sf::Mouse::getPosition(window));
+    if (sf::Mouse::isButtonPressed(sf::Mouse::Button::Left) || sf::Mouse::isButtonPressed(sf::Mouse::Button::Right))
+        watchdog.externalForceApplied();
     if (sf::Mouse::isButtonPressed(sf::Mouse::Button::Left))
     {
         particleSystem.applyCentralForce(mousePosition, params.interactForceRadius, params.interactForceStrength);
@@ -368,16 +697,81 @@ void Main::rebuildGrid()
 {
     sf::Color gridColor = params.backgroundColor * 4;
     gridVertices.clear();
-    for (float x = 0; x < params.windowWidth; x += params.densitySampleRadius)
+    gridDivisions = particleSystem.cellDivisions;
+    const float cellSize = particleSystem.cellSize();
+    for (float x = 0; x < params.windowWidth; x += cellSize)
     {
         gridVertices.append(sf::Vertex{sf::Vector2f(x, 0), gridColor});
         gridVertices.append(sf::Vertex{sf::Vector2f(x, params.windowHeight), gridColor});
     }
-    for (float y = 0; y < params.windowHeight; y += params.densitySampleRadius)
+    for (float y = 0; y < params.windowHeight; y += cellSize)
     {
         gridVertices.append(sf::Vertex{sf::Vector2f(0, y), gridColor});
         gridVertices.append(sf::Vertex{sf::Vector2f(params.windowWidth, y), gridColor});
     }
+    if (backgroundLayer >= 0)
+        layerCache.invalidate(backgroundLayer);
+}
+
+void Main::saveCheckpoint()
+{
+    if (!checkpoint.saveAsync(particleSystem, checkpointPath))
+        std::cerr << "Checkpoint is still being written" << std::endl;
+}
+
+void Main::loadCheckpoint()
+{
+    checkpoint.wait();
+    if (!Checkpoint::load(particleSystem, checkpointPath, true))
+        return;
+    watchdog.reset();
+    params.particleCount = particleSystem.particlePosition.size();
+    rebuildGrid();
+}
+
+void Main::openPlayback()
+{
+    if (recorder.isRecording())
+        recorder.stop();
+    if (!player.open(trajectoryPath))
+        return;
+    playbackPosition = 0;
+    player.getFrame(0, playbackFrame);
+    particleSystem.setParticles(playbackFrame.position, playbackFrame.velocity, playbackFrame.phase);
+}
+
+void Main::closePlayback()
+{
+    player.close();
+    resetParticles();
+}
+
+void Main::updatePlayback()
+{
+    // playback feeds recorded frames to the same render path instead of simulating
+    float last = player.getFrameCount() - 1;
+    playbackPosition = std::clamp(playbackPosition + playbackSpeed, 0.0f, last);
+    if (player.getFrame(static_cast<uint64_t>(playbackPosition), playbackFrame))
+        particleSystem.setParticles(playbackFrame.position, playbackFrame.velocity, playbackFrame.phase);
+}
+
+void Main::showPlaybackGui()
+{
+    int frame = static_cast<int>(playbackPosition);
+    if (ImGui::SliderInt("Frame", &frame, 0, static_cast<int>(player.getFrameCount()) - 1))
+    {
+        playbackPosition = frame;
+        if (player.getFrame(frame, playbackFrame))
+            particleSystem.setParticles(playbackFrame.position, playbackFrame.velocity, playbackFrame.phase);
+    }
+    ImGui::SliderFloat("Playback Speed", &playbackSpeed, -8.0f, 8.0f);
+    ImGui::Text("Step %llu, %llu chunks decoded", (unsigned long long)playbackFrame.step, (unsigned long long)player.chunksDecoded);
+}
+
+sf::RenderTexture &Main::densityBuffer(size_t age)
+{
+    size_t count = densityBuffers.size();
+    return densityBuffers[(densityBufferIndex + count - age % count) % count];
 }
 
 sf::Color hsvToRgb(float h, float s, float v)
@@ -1,59 +1,107 @@
+#pragma once
 #include "imgui/imgui-SFML.h"
 #include "imgui/imgui.h"
 #include "particle_system.h"
+#include "layer_cache.h"
+#include "density_field.h"
+#include "checkpoint.h"
+#include "trajectory.h"
+#include "watchdog.h"
+#include "metrics_server.h"
+#include "frame_arena.h"
+#include "memory_budget.h"
 #include <SFML/Graphics.hpp>
 #include <SFML/System.hpp>
 #include <SFML/Window.hpp>
 #include <algorithm>
 #include <vector>
 #include <string>
-#include <queue>
+#include <array>
 
 class Main
 {
     // rendering and event handling
 public:
-    Main(Parameters &params) : particleSystem(params), params(params) {}
+    // the window edits the parameters owned by its particle system
+    Main(const Parameters &params) : particleSystem(params), params(particleSystem.params) {}
     void run();
 
+    std::string checkpointPath = "checkpoint.flck";
+    bool loadCheckpointOnStart = false;
+    std::string trajectoryPath = "trajectory.fltr";
+    bool playOnStart = false;
+    unsigned short metricsPort = 0;
+    std::string obstaclePath;
+
 private:
     void processEvents();
     void update();
+    void resetParticles();
     void initialize();
     void render();
     void postEffects();
+    void paintBackground(sf::RenderTarget &target);
     void debugEffects();
     void renderParticles();
     void showGui();
+    void showTelemetry();
     void visualizeNeighbors();
+    void drawSources();
+    void drawObstacles();
+    void drawBodies();
     void rebuildGrid();
+    void saveCheckpoint();
+    void loadCheckpoint();
+    void openPlayback();
+    void closePlayback();
+    void updatePlayback();
+    void showPlaybackGui();
+    sf::RenderTexture &densityBuffer(size_t age = 0);
     sf::Color hsvToRgb(float h, float s, float v);
     sf::Color lerpColor(const sf::Color &a, const sf::Color &b, float t);
     sf::Color reserveColor(const sf::Color &color);
 
     sf::RenderWindow window;
     sf::RenderTexture particleBuffer;
-    sf::RenderTexture postBuffer;
-    sf::RenderTexture densityBuffer;
-    sf::RenderTexture densityBuffer2;
-    sf::RenderTexture backgroundBuffer;
+    std::vector<sf::RenderTexture> densityBuffers;
+    size_t densityBufferIndex = 0;
+    LayerCache layerCache;
+    int backgroundLayer = -1;
     sf::VertexArray particleVertices{sf::PrimitiveType::Triangles};
     sf::VertexArray densityVertices{sf::PrimitiveType::Triangles};
     sf::VertexArray gridVertices{sf::PrimitiveType::Lines};
+    sf::VertexArray bodyVertices{sf::PrimitiveType::Triangles};
+    sf::CircleShape mouseCircle;
+    sf::CircleShape neighborMarker{10.0f};
+    sf::CircleShape sourceMarker;
+    sf::Texture obstacleTexture;
+    uint32_t obstacleTextureVersion = 0;
     sf::Texture particleTexture;
     sf::Texture densityTexture;
+    ParticleSystem particleSystem;
     Parameters &params;
+    FrameArena frameArena; // rewound at the end of every frame
     sf::Clock deltaClock;
     sf::Clock debugClock;
     sf::Clock timer;
     Vector2f mousePosition;
     sf::Shader densityShader;
-    ParticleSystem particleSystem;
+    DensityField densityField;
+    Checkpoint checkpoint;
+    TrajectoryRecorder recorder;
+    StabilityWatchdog watchdog;
+    MetricsServer metrics;
+    TrajectoryPlayer player;
+    TrajectoryFrame playbackFrame;
+    float playbackPosition = 0;
+    float playbackSpeed = 1.0f;
     float currentFps = 0;
     float renderTime = 0;
     float updateTime = 0;
     bool paused = false;
     size_t frameCount = 0;
-    std::queue<float, std::deque<float>> frameTimesHistory;
+    std::array<float, 120> frameTimesHistory{}; // ring, the next entry goes to frameCount % size
+    uint64_t frameAllocations = 0;                // heap allocations during the last frame
     int neighborCount = 0;
+    int gridDivisions = 0; // of the grid lines drawn, the solver can pick another
 };
\ No newline at end of file
@@ -0,0 +1,144 @@
+#include "frame_arena.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+FrameArena::FrameArena(size_t capacity)
+    : blockSize(capacity)
+{
+    block = static_cast<char *>(std::pmr::new_delete_resource()->allocate(blockSize, alignof(std::max_align_t)));
+}
+
+FrameArena::~FrameArena()
+{
+    reset();
+    std::pmr::new_delete_resource()->deallocate(block, blockSize, alignof(std::max_align_t));
+}
+
+void FrameArena::reset()
+{
+    highWater = std::max(highWater, used());
+    for (auto &[p, bytes] : overflow)
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignof(std::max_align_t));
+    overflow.clear();
+    if (highWater > blockSize)
+    {
+        std::pmr::new_delete_resource()->deallocate(block, blockSize, alignof(std::max_align_t));
+        blockSize = highWater + highWater / 4;
+        block = static_cast<char *>(std::pmr::new_delete_resource()->allocate(blockSize, alignof(std::max_align_t)));
+    }
+    offset = 0;
+    overflowBytes = 0;
+}
+
+void *FrameArena::do_allocate(size_t bytes, size_t alignment)
+{
+    size_t start = (offset + alignment - 1) & ~(alignment - 1);
+    if (start + bytes <= blockSize)
+    {
+        offset = start + bytes;
+        return block + start;
+    }
+    // out of room, fall back to the heap until the next reset grows the block
+    alignment = std::max(alignment, alignof(std::max_align_t));
+    void *p = std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    overflow.push_back({p, bytes});
+    overflowBytes += bytes;
+    return p;
+}
+
+void FrameArena::do_deallocate(void *p, size_t bytes, size_t)
+{
+    // only the newest allocation is given back, which covers a vector growing in place
+    if (static_cast<char *>(p) + bytes == block + offset)
+        offset = static_cast<char *>(p) - block;
+}
+
+namespace
+{
+    std::atomic<uint64_t> allocationCount{0};
+    std::atomic<uint64_t> allocationBytes{0};
+
+    void *countedAllocate(size_t size, size_t alignment)
+    {
+        allocationCount.fetch_add(1, std::memory_order_relaxed);
+        allocationBytes.fetch_add(size, std::memory_order_relaxed);
+        if (size == 0)
+            size = 1;
+        if (alignment <= alignof(std::max_align_t))
+            return std::malloc(size);
+#ifdef _WIN32
+        return _aligned_malloc(size, alignment);
+#else
+        void *p = nullptr;
+        return posix_memalign(&p, alignment, size) == 0 ? p : nullptr;
+#endif
+    }
+
+    void countedFree(void *p, [[maybe_unused]] size_t alignment)
+    {
+#ifdef _WIN32
+        if (alignment > alignof(std::max_align_t))
+        {
+            _aligned_free(p);
+            return;
+        }
+#endif
+        std::free(p);
+    }
+}
+
+uint64_t AllocationCounter::count()
+{
+    return allocationCount.load(std::memory_order_relaxed);
+}
+
+uint64_t AllocationCounter::bytes()
+{
+    return allocationBytes.load(std::memory_order_relaxed);
+}
+
+// the replaced global allocation functions feed the counter
+void *operator new(size_t size)
+{
+    if (void *p = countedAllocate(size, alignof(std::max_align_t)))
+        return p;
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return countedAllocate(size, alignof(std::max_align_t));
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return countedAllocate(size, alignof(std::max_align_t));
+}
+
+void *operator new(size_t size, std::align_val_t alignment)
+{
+    if (void *p = countedAllocate(size, static_cast<size_t>(alignment)))
+        return p;
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size, std::align_val_t alignment)
+{
+    return operator new(size, alignment);
+}
+
+void operator delete(void *p) noexcept { countedFree(p, alignof(std::max_align_t)); }
+void operator delete[](void *p) noexcept { countedFree(p, alignof(std::max_align_t)); }
+void operator delete(void *p, size_t) noexcept { countedFree(p, alignof(std::max_align_t)); }
+void operator delete[](void *p, size_t) noexcept { countedFree(p, alignof(std::max_align_t)); }
+void operator delete(void *p, std::align_val_t alignment) noexcept { countedFree(p, static_cast<size_t>(alignment)); }
+void operator delete[](void *p, std::align_val_t alignment) noexcept { countedFree(p, static_cast<size_t>(alignment)); }
+void operator delete(void *p, size_t, std::align_val_t alignment) noexcept { countedFree(p, static_cast<size_t>(alignment)); }
+void operator delete[](void *p, size_t, std::align_val_t alignment) noexcept { countedFree(p, static_cast<size_t>(alignment)); }
@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+
+class FrameArena : public std::pmr::memory_resource
+{
+    // bump allocator for temporaries that live until the end of a frame. reset() rewinds it;
+    // a frame that overflowed grows the block to its high-water mark on the next reset,
+    // so after warming up it no longer touches the heap
+public:
+    explicit FrameArena(size_t capacity = 64 * 1024);
+    FrameArena(const FrameArena &) = delete;
+    FrameArena &operator=(const FrameArena &) = delete;
+    ~FrameArena();
+
+    void reset();
+    size_t used() const { return offset + overflowBytes; }
+    size_t capacity() const { return blockSize; }
+    size_t highWater = 0; // bytes used by the largest frame so far
+
+private:
+    char *block = nullptr;
+    size_t blockSize = 0;
+    size_t offset = 0;
+    size_t overflowBytes = 0;
+    std::vector<std::pair<void *, size_t>> overflow; // heap blocks taken this frame
+
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+};
+
+namespace AllocationCounter
+{
+    // totals of every global operator new since the start of the process
+    uint64_t count();
+    uint64_t bytes();
+}
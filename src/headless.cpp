@@ -0,0 +1,104 @@
+#include "headless.h"
+#include "frame_arena.h"
+#include "memory_budget.h"
+#include <SFML/Graphics/Image.hpp>
+#include <fstream>
+#include <iostream>
+
+int Headless::run(const HeadlessOptions &options)
+{
+    initialize(options);
+    if (!options.recordPath.empty() && !recorder.start(options.recordPath, params))
+        return 1;
+    if (options.metricsPort != 0 && !metrics.start(options.metricsPort))
+        return 1;
+    std::ofstream telemetryFile;
+    if (!options.telemetryPath.empty())
+    {
+        telemetryFile.open(options.telemetryPath);
+        if (!telemetryFile)
+        {
+            std::cerr << "Failed to open " << options.telemetryPath << std::endl;
+            return 1;
+        }
+        TelemetryFrame::writeCsvHeader(telemetryFile);
+    }
+
+    // the second half of the run is taken as the steady state for the allocation count
+    uint64_t steadyAllocations = 0;
+    int failedSaves = 0;
+    for (int step = 0; step < options.steps; ++step)
+    {
+        if (step == options.steps / 2)
+            steadyAllocations = AllocationCounter::count();
+        for (int i = 0; i < params.stepCount; ++i)
+        {
+            if (params.enableWatchdog)
+                watchdog.step(particleSystem, getTimeStep(params));
+            else
+                particleSystem.updateParticles(getTimeStep(params));
+            if (telemetryFile.is_open())
+                particleSystem.telemetry.last.writeCsv(telemetryFile);
+            metrics.publish(particleSystem, &watchdog);
+        }
+        recorder.recordFrame(particleSystem);
+
+        if (!options.savePath.empty() && options.saveInterval > 0 && (step + 1) % options.saveInterval == 0)
+        {
+            // nobody would notice a skipped save, so a slow one holds up the run instead
+            failedSaves += !checkpoint.wait();
+            checkpoint.saveAsync(particleSystem, options.savePath);
+        }
+    }
+    failedSaves += !checkpoint.wait();
+
+    uint64_t endAllocations = AllocationCounter::count();
+
+    recorder.stop();
+    if (!options.savePath.empty() && !checkpoint.save(particleSystem, options.savePath))
+        return 1;
+    if (failedSaves > 0)
+        std::cerr << failedSaves << " of the checkpoints saved with --save-every failed" << std::endl;
+    std::cout << "Finished " << options.steps << " frames, step " << particleSystem.stepCounter
+              << ", " << watchdog.rollbackCount << " rollbacks" << std::endl;
+    int steadyFrames = options.steps - options.steps / 2;
+    if (steadyFrames > 0)
+        std::cout << "Steady state: " << (double)(endAllocations - steadyAllocations) / steadyFrames
+                  << " heap allocations per frame" << std::endl;
+    if (!particleSystem.particlePosition.empty())
+        std::cout << "Reserved: " << (particleSystem.reservedBytes() >> 20) << " MB, "
+                  << particleSystem.reservedBytes() / particleSystem.particlePosition.size() << " bytes per particle" << std::endl;
+    size_t remotePages = 0, presentPages = 0;
+    particleSystem.countRemotePages(remotePages, presentPages);
+    if (presentPages > 0)
+        std::cout << "Memory placement: " << MemoryPlacement::nodeCount() << " nodes, " << 100.0 * remotePages / presentPages
+                  << "% of " << presentPages << " particle pages remote to the thread that owns them" << std::endl;
+    return failedSaves > 0 ? 1 : 0;
+}
+
+void Headless::initialize(const HeadlessOptions &options)
+{
+    // same particle size as the window, which takes it from the particle texture
+    sf::Image particleImage;
+    particleSystem.particleRadius = particleImage.loadFromFile("assets/textures/particle.png") ? particleImage.getSize().x / 2.0f : 8.0f;
+
+    if (!options.obstaclePath.empty())
+        particleSystem.obstacles.loadImage(options.obstaclePath);
+    const MemoryBudget budget = MemoryBudget::estimate(params);
+    if (options.loadPath.empty() || !Checkpoint::load(particleSystem, options.loadPath, false))
+    {
+        params.particleCount = budget.fit(params.particleCount);
+        particleSystem.initParticles(params.particleCount);
+    }
+    const size_t count = particleSystem.particlePosition.size();
+    std::cout << "Memory: " << count << " particles, " << budget.bytesPerParticle() << " bytes per particle ("
+              << budget.solverBytesPerParticle << " solver, " << budget.snapshotBytesPerParticle << " watchdog), "
+              << (budget.required(count) >> 20) << " MB of a " << (budget.limit >> 20) << " MB budget" << std::endl;
+}
+
+float Headless::getTimeStep(const Parameters &params)
+{
+    // matches the window running at its target frame rate
+    float frameTime = 1000.0f / params.targetFps;
+    return params.timeScale * frameTime / 100.0f / params.stepCount;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <string>
+#include "particle_system.h"
+#include "checkpoint.h"
+#include "trajectory.h"
+#include "watchdog.h"
+#include "metrics_server.h"
+
+struct HeadlessOptions
+{
+    int steps = 1000;
+    std::string loadPath;
+    std::string savePath;
+    int saveInterval = 0; // steps between checkpoints, 0 only saves at the end
+    std::string recordPath;
+    std::string telemetryPath; // csv, one row per solver step
+    unsigned short metricsPort = 0; // 0 disables the metrics server
+    std::string obstaclePath;       // image, dark opaque pixels are solid
+};
+
+class Headless
+{
+    // runs the solver without a window, for long runs and batch jobs
+public:
+    Headless(const Parameters &params) : particleSystem(params), params(particleSystem.params) {}
+    int run(const HeadlessOptions &options);
+    static float getTimeStep(const Parameters &params);
+
+    ParticleSystem particleSystem;
+    Parameters &params;
+    Checkpoint checkpoint;
+    TrajectoryRecorder recorder;
+    StabilityWatchdog watchdog;
+    MetricsServer metrics;
+
+private:
+    void initialize(const HeadlessOptions &options);
+};
@@ -0,0 +1,41 @@
+#include "layer_cache.h"
+
+int LayerCache::addLayer(sf::Vector2u size, Painter paint)
+{
+    layers.emplace_back(size, std::move(paint));
+    return static_cast<int>(layers.size()) - 1;
+}
+
+void LayerCache::invalidate(int layer)
+{
+    layers[layer].dirty = true;
+}
+
+void LayerCache::resize(sf::Vector2u size)
+{
+    for (int i = 0; i < static_cast<int>(layers.size()); ++i)
+    {
+        if (layers[i].texture.resize(size))
+            invalidate(i);
+    }
+}
+
+void LayerCache::update()
+{
+    for (auto &layer : layers)
+    {
+        if (!layer.dirty)
+            continue;
+
+        layer.texture.setView(sf::View(sf::FloatRect({0, 0}, sf::Vector2f(layer.texture.getSize()))));
+        layer.paint(layer.texture);
+        layer.texture.display();
+
+        layer.dirty = false;
+    }
+}
+
+const sf::Texture &LayerCache::getTexture(int layer) const
+{
+    return layers[layer].texture.getTexture();
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <SFML/Graphics.hpp>
+#include <functional>
+#include <vector>
+
+class LayerCache
+{
+    // render targets that are only redrawn after being invalidated
+public:
+    using Painter = std::function<void(sf::RenderTarget &target)>;
+
+    int addLayer(sf::Vector2u size, Painter paint);
+    void invalidate(int layer);
+    void resize(sf::Vector2u size);
+    void update();
+    const sf::Texture &getTexture(int layer) const;
+
+private:
+    struct Layer
+    {
+        Layer(sf::Vector2u size, Painter paint) : texture(size), paint(std::move(paint)) {}
+        sf::RenderTexture texture;
+        Painter paint;
+        bool dirty = true;
+    };
+    std::vector<Layer> layers;
+};
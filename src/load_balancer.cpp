@@ -0,0 +1,91 @@
+#include "load_balancer.h"
+#include <algorithm>
+#include <numeric>
+
+void LoadBalancer::update(const CellSlot *cellSlots, int count, int cols, int rows, int reach, WorkBalance mode, int chunks)
+{
+    const int cellCount = cols * rows;
+    cellCounts.assign(cellCount, 0);
+    runStarts.clear();
+    runCosts.clear();
+    for (int slot = 0; slot < count;)
+    {
+        const int cell = std::get<1>(cellSlots[slot]);
+        const int start = slot;
+        while (slot < count && std::get<1>(cellSlots[slot]) == cell)
+            ++slot;
+        runStarts.push_back(start);
+        runCosts.push_back(slot - start);
+        if (cell >= 0 && cell < cellCount)
+            cellCounts[cell] = slot - start;
+    }
+
+    if (mode == BalancePairs)
+    {
+        // every particle of a cell tests the particles of the cells within reach of it
+        for (size_t run = 0; run < runStarts.size(); ++run)
+        {
+            const int cell = std::get<1>(cellSlots[runStarts[run]]);
+            if (cell < 0 || cell >= cellCount)
+                continue;
+            const int x = cell % cols, y = cell / cols;
+            int around = 0;
+            for (int ny = std::max(y - reach, 0); ny <= std::min(y + reach, rows - 1); ++ny)
+            {
+                for (int nx = std::max(x - reach, 0); nx <= std::min(x + reach, cols - 1); ++nx)
+                    around += cellCounts[nx + ny * cols];
+            }
+            runCosts[run] *= around;
+        }
+    }
+
+    // chunks end between cells, a cell holds far fewer particles than a chunk
+    split(runCosts, chunks, runChunks);
+    chunkStart.resize(chunks + 1);
+    double total = 0.0, largest = 0.0;
+    for (int chunk = 0; chunk < chunks; ++chunk)
+    {
+        chunkStart[chunk] = runChunks[chunk] < static_cast<int>(runStarts.size()) ? runStarts[runChunks[chunk]] : count;
+        double cost = std::accumulate(runCosts.begin() + runChunks[chunk], runCosts.begin() + runChunks[chunk + 1], 0.0);
+        total += cost;
+        largest = std::max(largest, cost);
+    }
+    chunkStart[chunks] = count;
+    estimatedImbalance = total > 0.0 ? static_cast<float>(largest * chunks / total) : 1.0f;
+}
+
+void LoadBalancer::split(const std::vector<double> &costs, int parts, std::vector<int> &starts)
+{
+    // an item goes to the part its middle falls into, so no part is more than half an item off
+    const double total = std::accumulate(costs.begin(), costs.end(), 0.0);
+    starts.assign(parts + 1, static_cast<int>(costs.size()));
+    starts[0] = 0;
+    double prefix = 0.0;
+    int part = 1;
+    for (size_t i = 0; i < costs.size() && part < parts; ++i)
+    {
+        while (part < parts && prefix + costs[i] * 0.5 >= total * part / parts)
+            starts[part++] = static_cast<int>(i);
+        prefix += costs[i];
+    }
+}
+
+void LoadBalancer::clear()
+{
+    chunkStart.clear();
+    estimatedImbalance = 0.0f;
+}
+
+void LoadBalancer::beginStep(int threads)
+{
+    threadSeconds.assign(threads, 0.0);
+}
+
+float LoadBalancer::measuredImbalance() const
+{
+    if (threadSeconds.empty())
+        return 1.0f;
+    const double total = std::accumulate(threadSeconds.begin(), threadSeconds.end(), 0.0);
+    const double slowest = *std::max_element(threadSeconds.begin(), threadSeconds.end());
+    return total > 0.0 ? static_cast<float>(slowest * threadSeconds.size() / total) : 1.0f;
+}
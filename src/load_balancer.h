@@ -0,0 +1,38 @@
+#pragma once
+#include <vector>
+#include "particle_index.h"
+
+enum WorkBalance
+{
+    BalanceIndex,     // static chunks of particle indices, the split the arrays were first touched with
+    BalanceParticles, // equal particle counts in cell order
+    BalancePairs,     // equal neighbour pairs in cell order, a particle costs the particles its search reaches
+};
+
+class LoadBalancer
+{
+    // splits the cell-sorted particles into one chunk per thread by prefix sums of their estimated
+    // cost, so a fluid pooled in a few cells does not leave threads waiting on the busiest one.
+    // the threads also report how long their chunks took, which gives the measured imbalance
+public:
+    void update(const CellSlot *cellSlots, int count, int cols, int rows, int reach, WorkBalance mode, int chunks);
+    int chunkCount() const { return chunkStart.empty() ? 0 : static_cast<int>(chunkStart.size()) - 1; }
+
+    void clear();
+    void beginStep(int threads);
+    void record(int thread, double seconds) { threadSeconds[thread] += seconds; }
+    float measuredImbalance() const; // slowest thread over the mean, 1 when even
+
+    std::vector<int> chunkStart;     // slots into the sorted particles, chunkCount() + 1 entries
+    float estimatedImbalance = 0.0f; // largest chunk cost over the mean, 0 without chunks
+
+    // starts of parts of equal total cost, at whole items
+    static void split(const std::vector<double> &costs, int parts, std::vector<int> &starts);
+
+private:
+    std::vector<int> cellCounts;
+    std::vector<double> runCosts;
+    std::vector<int> runStarts;
+    std::vector<int> runChunks;
+    std::vector<double> threadSeconds;
+};
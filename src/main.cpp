@@ -1,9 +1,13 @@
 #include <iostream>
 #include <filesystem>
+#include <string>
 #include <windows.h>
+#include "distributed.h"
 #include "fluid.h"
+#include "headless.h"
+#include "sweep.h"
 
-int main()
+int main(int argc, char *argv[])
 {
     wchar_t path[MAX_PATH];
     if (!GetModuleFileNameW(NULL, path, (DWORD)MAX_PATH) > 0) {
@@ -16,6 +20,135 @@ int main()
     AddDllDirectory(p.parent_path().append("libs\\SFML-2.6.0\\bin").c_str());
 
     Parameters params;
+    bool headless = false;
+    HeadlessOptions options;
+    std::string playPath;
+    std::string sweepPath;
+    std::string sweepOutput = "sweep_results.csv";
+    int sweepThreads = 0;
+    DistributedOptions distributed;
+    int distributedBench = 0;
+    std::vector<std::string> forwarded; // handed to the ranks, which get their own distributed options
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        int first = i;
+        if (arg == "--headless")
+            headless = true;
+        else if (arg == "--steps" && hasValue)
+            options.steps = distributed.steps = std::stoi(argv[++i]);
+        else if (arg == "--ranks" && hasValue)
+            distributed.ranks = std::stoi(argv[++i]);
+        else if (arg == "--rank" && hasValue)
+            distributed.rank = std::stoi(argv[++i]);
+        else if (arg == "--transport" && hasValue)
+            distributed.transport = argv[++i];
+        else if (arg == "--session" && hasValue)
+            distributed.session = argv[++i];
+        else if (arg == "--port" && hasValue)
+            distributed.basePort = static_cast<unsigned short>(std::stoi(argv[++i]));
+        else if (arg == "--distributed-bench" && hasValue)
+            distributedBench = std::stoi(argv[++i]);
+        else if (arg == "--distributed-out" && hasValue)
+            distributed.outputPath = argv[++i];
+        else if (arg == "--load" && hasValue)
+            options.loadPath = argv[++i];
+        else if (arg == "--save" && hasValue)
+            options.savePath = argv[++i];
+        else if (arg == "--save-every" && hasValue)
+            options.saveInterval = std::stoi(argv[++i]);
+        else if (arg == "--record" && hasValue)
+            options.recordPath = argv[++i];
+        else if (arg == "--telemetry" && hasValue)
+            options.telemetryPath = argv[++i];
+        else if (arg == "--metrics-port" && hasValue)
+            options.metricsPort = static_cast<unsigned short>(std::stoi(argv[++i]));
+        else if (arg == "--obstacles" && hasValue)
+            options.obstaclePath = argv[++i];
+        else if (arg == "--periodic" && hasValue)
+        {
+            std::string axes = argv[++i];
+            params.periodicX = axes.find('x') != std::string::npos;
+            params.periodicY = axes.find('y') != std::string::npos;
+        }
+        else if (arg == "--play" && hasValue)
+            playPath = argv[++i];
+        else if (arg == "--sweep" && hasValue)
+            sweepPath = argv[++i];
+        else if (arg == "--sweep-out" && hasValue)
+            sweepOutput = argv[++i];
+        else if (arg == "--threads" && hasValue)
+            sweepThreads = std::stoi(argv[++i]);
+        else if (arg == "--affinity" && hasValue)
+        {
+            if (!MemoryPlacement::parseAffinity(argv[++i], MemoryPlacement::settings.affinity))
+                std::cerr << "Unknown affinity: " << argv[i] << std::endl;
+        }
+        else if (arg == "--particles" && hasValue)
+            params.particleCount = params.particleCapacity = std::stoi(argv[++i]);
+        else if (arg == "--domain" && hasValue)
+        {
+            std::string size = argv[++i];
+            size_t x = size.find('x');
+            if (x == std::string::npos)
+                std::cerr << "Expected <width>x<height>: " << size << std::endl;
+            else
+            {
+                params.windowWidth = static_cast<unsigned>(std::stoul(size.substr(0, x)));
+                params.windowHeight = static_cast<unsigned>(std::stoul(size.substr(x + 1)));
+            }
+        }
+        else if (arg == "--memory-budget" && hasValue)
+            params.memoryBudgetMB = std::stoi(argv[++i]);
+        else if (arg == "--reduced-memory")
+            params.reducedMemory = true;
+        else if (arg == "--huge-pages")
+            MemoryPlacement::settings.hugePages = true;
+        else if (arg == "--no-first-touch")
+            MemoryPlacement::settings.firstTouch = false;
+        else
+            std::cerr << "Unknown argument: " << arg << std::endl;
+        bool distributedArgument = arg == "--steps" || arg == "--ranks" || arg == "--rank" || arg == "--transport" ||
+                                   arg == "--session" || arg == "--port" || arg == "--distributed-bench" || arg == "--distributed-out";
+        if (!distributedArgument)
+            forwarded.insert(forwarded.end(), argv + first, argv + i + 1);
+    }
+
+    if (distributed.rank >= 0)
+        return runDistributedRank(params, distributed);
+    if (distributedBench > 0)
+        return DistributedLauncher(forwarded).benchmark(distributed, distributedBench);
+    if (distributed.ranks > 1)
+        return DistributedLauncher(forwarded).launch(distributed);
+
+    // after the distributed ranks, which share the cores and are left to the os
+    MemoryPlacement::pinThreads();
+
+    if (!sweepPath.empty())
+    {
+        SweepRunner sweep(params);
+        if (!sweep.loadGrid(sweepPath))
+            return 1;
+        return sweep.run(sweepOutput, sweepThreads);
+    }
+
+    if (headless)
+    {
+        Headless runner(params);
+        return runner.run(options);
+    }
+
     Main main(params);
+    if (!options.loadPath.empty())
+        main.checkpointPath = options.loadPath;
+    main.loadCheckpointOnStart = !options.loadPath.empty();
+    if (!options.recordPath.empty())
+        main.trajectoryPath = options.recordPath;
+    if (!playPath.empty())
+        main.trajectoryPath = playPath;
+    main.playOnStart = !playPath.empty();
+    main.metricsPort = options.metricsPort;
+    main.obstaclePath = options.obstaclePath;
     main.run();
-}
\ No newline at end of file
+}
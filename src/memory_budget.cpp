@@ -0,0 +1,63 @@
+#include "memory_budget.h"
+#include "memory_placement.h"
+#include "particle_index.h"
+#include "watchdog.h"
+#include <algorithm>
+#include <climits>
+#include <iostream>
+#include <omp.h>
+
+MemoryBudget MemoryBudget::estimate(const Parameters &params)
+{
+    MemoryBudget budget;
+    // positions, velocities, densities, the cell slots, sleep and phase flags, the id and its slot,
+    // and the free id and removal lists, which are reserved to the same capacity
+    const size_t positions = params.reducedMemory ? 2 : 3;
+    budget.solverBytesPerParticle = positions * sizeof(sf::Vector2f) + sizeof(float) + sizeof(CellSlot) +
+                                    2 * sizeof(uint8_t) + 2 * sizeof(uint32_t) + sizeof(uint32_t) + sizeof(int);
+    if (params.enableWatchdog)
+        budget.snapshotBytesPerParticle = StabilityWatchdog::snapshotCount *
+                                          (positions * sizeof(sf::Vector2f) + sizeof(float) + sizeof(uint32_t) + sizeof(uint8_t));
+
+    // the automatic grid can go down to a third of the sample radius
+    const float cellSize = params.densitySampleRadius / (params.cellDivisions > 0 ? std::min(params.cellDivisions, 3) : 3);
+    const size_t cols = static_cast<size_t>(params.windowWidth / cellSize) + 1;
+    const size_t rows = static_cast<size_t>(params.windowHeight / cellSize) + 1;
+    size_t cellBytes = sizeof(ParticleIndex);
+    if (params.enableSleeping)
+        cellBytes += sizeof(uint16_t) + sizeof(float);
+    if (params.workBalance != 0)
+        cellBytes += sizeof(int);
+    budget.fixedBytes = cols * rows * cellBytes;
+    if (params.enableBoundaryDensity)
+    {
+        // the wall distance, volume and volume gradient grids
+        const size_t obstacleCells = (static_cast<size_t>(params.windowWidth / params.obstacleCellSize) + 1) *
+                                     (static_cast<size_t>(params.windowHeight / params.obstacleCellSize) + 1);
+        budget.fixedBytes += obstacleCells * (2 * sizeof(float) + sizeof(sf::Vector2f));
+    }
+    if (params.enableTiling)
+        budget.fixedBytes += static_cast<size_t>(omp_get_max_threads()) * params.tileCacheKB * 1024;
+
+    budget.limit = params.memoryBudgetMB > 0 ? static_cast<size_t>(params.memoryBudgetMB) << 20 : MemoryPlacement::physicalMemory() / 4 * 3;
+    return budget;
+}
+
+int MemoryBudget::maxParticles() const
+{
+    if (limit == 0)
+        return INT_MAX; // unknown physical memory
+    if (limit <= fixedBytes)
+        return 0;
+    return static_cast<int>(std::min<size_t>((limit - fixedBytes) / bytesPerParticle(), INT_MAX));
+}
+
+int MemoryBudget::fit(int particles) const
+{
+    const int fitting = maxParticles();
+    if (particles <= fitting)
+        return particles;
+    std::cerr << particles << " particles need " << (required(particles) >> 20) << " MB at " << bytesPerParticle()
+              << " bytes each, the budget is " << (limit >> 20) << " MB, using " << fitting << std::endl;
+    return fitting;
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <cstddef>
+#include "parameters.h"
+
+struct MemoryBudget
+{
+    // what a run will take, worked out from the parameters before anything is allocated. per
+    // particle it counts the solver arrays and the watchdog's snapshots, the grid comes on top
+    size_t solverBytesPerParticle = 0;
+    size_t snapshotBytesPerParticle = 0;
+    size_t fixedBytes = 0; // grid and per-thread scratch
+    size_t limit = 0;
+
+    static MemoryBudget estimate(const Parameters &params);
+    size_t bytesPerParticle() const { return solverBytesPerParticle + snapshotBytesPerParticle; }
+    size_t required(size_t particles) const { return particles * bytesPerParticle() + fixedBytes; }
+    int maxParticles() const;
+    int fit(int particles) const; // the count lowered to the limit, with a message when it had to be
+};
@@ -0,0 +1,324 @@
+#include "memory_placement.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <omp.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+PlacementSettings MemoryPlacement::settings;
+
+namespace
+{
+    struct Topology
+    {
+        std::vector<std::vector<int>> nodeCpus; // a machine without numa is a single node
+        std::vector<int> cpuNode;
+    };
+
+    Topology detectTopology()
+    {
+        Topology topology;
+#ifdef _WIN32
+        ULONG highest = 0;
+        if (GetNumaHighestNodeNumber(&highest))
+        {
+            for (ULONG node = 0; node <= highest; ++node)
+            {
+                GROUP_AFFINITY affinity{};
+                if (!GetNumaNodeProcessorMaskEx(static_cast<USHORT>(node), &affinity) || affinity.Mask == 0)
+                    continue;
+                std::vector<int> cpus;
+                for (int bit = 0; bit < 64; ++bit)
+                {
+                    if (affinity.Mask & (KAFFINITY(1) << bit))
+                        cpus.push_back(affinity.Group * 64 + bit);
+                }
+                topology.nodeCpus.push_back(cpus);
+            }
+        }
+#else
+        // node directories may have gaps, e.g. after hot-unplugging
+        for (int node = 0; node < 256; ++node)
+        {
+            std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string list;
+            if (!in || !std::getline(in, list))
+                continue;
+            std::vector<int> cpus;
+            std::stringstream stream(list);
+            for (std::string range; std::getline(stream, range, ',');)
+            {
+                int first = 0, last = 0;
+                char dash = 0;
+                std::stringstream parts(range);
+                if (!(parts >> first))
+                    continue;
+                last = parts >> dash >> last ? last : first;
+                for (int cpu = first; cpu <= last; ++cpu)
+                    cpus.push_back(cpu);
+            }
+            if (!cpus.empty())
+                topology.nodeCpus.push_back(cpus);
+        }
+#endif
+        if (topology.nodeCpus.empty())
+        {
+            topology.nodeCpus.emplace_back();
+            for (int cpu = 0; cpu < static_cast<int>(std::max(1u, std::thread::hardware_concurrency())); ++cpu)
+                topology.nodeCpus[0].push_back(cpu);
+        }
+        for (int node = 0; node < static_cast<int>(topology.nodeCpus.size()); ++node)
+        {
+            for (int cpu : topology.nodeCpus[node])
+            {
+                if (cpu >= static_cast<int>(topology.cpuNode.size()))
+                    topology.cpuNode.resize(cpu + 1, 0);
+                topology.cpuNode[cpu] = node;
+            }
+        }
+        return topology;
+    }
+
+    const Topology &topology()
+    {
+        static const Topology detected = detectTopology();
+        return detected;
+    }
+
+    int currentNode()
+    {
+#ifdef _WIN32
+        PROCESSOR_NUMBER processor;
+        GetCurrentProcessorNumberEx(&processor);
+        int cpu = processor.Group * 64 + processor.Number;
+#else
+        int cpu = sched_getcpu();
+#endif
+        const std::vector<int> &cpuNode = topology().cpuNode;
+        return cpu >= 0 && cpu < static_cast<int>(cpuNode.size()) ? cpuNode[cpu] : 0;
+    }
+
+    bool pinCurrentThread(int cpu)
+    {
+#ifdef _WIN32
+        GROUP_AFFINITY affinity{};
+        affinity.Group = static_cast<WORD>(cpu / 64);
+        affinity.Mask = KAFFINITY(1) << (cpu % 64);
+        return SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL) != 0;
+#else
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+    }
+
+    size_t roundUp(size_t value, size_t alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+#ifndef _WIN32
+    // every mapping is a whole number of huge pages, so release does not depend on the settings
+    constexpr size_t hugePageSize = 2 << 20;
+#endif
+}
+
+size_t MemoryPlacement::pageSize()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+void *MemoryPlacement::allocate(size_t bytes)
+{
+#ifdef _WIN32
+    char *data = nullptr;
+    if (settings.hugePages && GetLargePageMinimum() > 0)
+    {
+        // large pages need the lock memory privilege and are placed when allocated, not when touched
+        data = static_cast<char *>(VirtualAlloc(NULL, roundUp(bytes, GetLargePageMinimum()), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE));
+        static bool warned = false;
+        if (data == nullptr && !warned)
+        {
+            std::cerr << "Large pages are not available, using normal pages" << std::endl;
+            warned = true;
+        }
+    }
+    if (data == nullptr)
+        data = static_cast<char *>(VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+    if (data == nullptr)
+        return nullptr;
+#else
+    const size_t size = roundUp(bytes, hugePageSize);
+    // huge pages need an aligned range, so map one more and trim the ends
+    const size_t slack = settings.hugePages ? hugePageSize : 0;
+    char *mapped = static_cast<char *>(mmap(nullptr, size + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (mapped == MAP_FAILED)
+        return nullptr;
+    char *data = mapped;
+    if (slack > 0)
+    {
+        data = reinterpret_cast<char *>(roundUp(reinterpret_cast<uintptr_t>(mapped), hugePageSize));
+        if (data > mapped)
+            munmap(mapped, data - mapped);
+        if (mapped + slack > data)
+            munmap(data + size, mapped + slack - data);
+        madvise(data, size, MADV_HUGEPAGE);
+    }
+#endif
+    if (settings.firstTouch)
+        firstTouch(data, bytes);
+    return data;
+}
+
+void MemoryPlacement::release(void *data, size_t bytes)
+{
+#ifdef _WIN32
+    VirtualFree(data, 0, MEM_RELEASE);
+#else
+    munmap(data, roundUp(bytes, hugePageSize));
+#endif
+}
+
+void MemoryPlacement::firstTouch(char *data, size_t bytes)
+{
+    // the os places a page on the node of the thread that writes it first
+    const size_t page = pageSize();
+    const long pages = static_cast<long>((bytes + page - 1) / page);
+#pragma omp parallel for schedule(static)
+    for (long i = 0; i < pages; ++i)
+        data[i * page] = 0;
+}
+
+void MemoryPlacement::pinThreads()
+{
+    // the omp threads persist between parallel regions, so they stay pinned for the whole run
+    if (settings.affinity == ThreadAffinity::None)
+        return;
+    const Topology &t = topology();
+    std::vector<int> compact;
+    for (const std::vector<int> &cpus : t.nodeCpus)
+        compact.insert(compact.end(), cpus.begin(), cpus.end());
+    int failures = 0;
+#pragma omp parallel reduction(+ : failures)
+    {
+        const int thread = omp_get_thread_num();
+        int cpu;
+        if (settings.affinity == ThreadAffinity::Compact)
+            cpu = compact[thread % compact.size()];
+        else
+        {
+            const std::vector<int> &cpus = t.nodeCpus[thread % t.nodeCpus.size()];
+            cpu = cpus[(thread / t.nodeCpus.size()) % cpus.size()];
+        }
+        failures += !pinCurrentThread(cpu);
+    }
+    if (failures > 0)
+        std::cerr << "Failed to pin " << failures << " threads" << std::endl;
+}
+
+size_t MemoryPlacement::physicalMemory()
+{
+#ifdef _WIN32
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    return GlobalMemoryStatusEx(&status) ? static_cast<size_t>(status.ullTotalPhys) : 0;
+#else
+    long pages = sysconf(_SC_PHYS_PAGES);
+    return pages > 0 ? static_cast<size_t>(pages) * pageSize() : 0;
+#endif
+}
+
+int MemoryPlacement::nodeCount()
+{
+    return static_cast<int>(topology().nodeCpus.size());
+}
+
+void MemoryPlacement::countRemotePages(const void *data, size_t count, size_t elementSize, const std::vector<int> &elementThread,
+                                       size_t &remote, size_t &present)
+{
+    const size_t bytes = count * elementSize;
+    const size_t page = pageSize();
+    const uintptr_t first = reinterpret_cast<uintptr_t>(data) / page * page;
+    const size_t pages = bytes == 0 ? 0 : (reinterpret_cast<uintptr_t>(data) + bytes - first + page - 1) / page;
+    if (pages == 0)
+        return;
+    if (nodeCount() == 1)
+    {
+        present += pages;
+        return;
+    }
+
+    // where each thread runs right now, which is where it stays once pinned
+    std::vector<int> threadNode(omp_get_max_threads(), 0);
+    int threads = 1;
+#pragma omp parallel
+    {
+        threadNode[omp_get_thread_num()] = currentNode();
+#pragma omp single
+        threads = omp_get_num_threads();
+    }
+
+    std::vector<int> pageNode(pages, -1);
+#ifdef _WIN32
+    std::vector<PSAPI_WORKING_SET_EX_INFORMATION> info(pages);
+    for (size_t i = 0; i < pages; ++i)
+        info[i].VirtualAddress = reinterpret_cast<void *>(first + i * page);
+    if (!QueryWorkingSetEx(GetCurrentProcess(), info.data(), static_cast<DWORD>(pages * sizeof(info[0]))))
+        return;
+    for (size_t i = 0; i < pages; ++i)
+    {
+        if (info[i].VirtualAttributes.Valid)
+            pageNode[i] = static_cast<int>(info[i].VirtualAttributes.Node);
+    }
+#else
+    // move_pages without target nodes only reports where the pages are
+    std::vector<void *> addresses(pages);
+    for (size_t i = 0; i < pages; ++i)
+        addresses[i] = reinterpret_cast<void *>(first + i * page);
+    if (syscall(SYS_move_pages, 0, pages, addresses.data(), nullptr, pageNode.data(), 0) != 0)
+        return;
+#endif
+    const size_t chunk = std::max<size_t>((count + threads - 1) / threads, 1);
+    for (size_t i = 0; i < pages; ++i)
+    {
+        if (pageNode[i] < 0)
+            continue;
+        // the first page can start before the array
+        const uintptr_t start = std::max(first + i * page, reinterpret_cast<uintptr_t>(data));
+        const size_t element = (start - reinterpret_cast<uintptr_t>(data)) / elementSize;
+        const int thread = elementThread.empty() ? static_cast<int>(element / chunk) : elementThread[element];
+        present++;
+        remote += thread >= 0 && thread < threads && pageNode[i] != threadNode[thread];
+    }
+}
+
+bool MemoryPlacement::parseAffinity(const std::string &name, ThreadAffinity &affinity)
+{
+    if (name == "none")
+        affinity = ThreadAffinity::None;
+    else if (name == "compact")
+        affinity = ThreadAffinity::Compact;
+    else if (name == "spread")
+        affinity = ThreadAffinity::Spread;
+    else
+        return false;
+    return true;
+}
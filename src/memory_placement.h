@@ -0,0 +1,81 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <string>
+#include <vector>
+
+enum class ThreadAffinity
+{
+    None,    // left to the os
+    Compact, // fills the cores of one node before the next
+    Spread,  // deals the threads round robin over the nodes
+};
+
+struct PlacementSettings
+{
+    bool firstTouch = true; // large arrays are touched by the omp threads in static chunks
+    bool hugePages = false; // transparent huge pages (large pages on windows) for large arrays
+    ThreadAffinity affinity = ThreadAffinity::None;
+};
+
+class MemoryPlacement
+{
+    // where the large solver arrays live. they come straight from the os and their pages are first
+    // touched by the same static omp partition the particle loops use, so on a multi-socket machine
+    // each thread's share of an array sits on its own node. with a full particle pool the partition
+    // of the allocation and of the particles are the same, and ParticleSystem::reorderParticles keeps
+    // each share a strip of grid rows
+public:
+    static PlacementSettings settings;
+    static constexpr size_t largeSize = 1 << 20; // smaller arrays go through the heap as usual
+
+    static void *allocate(size_t bytes);
+    static void release(void *data, size_t bytes);
+    static void pinThreads();
+    static int nodeCount();
+    static size_t physicalMemory(); // bytes installed, 0 when unknown
+    // pages of an array on another node than the thread that works on the element at the page's
+    // start. an empty elementThread stands for static chunks of the elements
+    static void countRemotePages(const void *data, size_t count, size_t elementSize, const std::vector<int> &elementThread,
+                                 size_t &remote, size_t &present);
+    static bool parseAffinity(const std::string &name, ThreadAffinity &affinity);
+
+private:
+    static size_t pageSize();
+    static void firstTouch(char *data, size_t bytes);
+};
+
+template <class T>
+struct PlacedAllocator
+{
+    using value_type = T;
+
+    PlacedAllocator() = default;
+    template <class U>
+    PlacedAllocator(const PlacedAllocator<U> &) {}
+
+    T *allocate(size_t n)
+    {
+        if (n * sizeof(T) < MemoryPlacement::largeSize)
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        void *data = MemoryPlacement::allocate(n * sizeof(T));
+        if (data == nullptr)
+            throw std::bad_alloc();
+        return static_cast<T *>(data);
+    }
+    void deallocate(T *data, size_t n)
+    {
+        if (n * sizeof(T) < MemoryPlacement::largeSize)
+            ::operator delete(data);
+        else
+            MemoryPlacement::release(data, n * sizeof(T));
+    }
+
+    template <class U>
+    bool operator==(const PlacedAllocator<U> &) const { return true; }
+    template <class U>
+    bool operator!=(const PlacedAllocator<U> &) const { return false; }
+};
+
+template <class T>
+using PlacedVector = std::vector<T, PlacedAllocator<T>>;
@@ -0,0 +1,186 @@
+#include "metrics_server.h"
+#include <SFML/Network.hpp>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <unistd.h>
+#endif
+
+bool MetricsServer::start(unsigned short port)
+{
+    stop();
+    // bound here, so a port in use fails the call instead of the server thread
+    if (listener.listen(port, sf::IpAddress::LocalHost) != sf::Socket::Status::Done)
+    {
+        std::cerr << "Metrics server failed to listen on port " << port << std::endl;
+        return false;
+    }
+    std::cout << "Serving metrics on http://127.0.0.1:" << port << "/metrics" << std::endl;
+    stopping = false;
+    running = true;
+    lastStepTime = std::chrono::steady_clock::now();
+    server = std::thread(&MetricsServer::serve, this);
+    return true;
+}
+
+void MetricsServer::stop()
+{
+    if (!server.joinable())
+        return;
+    stopping = true;
+    server.join();
+    listener.close();
+    running = false;
+}
+
+void MetricsServer::publish(const ParticleSystem &particleSystem, const StabilityWatchdog *watchdog)
+{
+    if (!running)
+        return;
+
+    const TelemetryFrame &t = particleSystem.telemetry.last;
+    MetricsSnapshot &s = buffers[writeIndex];
+    s.step = particleSystem.stepCounter;
+    s.stepsTotal = ++stepsTotal; // published once per step
+    s.particleCount = static_cast<int>(particleSystem.particlePosition.size());
+    s.sleepingParticles = particleSystem.stepStats.sleepingParticles;
+    for (int i = 0; i < PhaseCount; ++i)
+        s.phaseTime[i] = t.phaseTime[i];
+    s.meanDensityError = t.meanDensityError;
+    s.meanNeighbors = t.meanNeighbors;
+    s.candidatesPerNeighbor = t.candidatesPerNeighbor;
+    s.cellDivisions = t.cellDivisions;
+    s.kineticEnergy = t.kineticEnergy;
+    s.maxSpeed = t.maxSpeed;
+    s.loadImbalance = t.loadImbalance;
+    s.partitionImbalance = t.partitionImbalance;
+    forceClampsTotal += t.forceClamps;
+    velocityClampsTotal += t.velocityClamps;
+    s.forceClampsTotal = forceClampsTotal;
+    s.velocityClampsTotal = velocityClampsTotal;
+    s.watchdogRollbacks = watchdog ? watchdog->rollbackCount : 0;
+    s.watchdogTimeStepScale = watchdog ? watchdog->timeStepScale : 1.0f;
+    s.particleMemoryBytes = particleSystem.reservedBytes();
+    s.bytesPerParticle = s.particleCount > 0 ? static_cast<float>(s.particleMemoryBytes) / s.particleCount : 0.0f;
+
+    // smoothed rate of the steps run, one per publish
+    auto now = std::chrono::steady_clock::now();
+    float elapsed = std::chrono::duration<float>(now - lastStepTime).count();
+    if (elapsed > 0.0f)
+    {
+        float rate = 1.0f / elapsed;
+        stepsPerSecond = stepsPerSecond > 0.0f ? stepsPerSecond * 0.9f + rate * 0.1f : rate;
+    }
+    s.stepsPerSecond = stepsPerSecond;
+    lastStepTime = now;
+
+    writeIndex = middle.exchange(writeIndex | freshBit, std::memory_order_acq_rel) & 3;
+}
+
+const MetricsSnapshot &MetricsServer::readLatest()
+{
+    if (middle.load(std::memory_order_acquire) & freshBit)
+        readIndex = middle.exchange(readIndex, std::memory_order_acq_rel) & 3;
+    return buffers[readIndex];
+}
+
+void MetricsServer::serve()
+{
+    sf::SocketSelector selector;
+    selector.add(listener);
+    while (!stopping)
+    {
+        if (!selector.wait(sf::milliseconds(100)) || !selector.isReady(listener))
+            continue;
+        sf::TcpSocket client;
+        if (listener.accept(client) != sf::Socket::Status::Done)
+            continue;
+
+        // the request itself does not matter, every path returns the metrics
+        char request[1024];
+        std::size_t received = 0;
+        sf::SocketSelector clientSelector;
+        clientSelector.add(client);
+        if (clientSelector.wait(sf::milliseconds(500)))
+            (void)client.receive(request, sizeof(request), received);
+
+        std::string body = format(readLatest());
+        std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                               std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        (void)client.send(response.data(), response.size());
+        client.disconnect();
+        scrapeCount++;
+    }
+}
+
+std::string MetricsServer::format(const MetricsSnapshot &s) const
+{
+    std::ostringstream out;
+    auto metric = [&out](const char *name, const char *type, const char *help)
+    {
+        out << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
+    };
+
+    metric("fluid_steps_total", "counter", "Solver steps run since the run started, rolled back ones included.");
+    out << "fluid_steps_total " << s.stepsTotal << '\n';
+    metric("fluid_step", "gauge", "Step of the simulation state, goes back after a watchdog rollback.");
+    out << "fluid_step " << s.step << '\n';
+    metric("fluid_steps_per_second", "gauge", "Smoothed solver step rate.");
+    out << "fluid_steps_per_second " << s.stepsPerSecond << '\n';
+    metric("fluid_particles", "gauge", "Number of particles.");
+    out << "fluid_particles " << s.particleCount << '\n';
+    metric("fluid_sleeping_particles", "gauge", "Particles in sleeping cells, skipped by the solver.");
+    out << "fluid_sleeping_particles " << s.sleepingParticles << '\n';
+    metric("fluid_phase_seconds", "gauge", "Duration of each solver phase in the last step.");
+    for (int i = 0; i < PhaseCount; ++i)
+        out << "fluid_phase_seconds{phase=\"" << telemetryPhaseNames[i] << "\"} " << s.phaseTime[i] * 1e-6f << '\n';
+    metric("fluid_density_residual", "gauge", "Mean relative density error against the target density.");
+    out << "fluid_density_residual " << s.meanDensityError << '\n';
+    metric("fluid_mean_neighbors", "gauge", "Mean neighbor count per particle.");
+    out << "fluid_mean_neighbors " << s.meanNeighbors << '\n';
+    metric("fluid_candidates_per_neighbor", "gauge", "Particles the density searches tested per neighbor found.");
+    out << "fluid_candidates_per_neighbor " << s.candidatesPerNeighbor << '\n';
+    metric("fluid_cell_divisions", "gauge", "Neighbor grid cells per sample radius.");
+    out << "fluid_cell_divisions " << s.cellDivisions << '\n';
+    metric("fluid_kinetic_energy", "gauge", "Total kinetic energy.");
+    out << "fluid_kinetic_energy " << s.kineticEnergy << '\n';
+    metric("fluid_max_speed", "gauge", "Largest particle speed.");
+    out << "fluid_max_speed " << s.maxSpeed << '\n';
+    metric("fluid_load_imbalance", "gauge", "Busiest thread's time in the parallel phases over the mean, 1 when even.");
+    out << "fluid_load_imbalance " << s.loadImbalance << '\n';
+    metric("fluid_partition_imbalance", "gauge", "Largest particle chunk's estimated cost over the mean, 0 when split by index.");
+    out << "fluid_partition_imbalance " << s.partitionImbalance << '\n';
+    metric("fluid_clamps_total", "counter", "Forces and velocities clamped by the solver.");
+    out << "fluid_clamps_total{kind=\"force\"} " << s.forceClampsTotal << '\n';
+    out << "fluid_clamps_total{kind=\"velocity\"} " << s.velocityClampsTotal << '\n';
+    metric("fluid_watchdog_rollbacks_total", "counter", "Rollbacks done by the stability watchdog.");
+    out << "fluid_watchdog_rollbacks_total " << s.watchdogRollbacks << '\n';
+    metric("fluid_watchdog_time_step_scale", "gauge", "Time step scale applied by the stability watchdog.");
+    out << "fluid_watchdog_time_step_scale " << s.watchdogTimeStepScale << '\n';
+    metric("fluid_particle_memory_bytes", "gauge", "Bytes reserved by the particle and cell arrays.");
+    out << "fluid_particle_memory_bytes " << s.particleMemoryBytes << '\n';
+    metric("fluid_bytes_per_particle", "gauge", "Reserved particle and cell bytes over the particle count.");
+    out << "fluid_bytes_per_particle " << s.bytesPerParticle << '\n';
+    metric("fluid_process_resident_bytes", "gauge", "Resident memory of the process.");
+    out << "fluid_process_resident_bytes " << getProcessResidentBytes() << '\n';
+    return out.str();
+}
+
+uint64_t getProcessResidentBytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.WorkingSetSize;
+    return 0;
+#else
+    std::ifstream statm("/proc/self/statm");
+    uint64_t size = 0, resident = 0;
+    statm >> size >> resident;
+    return resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
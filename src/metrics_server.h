@@ -0,0 +1,74 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <SFML/Network/TcpListener.hpp>
+#include "particle_system.h"
+#include "watchdog.h"
+
+struct MetricsSnapshot
+{
+    uint64_t step = 0;       // of the simulation state, goes back after a watchdog rollback
+    uint64_t stepsTotal = 0; // steps run, keeps counting through rollbacks
+    int particleCount = 0;
+    int sleepingParticles = 0;
+    float stepsPerSecond = 0.0f;
+    float phaseTime[PhaseCount] = {}; // us
+    float meanDensityError = 0.0f;
+    float meanNeighbors = 0.0f;
+    float candidatesPerNeighbor = 0.0f;
+    int cellDivisions = 1;
+    float kineticEnergy = 0.0f;
+    float maxSpeed = 0.0f;
+    float loadImbalance = 1.0f;
+    float partitionImbalance = 0.0f;
+    uint64_t forceClampsTotal = 0;
+    uint64_t velocityClampsTotal = 0;
+    int watchdogRollbacks = 0;
+    float watchdogTimeStepScale = 1.0f;
+    uint64_t particleMemoryBytes = 0;
+    float bytesPerParticle = 0.0f;
+};
+
+class MetricsServer
+{
+    // serves the latest snapshot as prometheus text on a localhost tcp port. the simulation
+    // thread only copies a snapshot into a wait-free triple buffer; formatting and socket
+    // work happen on the server thread, so a slow scraper never stalls a step
+public:
+    ~MetricsServer() { stop(); }
+    bool start(unsigned short port); // false when the port cannot be listened on
+
+    void stop();
+    bool isRunning() const { return running; }
+    void publish(const ParticleSystem &particleSystem, const StabilityWatchdog *watchdog);
+
+    std::atomic<uint64_t> scrapeCount{0};
+
+private:
+    static constexpr int freshBit = 4;
+
+    MetricsSnapshot buffers[3];
+    std::atomic<int> middle{1};
+    int writeIndex = 0;
+    int readIndex = 2;
+
+    sf::TcpListener listener; // bound by start, accepted on by the server thread
+    std::thread server;
+    std::atomic<bool> running{false};
+    std::atomic<bool> stopping{false};
+
+    uint64_t forceClampsTotal = 0;
+    uint64_t velocityClampsTotal = 0;
+    uint64_t stepsTotal = 0;
+    float stepsPerSecond = 0.0f;
+    std::chrono::steady_clock::time_point lastStepTime;
+
+    const MetricsSnapshot &readLatest();
+    void serve();
+    std::string format(const MetricsSnapshot &snapshot) const;
+};
+
+uint64_t getProcessResidentBytes();
@@ -0,0 +1,306 @@
+#include "obstacle_field.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+void ObstacleField::addCircle(sf::Vector2f center, float radius)
+{
+    shapes.push_back({ObstacleType::Circle, center, {radius, radius}});
+    distanceDirty = true;
+}
+
+void ObstacleField::addBox(sf::Vector2f center, sf::Vector2f halfSize)
+{
+    shapes.push_back({ObstacleType::Box, center, halfSize});
+    distanceDirty = true;
+}
+
+bool ObstacleField::loadImage(const std::string &path)
+{
+    // dark opaque pixels are solid, so both black on white and black on transparent work
+    sf::Image image;
+    if (!image.loadFromFile(path))
+    {
+        std::cerr << "Failed to load obstacle image " << path << std::endl;
+        return false;
+    }
+    imageSize = image.getSize();
+    imageMask.assign(imageSize.x * imageSize.y, 0);
+    for (unsigned y = 0; y < imageSize.y; ++y)
+    {
+        for (unsigned x = 0; x < imageSize.x; ++x)
+        {
+            sf::Color c = image.getPixel({x, y});
+            imageMask[x + y * imageSize.x] = c.a > 127 && c.r + c.g + c.b < 3 * 128;
+        }
+    }
+    distanceDirty = true;
+    return true;
+}
+
+void ObstacleField::clear()
+{
+    shapes.clear();
+    imageMask.clear();
+    distanceDirty = true;
+}
+
+void ObstacleField::prepare(sf::Vector2u domain, float cellSize, float radius, sf::Vector2<bool> walls, const std::function<float(float)> &kernel)
+{
+    if (domain != this->domain || cellSize != this->cellSize)
+    {
+        this->domain = domain;
+        this->cellSize = cellSize;
+        distanceDirty = true;
+    }
+    if (distanceDirty)
+    {
+        rasterize();
+        distanceDirty = false;
+    }
+    if (volumeVersion != version || radius != volumeRadius || walls != volumeWalls)
+        buildVolume(radius, walls, kernel);
+}
+
+void ObstacleField::rasterize()
+{
+    cols = static_cast<int>(domain.x / cellSize) + 1;
+    rows = static_cast<int>(domain.y / cellSize) + 1;
+    distance.assign(cols * rows, 1e9f);
+
+    if (!imageMask.empty())
+    {
+        std::vector<uint8_t> solid(cols * rows);
+        for (int y = 0; y < rows; ++y)
+        {
+            for (int x = 0; x < cols; ++x)
+            {
+                unsigned ix = std::min<unsigned>(x * cellSize * imageSize.x / std::max(domain.x, 1u), imageSize.x - 1);
+                unsigned iy = std::min<unsigned>(y * cellSize * imageSize.y / std::max(domain.y, 1u), imageSize.y - 1);
+                solid[x + y * cols] = imageMask[ix + iy * imageSize.x];
+            }
+        }
+        distanceTransform(solid);
+    }
+
+    // primitives have exact distances, the union is the minimum
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < rows; ++y)
+    {
+        for (int x = 0; x < cols; ++x)
+        {
+            sf::Vector2f p(x * cellSize, y * cellSize);
+            float &d = distance[x + y * cols];
+            for (const ObstacleShape &shape : shapes)
+            {
+                sf::Vector2f q = p - shape.center;
+                if (shape.type == ObstacleType::Circle)
+                {
+                    d = std::min(d, q.length() - shape.size.x);
+                    continue;
+                }
+                sf::Vector2f e(std::abs(q.x) - shape.size.x, std::abs(q.y) - shape.size.y);
+                sf::Vector2f outside(std::max(e.x, 0.0f), std::max(e.y, 0.0f));
+                d = std::min(d, outside.length() + std::min(std::max(e.x, e.y), 0.0f));
+            }
+        }
+    }
+    version++;
+}
+
+void ObstacleField::distanceTransform(std::vector<uint8_t> &solid)
+{
+    // two pass propagation of the nearest node of the other kind (dead reckoning),
+    // once towards solid nodes for the outside and once towards free nodes for the inside
+    const int count = cols * rows;
+    std::vector<int> nearest(count);
+    std::vector<float> reach(count);
+    for (int inside = 0; inside < 2; ++inside)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            bool target = solid[i] != inside;
+            nearest[i] = target ? i : -1;
+            reach[i] = target ? 0.0f : 1e9f;
+        }
+        auto relax = [&](int x, int y, int nx, int ny)
+        {
+            if (nx < 0 || ny < 0 || nx >= cols || ny >= rows)
+                return;
+            int n = nearest[nx + ny * cols];
+            if (n < 0)
+                return;
+            float dx = static_cast<float>(x - n % cols);
+            float dy = static_cast<float>(y - n / cols);
+            float d = std::sqrt(dx * dx + dy * dy);
+            if (d < reach[x + y * cols])
+            {
+                reach[x + y * cols] = d;
+                nearest[x + y * cols] = n;
+            }
+        };
+        for (int y = 0; y < rows; ++y)
+        {
+            for (int x = 0; x < cols; ++x)
+            {
+                relax(x, y, x - 1, y - 1);
+                relax(x, y, x, y - 1);
+                relax(x, y, x + 1, y - 1);
+                relax(x, y, x - 1, y);
+            }
+            for (int x = cols - 1; x >= 0; --x)
+                relax(x, y, x + 1, y);
+        }
+        for (int y = rows - 1; y >= 0; --y)
+        {
+            for (int x = cols - 1; x >= 0; --x)
+            {
+                relax(x, y, x + 1, y + 1);
+                relax(x, y, x, y + 1);
+                relax(x, y, x - 1, y + 1);
+                relax(x, y, x + 1, y);
+            }
+            for (int x = 0; x < cols; ++x)
+                relax(x, y, x - 1, y);
+        }
+        // the surface lies half a cell between a solid and a free node
+        for (int i = 0; i < count; ++i)
+        {
+            if (solid[i] == inside)
+                distance[i] = (inside ? -1.0f : 1.0f) * (reach[i] - 0.5f) * cellSize;
+        }
+    }
+}
+
+void ObstacleField::buildVolume(float radius, sf::Vector2<bool> walls, const std::function<float(float)> &kernel)
+{
+    // the kernel weight of every node offset within the radius, times the area of a cell
+    struct Tap
+    {
+        int dx;
+        int dy;
+        float weight;
+    };
+    std::vector<Tap> taps;
+    int reach = static_cast<int>(std::ceil(radius / cellSize));
+    for (int dy = -reach; dy <= reach; ++dy)
+    {
+        for (int dx = -reach; dx <= reach; ++dx)
+        {
+            float d = std::sqrt(static_cast<float>(dx * dx + dy * dy)) * cellSize;
+            if (d < radius)
+                taps.push_back({dx, dy, kernel(d) * cellSize * cellSize});
+        }
+    }
+
+    // outside the domain counts as solid on the axes whose window edges are walls too
+    volume.assign(cols * rows, 0.0f);
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < rows; ++y)
+    {
+        for (int x = 0; x < cols; ++x)
+        {
+            float v = 0.0f;
+            for (const Tap &tap : taps)
+            {
+                int nx = x + tap.dx;
+                int ny = y + tap.dy;
+                bool solid;
+                if (nx < 0 || nx >= cols)
+                    solid = walls.x;
+                else if (ny < 0 || ny >= rows)
+                    solid = walls.y;
+                else
+                    solid = distance[nx + ny * cols] < 0.0f;
+                v += solid ? tap.weight : 0.0f;
+            }
+            volume[x + y * cols] = v;
+        }
+    }
+
+    volumeGradient.assign(cols * rows, sf::Vector2f(0.0f, 0.0f));
+    for (int y = 0; y < rows; ++y)
+    {
+        for (int x = 0; x < cols; ++x)
+        {
+            int x0 = std::max(x - 1, 0), x1 = std::min(x + 1, cols - 1);
+            int y0 = std::max(y - 1, 0), y1 = std::min(y + 1, rows - 1);
+            volumeGradient[x + y * cols] = sf::Vector2f(
+                (volume[x1 + y * cols] - volume[x0 + y * cols]) / ((x1 - x0) * cellSize),
+                (volume[x + y1 * cols] - volume[x + y0 * cols]) / ((y1 - y0) * cellSize));
+        }
+    }
+
+    volumeRadius = radius;
+    volumeWalls = walls;
+    volumeVersion = version;
+}
+
+template <class T>
+T ObstacleField::sample(const std::vector<T> &grid, sf::Vector2f pos) const
+{
+    // bilinear, positions outside the grid are clamped to its edge
+    float fx = std::clamp(pos.x / cellSize, 0.0f, cols - 1.001f);
+    float fy = std::clamp(pos.y / cellSize, 0.0f, rows - 1.001f);
+    int x = static_cast<int>(fx);
+    int y = static_cast<int>(fy);
+    float tx = fx - x;
+    float ty = fy - y;
+    const T *row0 = &grid[x + y * cols];
+    const T *row1 = row0 + cols;
+    return (row0[0] * (1.0f - tx) + row0[1] * tx) * (1.0f - ty) + (row1[0] * (1.0f - tx) + row1[1] * tx) * ty;
+}
+
+float ObstacleField::sampleDistance(sf::Vector2f pos) const
+{
+    return distance.empty() ? 1e9f : sample(distance, pos);
+}
+
+sf::Vector2f ObstacleField::sampleNormal(sf::Vector2f pos) const
+{
+    float e = cellSize * 0.5f;
+    sf::Vector2f gradient(sampleDistance(pos + sf::Vector2f(e, 0.0f)) - sampleDistance(pos - sf::Vector2f(e, 0.0f)),
+                          sampleDistance(pos + sf::Vector2f(0.0f, e)) - sampleDistance(pos - sf::Vector2f(0.0f, e)));
+    float length = gradient.length();
+    return length > 0.0f ? gradient / length : sf::Vector2f(0.0f, -1.0f);
+}
+
+float ObstacleField::sampleVolume(sf::Vector2f pos) const
+{
+    return volume.empty() ? 0.0f : sample(volume, pos);
+}
+
+sf::Vector2f ObstacleField::sampleVolumeGradient(sf::Vector2f pos) const
+{
+    return volumeGradient.empty() ? sf::Vector2f(0.0f, 0.0f) : sample(volumeGradient, pos);
+}
+
+bool ObstacleField::collide(sf::Vector2f &position, sf::Vector2f &velocity, float radius, float damping) const
+{
+    if (!hasSolid())
+        return false;
+    float d = sampleDistance(position) - radius;
+    if (d >= 0.0f)
+        return false;
+    // push out along the surface normal and reflect the normal part of the velocity
+    sf::Vector2f normal = sampleNormal(position);
+    position -= normal * d;
+    float normalSpeed = velocity.x * normal.x + velocity.y * normal.y;
+    if (normalSpeed < 0.0f)
+        velocity -= normal * ((1.0f + damping) * normalSpeed);
+    return true;
+}
+
+sf::Image ObstacleField::toImage(sf::Color color) const
+{
+    sf::Image image({static_cast<unsigned>(std::max(cols, 1)), static_cast<unsigned>(std::max(rows, 1))}, sf::Color::Transparent);
+    for (int y = 0; y < rows; ++y)
+    {
+        for (int x = 0; x < cols; ++x)
+        {
+            if (distance[x + y * cols] < 0.0f)
+                image.setPixel({static_cast<unsigned>(x), static_cast<unsigned>(y)}, color);
+        }
+    }
+    return image;
+}
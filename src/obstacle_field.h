@@ -0,0 +1,67 @@
+#pragma once
+#include <SFML/Graphics.hpp>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+enum class ObstacleType
+{
+    Circle,
+    Box
+};
+
+struct ObstacleShape
+{
+    ObstacleType type;
+    sf::Vector2f center;
+    sf::Vector2f size; // radius in x for circles, half extents for boxes
+};
+
+class ObstacleField
+{
+    // static obstacles rasterised into a signed distance grid (negative inside), plus a
+    // volume map holding the kernel weighted solid volume around every node, so the
+    // solver's wall queries are a bilinear lookup whatever the shapes look like
+public:
+    float cellSize = 4.0f;
+    int cols = 0; // nodes per row
+    int rows = 0;
+    std::vector<float> distance;
+    std::vector<float> volume;
+    std::vector<sf::Vector2f> volumeGradient;
+    std::vector<ObstacleShape> shapes;
+    uint32_t version = 0; // bumped whenever the solid region changes
+
+    void addCircle(sf::Vector2f center, float radius);
+    void addBox(sf::Vector2f center, sf::Vector2f halfSize);
+    bool loadImage(const std::string &path);
+    void clear();
+    bool hasSolid() const { return !shapes.empty() || !imageMask.empty(); }
+
+    // rebuilds what changed since the last call, kernel is the normalised density kernel
+    // walls says per axis whether the window edges are solid, a periodic axis has open edges
+    void prepare(sf::Vector2u domain, float cellSize, float radius, sf::Vector2<bool> walls, const std::function<float(float)> &kernel);
+
+    float sampleDistance(sf::Vector2f pos) const;
+    sf::Vector2f sampleNormal(sf::Vector2f pos) const;
+    float sampleVolume(sf::Vector2f pos) const;
+    sf::Vector2f sampleVolumeGradient(sf::Vector2f pos) const;
+    bool collide(sf::Vector2f &position, sf::Vector2f &velocity, float radius, float damping) const;
+    sf::Image toImage(sf::Color color) const;
+
+private:
+    sf::Vector2u domain;
+    bool distanceDirty = true;
+    float volumeRadius = 0.0f;
+    sf::Vector2<bool> volumeWalls;
+    uint32_t volumeVersion = ~0u;
+    std::vector<uint8_t> imageMask; // solid pixels of the loaded image, stretched over the domain
+    sf::Vector2u imageSize;
+
+    void rasterize();
+    void buildVolume(float radius, sf::Vector2<bool> walls, const std::function<float(float)> &kernel);
+    void distanceTransform(std::vector<uint8_t> &solid);
+    template <class T>
+    T sample(const std::vector<T> &grid, sf::Vector2f pos) const;
+};
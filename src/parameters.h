@@ -1,4 +1,14 @@
+#pragma once
 #include <SFML/Graphics.hpp>
+struct FluidPhase
+{
+    // relative to the base fluid, which is phase 0
+    float densityScale; // rest density
+    float massScale;
+    float viscosityScale;
+    sf::Color tint;
+};
+
 struct Parameters
 {
     static Parameters DEFAULT;
@@ -6,24 +16,63 @@ struct Parameters
     unsigned windowHeight = 800;
     int targetFps = 60;
     int particleCount = 1200;
+    int particleCapacity = 4096; // reserved up front, emitters stop here
+    int memoryBudgetMB = 0;      // for the particles and the grid, 0 allows three quarters of the physical memory
     float particleMass = 100.0f;
     float timeScale = 1.0f;
     int stepCount = 2;
+    int densityHistorySize = 2;
     float targetDensity = 0.1f;
     float forceStrength = 6.0f;
     float viscosity = 1.2f;
     float interactForceRadius = 120.0f;
     float interactForceStrength = 8.0f;
     float densitySampleRadius = 50.0f;
+    int cellDivisions = 0; // neighbour grid cells per sample radius, 1 to 3; 0 picks them from the measured density
     float collisionDamping = 0.3f;
     float movingDamping = 0.1f;
     float gravityStrength = 1.0f;
+    float densityFieldCellSize = 10.0f;
+    float emitterRate = 20.0f; // particles per unit of simulated time
+    float sinkRadius = 40.0f;
+    float obstacleCellSize = 4.0f; // resolution of the obstacle distance and volume grids
+    float obstacleRadius = 40.0f;
+    static constexpr int maxPhases = 4;
+    int phaseCount = 1; // the initial block is split into one horizontal band per phase
+    int spawnPhase = 0; // of particles added by emitters and the count slider
+    FluidPhase phases[maxPhases] = {
+        {1.0f, 1.0f, 1.0f, sf::Color(60, 170, 255)},
+        {2.0f, 2.0f, 0.5f, sf::Color(255, 150, 60)},
+        {0.5f, 0.5f, 2.0f, sf::Color(110, 255, 140)},
+        {1.0f, 1.0f, 8.0f, sf::Color(230, 90, 210)}};
+    float bodySize = 40.0f;
+    float bodyDensity = 0.02f; // mass per unit area of new rigid bodies
+    float watchdogMaxSpeed = 450.0f;
+    float watchdogEnergyGrowth = 4.0f;
+    float watchdogClampFraction = 0.02f;
+    float sleepSpeed = 2.0f;           // cells whose particles stay slower than this...
+    float sleepDensityChange = 0.002f; // ...and whose mean density changes less than this per step
+    int sleepSteps = 60;               // ...for this many steps are put to sleep
+    int taskBlockCells = 4;            // side of the blocks the task graph schedules, in sample radii
+    int workBalance = 2;               // WorkBalance of the loops outside the task graph
+    int reorderSteps = 50;             // steps between moving the particle arrays into cell order, 0 never
+    int tileCacheKB = 256;             // cache share of one thread a packed tile and its ring fill
     sf::Color backgroundColor = sf::Color(21, 5, 30);
     bool debugMode = false;
     bool enableGravity = true;
     bool showParticles = false;
     bool showGrid = true;
     bool showDensity = true;
+    bool showContour = false;
     bool showFrameTime = false;
+    bool showTelemetry = false;
     bool enableAdjustingForce = false;
+    bool enableWatchdog = true;
+    bool enableSleeping = true;
+    bool enableTaskGraph = true;       // block tasks instead of a barrier after every phase
+    bool reducedMemory = false;        // density and pressure at the moved positions, the predictions are not stored
+    bool enableTiling = false;         // the neighbour phases run on packed tiles of cells, instead of the task graph
+    bool enableBoundaryDensity = true; // walls and obstacles count as fluid at the target density
+    bool periodicX = false;            // the left and right edges are joined instead of being walls
+    bool periodicY = false;            // the same for the top and bottom edges
 };
@@ -0,0 +1,20 @@
+#pragma once
+#include <cstdint>
+#include <tuple>
+
+template <class Index>
+struct IndexWidth
+{
+    // the integer the particle slots and cell starts are stored in. 32 bits address 2^31 particles
+    // and cells at half the memory of 64
+    using ParticleIndex = Index;
+    using CellSlot = std::tuple<Index, Index>; // a particle and its cell, sorted by cell
+};
+
+#ifdef FLUID_INDEX_64
+using Indices = IndexWidth<int64_t>;
+#else
+using Indices = IndexWidth<int32_t>;
+#endif
+using ParticleIndex = Indices::ParticleIndex;
+using CellSlot = Indices::CellSlot;
@@ -1,211 +1,1118 @@
 #include "particle_system.h"
 #include <cmath>
+#include <cstring>
 #include <stdexcept>
 #include <iostream>
 #include <chrono>
 #include <omp.h>
 
-ParticleSystem::ParticleSystem(Parameters &params) : params(params)
+ParticleSystem::ParticleSystem(const Parameters &params) : params(params)
 {
     forceStrengthOriginal = params.forceStrength;
 }
 
+template <size_t... Variants>
+constexpr std::array<ParticleSystem::StepFunction, sizeof...(Variants)> ParticleSystem::makeStepTable(std::index_sequence<Variants...>)
+{
+    // bit 0 gravity, 1 adjusting force, 2 sleeping, 3 walls and obstacles, 4 more than one phase
+    return {&ParticleSystem::step<(Variants & 1) != 0, (Variants & 2) != 0, (Variants & 4) != 0, (Variants & 8) != 0, (Variants & 16) != 0, QuadraticKernel>...};
+}
+
 void ParticleSystem::updateParticles(float timeStep)
 {
-    debugTimerT.reset();
+    // the feature flags pick a specialised step once, so the particle loops carry no branches on them
+    static constexpr auto steps = makeStepTable(std::make_index_sequence<32>());
+    int variant = params.enableGravity | params.enableAdjustingForce << 1 | params.enableSleeping << 2 |
+                  ((params.enableBoundaryDensity && !(params.periodicX && params.periodicY)) || obstacles.hasSolid()) << 3 |
+                  (params.phaseCount > 1) << 4;
+    applyMemoryMode();
+    updateSources(timeStep);
+    if (variant & 8)
+        prepareObstacles();
+    chooseCellDivisions();
+    StepConstants constants = makeStepConstants(timeStep);
+    if (constants.cellDivisions > 1)
+    {
+        // the particles move once after they are sorted, so the searches that follow the circle
+        // reach as far beyond it as the fastest one can go
+        const int count = static_cast<int>(particlePosition.size());
+        float maxSpeedSquared = 0.0f;
+#pragma omp parallel for reduction(max : maxSpeedSquared)
+        for (int i = 0; i < count; ++i)
+            maxSpeedSquared = std::max(maxSpeedSquared, particleVelocity[i].lengthSquared());
+        constants.cellSlack = std::sqrt(maxSpeedSquared) * timeStep;
+        constants.cellReach = static_cast<int>(std::ceil((constants.radius + constants.cellSlack) * constants.inverseCellSize));
+    }
+    if (params.enableSleeping)
+    {
+        // the fluid settled under the old settings, so any change wakes it up
+        SleepSettings settings{constants, variant, forceStrengthOriginal, obstacles.version};
+        settings.constants.timeStep = 0.0f;
+        settings.constants.cellReach = 0;
+        settings.constants.cellSlack = 0.0f;
+        if (std::memcmp(&settings, &sleepSettings, sizeof(SleepSettings)) != 0)
+        {
+            wakeAll();
+            sleepSettings = settings;
+        }
+    }
+    else if (!cellQuietSteps.empty())
+        wakeAll();
+    (this->*steps[variant])(constants);
+}
+
+void ParticleSystem::prepareObstacles()
+{
+    const StepConstants c = makeStepConstants(0.0f);
+    sf::Vector2<bool> walls(params.enableBoundaryDensity && !params.periodicX, params.enableBoundaryDensity && !params.periodicY);
+    obstacles.prepare({params.windowWidth, params.windowHeight}, params.obstacleCellSize, c.radius, walls,
+                      [&c](float distance)
+                      { return QuadraticKernel::density(distance, c); });
+}
+
+StepConstants ParticleSystem::makeStepConstants(float timeStep) const
+{
+    StepConstants c;
+    c.timeStep = timeStep;
+    c.radius = params.densitySampleRadius;
+    c.radiusSquared = c.radius * c.radius;
+    c.kernelScale = 1.0f / (3.14159f * c.radiusSquared * c.radiusSquared);
+    c.cellDivisions = cellDivisions;
+    c.cellReach = cellDivisions;
+    c.cellSize = cellSize();
+    c.inverseCellSize = 1.0f / c.cellSize;
+    c.cellSlack = 0.0f;
+    c.cols = static_cast<int>(params.windowWidth / c.cellSize) + 1;
+    c.rows = static_cast<int>(params.windowHeight / c.cellSize) + 1;
+    c.width = static_cast<float>(params.windowWidth);
+    c.height = static_cast<float>(params.windowHeight);
+    c.particleRadius = particleRadius;
+    c.particleMass = params.particleMass;
+    c.targetDensity = params.targetDensity;
+    c.gravityStrength = params.gravityStrength;
+    c.movingDamping = params.movingDamping;
+    c.collisionDamping = params.collisionDamping;
+    c.viscosity = params.viscosity;
+    c.boundaryDensity = params.enableBoundaryDensity ? params.targetDensity : 0.0f;
+    c.periodicX = params.periodicX;
+    c.periodicY = params.periodicY;
+    for (int phase = 0; phase < Parameters::maxPhases; ++phase)
+    {
+        // phase 0 is the base fluid itself, whatever its scales say
+        const FluidPhase p = phase == 0 ? FluidPhase{1.0f, 1.0f, 1.0f, sf::Color::White} : params.phases[phase];
+        c.phaseMassScale[phase] = p.massScale;
+        c.phaseMass[phase] = c.particleMass * p.massScale;
+        c.phaseTargetDensity[phase] = c.targetDensity * p.densityScale;
+        c.phaseBoundaryDensity[phase] = c.boundaryDensity * p.densityScale;
+        c.phaseViscosity[phase] = c.viscosity * p.viscosityScale;
+    }
+    return c;
+}
+
+template <bool Gravity, bool AdjustingForce, bool Sleeping, bool Boundaries, bool Multiphase, class Kernel>
+void ParticleSystem::step(const StepConstants &c)
+{
     debugTimerS.reset();
+    stepStats = StepStats();
+    telemetry.beginStep();
+    telemetry.current.cellDivisions = c.cellDivisions;
     updateParticleCells();
-    debugTimerS.printD("  Update Particle Cells :");
-
-    // std::cout << "UPC\n";
-    // printDuration();
+    // the ranks keep their halo copies behind the owned particles, so their arrays stay in place
+    if (params.reorderSteps > 0 && stepCounter % params.reorderSteps == 0 && !phaseHook)
+        reorderParticles();
+    if constexpr (Sleeping)
+        markSleepingParticles(c);
+    telemetry.current.phaseTime[PhaseGrid] = debugTimerS.lap();
 
-    // std::cout << "UDB\n";
-    // printDuration();
+    const int count = static_cast<int>(particlePosition.size());
+    const float timeStep = c.timeStep;
 
-    // #pragma omp parallel for
-    for (int i = 0; i < particlePosition.size(); ++i)
+    const bool storePredicted = !params.reducedMemory;
+    auto movePosition = [&](int i)
     {
+        if constexpr (Sleeping)
+            if (particleAsleep[i])
+                return;
         particlePosition[i] += particleVelocity[i] * timeStep;
-        particlePositionPredicted[i] = particlePosition[i] + particleVelocity[i] * timeStep;
-        processParticleAboutToOutOfBounds(i, timeStep);
+        if (storePredicted)
+            particlePositionPredicted[i] = particlePosition[i] + particleVelocity[i] * timeStep;
+        resolveBounds(i, c);
+        if constexpr (Boundaries)
+        {
+            if (obstacles.collide(particlePosition[i], particleVelocity[i], c.particleRadius, c.collisionDamping) && storePredicted)
+                particlePositionPredicted[i] = particlePosition[i] + particleVelocity[i] * timeStep;
+        }
+    };
+
+    // the neighbour phases take the particle's index in the system and in the source its
+    // neighbours are read from, the same index unless the source is a packed tile
+    auto computeDensityFrom = [&](const auto &source, int i, int self)
+    {
+        const int phase = Multiphase ? particlePhase[i] : 0;
+        const float targetDensity = Multiphase ? c.phaseTargetDensity[phase] : c.targetDensity;
+        if constexpr (Sleeping)
+        {
+            // a sleeping particle keeps its last density, its neighbours have not moved
+            if (particleAsleep[i])
+            {
+                telemetry.recordDensity(particleDensity[i], targetDensity);
+                return;
+            }
+        }
+        int neighborCount = 0, candidateCount = 0;
+        float density = densityAt<Kernel>(source, source.predictedPosition(self), c, neighborCount, candidateCount);
+        // with several phases the density is the number density times the particle's own mass,
+        // so a heavy neighbour across an interface does not read as compression
+        if constexpr (Multiphase)
+            density *= c.phaseMassScale[phase];
+        if constexpr (Boundaries)
+            density += (Multiphase ? c.phaseBoundaryDensity[phase] : c.boundaryDensity) * obstacles.sampleVolume(predictedPosition(i));
+        particleDensity[i] = std::clamp(density, 0.001f, 2.0f);
+        telemetry.recordNeighbors(neighborCount, candidateCount);
+        telemetry.recordDensity(particleDensity[i], targetDensity);
+        if constexpr (AdjustingForce)
+            adjustForceStrength(particleDensity[i] * c.targetDensity / targetDensity);
+    };
+    auto computeDensity = [&](int i)
+    { computeDensityFrom(*this, i, i); };
+
+    // the force strength is final once the density pass has adjusted it
+    float pressureScale = params.forceStrength * 1000.0f;
+    auto applyForceFrom = [&](const auto &source, int i, int self)
+    {
+        if constexpr (Sleeping)
+            if (particleAsleep[i])
+                return;
+        if constexpr (Gravity)
+            particleVelocity[i].y += c.gravityStrength;
+
+        bool clamped = false;
+        Vector2f force = pushForce<Kernel, Multiphase>(source, self, c, pressureScale, clamped);
+        if constexpr (Boundaries)
+        {
+            // the walls mirror the particle's own pressure, pressure below the target does not pull
+            const float targetDensity = Multiphase ? c.phaseTargetDensity[particlePhase[i]] : c.targetDensity;
+            float pressure = std::max(particleDensity[i] - targetDensity, 0.0f) * pressureScale;
+            force += obstacles.sampleVolumeGradient(predictedPosition(i)) * (pressure * (c.boundaryDensity > 0.0f));
+        }
+        telemetry.local().forceClamps += clamped;
+        particleVelocity[i] += -force / particleDensity[i] * timeStep;
+    };
+    auto applyForce = [&](int i)
+    { applyForceFrom(*this, i, i); };
+
+    const float damping = c.movingDamping * 0.01f * timeStep;
+    auto dampVelocity = [&](int i)
+    {
+        if constexpr (Sleeping)
+            if (particleAsleep[i])
+                return;
+        Vector2f &velocityI = particleVelocity[i];
+        float speedSquared = velocityI.lengthSquared();
+        if (speedSquared > 0.0f)
+            velocityI -= velocityI * (damping * std::sqrt(speedSquared));
+        if (velocityI.lengthSquared() > 500.0f * 500.0f)
+        {
+            velocityI *= 0.2f;
+            telemetry.local().velocityClamps++;
+        }
+    };
+
+    auto addViscosity = [&](int i)
+    {
+        if constexpr (Sleeping)
+            if (particleAsleep[i])
+                return;
+        applyViscosity<Kernel, Multiphase>(*this, i, c);
+    };
+
+    // the adaptive force strength changes particle by particle and the halo refresh needs every
+    // particle of a phase done, both keep the phases apart
+    ranTaskGraph = !AdjustingForce && !phaseHook && !params.enableTiling && prepareTaskGraph(c);
+    if (ranTaskGraph)
+    {
+        taskGraph.run([&](int task)
+                      {
+                          const int blockCount = blocksX * blocksY;
+                          const int block = task % blockCount;
+                          switch (PhasePosition + task / blockCount)
+                          {
+                          case PhasePosition:
+                              forEachBlockParticle(block, movePosition);
+                              break;
+                          case PhaseDensity:
+                              forEachBlockParticle(block, computeDensity);
+                              break;
+                          case PhaseForce:
+                              forEachBlockParticle(block, applyForce);
+                              break;
+                          case PhaseVelocity:
+                              forEachBlockParticle(block, dampVelocity);
+                              break;
+                          default:
+                              forEachBlockParticle(block, addViscosity);
+                              break;
+                          } });
+        // the phases overlap, so each gets its share of the threads' busy time
+        for (int phase = PhasePosition; phase <= PhaseViscosity; ++phase)
+            telemetry.current.phaseTime[phase] = static_cast<float>(taskGraph.busySeconds[phase] * 1e6 / taskGraph.threadCount);
+        debugTimerS.lap();
+        telemetry.current.loadImbalance = taskGraph.imbalance();
+    }
+    else
+    {
+        // fluid pooled under gravity fills a few cells, so equal index ranges can leave most threads
+        // idle. index chunks keep the split of the arrays that MemoryPlacement touched first
+        const WorkBalance balance = static_cast<WorkBalance>(params.workBalance);
+        if (balance == BalanceIndex || omp_get_max_threads() < 2)
+            loadBalancer.clear();
+        else
+            loadBalancer.update(particleCellIndices.data(), count, c.cols, c.rows, c.cellReach, balance, omp_get_max_threads());
+        loadBalancer.beginStep(omp_get_max_threads());
+        // packed tiles read their neighbours from l2 instead of gathering them from the whole arrays.
+        // a particle whose stencil leaves its tile's ring uses the system's arrays
+        const bool tiled = !AdjustingForce && prepareTiles(c);
+        auto computeDensityInTile = [&](const PackedTile &tile, int k)
+        {
+            if (tile.covers(tile.predictedPosition(k), c))
+                computeDensityFrom(tile, tile.particleIndex[k], k);
+            else
+                computeDensity(tile.particleIndex[k]);
+        };
+        auto applyForceInTile = [&](const PackedTile &tile, int k)
+        {
+            if (tile.covers(tile.predictedPosition(k), c))
+                applyForceFrom(tile, tile.particleIndex[k], k);
+            else
+                applyForce(tile.particleIndex[k]);
+        };
+        auto addViscosityInTile = [&](PackedTile &tile, int k)
+        {
+            // the tile's later particles see the smoothed velocity in the packed copy
+            const int i = tile.particleIndex[k];
+            if constexpr (Sleeping)
+                if (particleAsleep[i])
+                    return;
+            if (tile.covers(tile.particlePosition[k], c))
+            {
+                applyViscosity<Kernel, Multiphase>(tile, k, c);
+                particleVelocity[i] = tile.particleVelocity[k];
+            }
+            else
+            {
+                applyViscosity<Kernel, Multiphase>(*this, i, c);
+                tile.particleVelocity[k] = particleVelocity[i];
+            }
+        };
+
+        forEachBalancedParticle(movePosition, true);
+        telemetry.current.phaseTime[PhasePosition] = debugTimerS.lap();
+
+        // the adaptive force strength is updated particle by particle, so it keeps the loop serial
+        if (tiled)
+            forEachTileParticle(c, true, computeDensityInTile);
+        else
+            forEachBalancedParticle(computeDensity, !AdjustingForce);
+        if (phaseHook)
+            phaseHook(PhaseDensity);
+        telemetry.current.phaseTime[PhaseDensity] = debugTimerS.lap();
+
+        pressureScale = params.forceStrength * 1000.0f;
+        if (tiled)
+            forEachTileParticle(c, true, applyForceInTile);
+        else
+            forEachBalancedParticle(applyForce, true);
+        telemetry.current.phaseTime[PhaseForce] = debugTimerS.lap();
+
+        for (int i = 0; i < count; ++i)
+            dampVelocity(i);
+        if (phaseHook)
+            phaseHook(PhaseVelocity);
+        telemetry.current.phaseTime[PhaseVelocity] = debugTimerS.lap();
+
+        // in place, later particles see the velocities the earlier ones already smoothed. tiles
+        // go in order, so the order is that of the cells instead of the indices
+        if (tiled)
+            forEachTileParticle(c, false, addViscosityInTile);
+        else
+        {
+            for (int i = 0; i < count; ++i)
+                addViscosity(i);
+        }
+        telemetry.current.phaseTime[PhaseViscosity] = debugTimerS.lap();
+        telemetry.current.loadImbalance = loadBalancer.measuredImbalance();
+        telemetry.current.partitionImbalance = loadBalancer.estimatedImbalance;
     }
-    debugTimerS.printD("  Update Particle Position :");
 
-    // #pragma omp parallel for
-    for (int i = 0; i < particlePosition.size(); ++i)
+    if (!rigidBodies.empty())
+        rigidBodies.step(*this, c, Gravity ? c.gravityStrength : 0.0f);
+    if constexpr (Sleeping)
+        updateCellActivity(c);
+    telemetry.current.phaseTime[PhaseBodies] = debugTimerS.lap();
+
+    updateStepStats();
+    stepCounter++;
+}
+
+bool ParticleSystem::prepareTaskGraph(const StepConstants &c)
+{
+    if (!params.enableTaskGraph || omp_get_max_threads() < 2 || cellStartIndices.size() != static_cast<size_t>(c.cols * c.rows))
+        return false;
+    // blocks keep their size in sample radii on a finer grid
+    const int blockCells = std::max(params.taskBlockCells, 2) * c.cellDivisions;
+    const std::array<int, 5> layout = {c.cols, c.rows, blockCells, c.periodicX, c.periodicY};
+    if (layout != taskLayout || taskGraph.empty())
     {
-        particleDensity[i] = std::clamp(getDensityAt(particlePositionPredicted[i]), 0.001f, 2.0f);
-        if (params.enableAdjustingForce)
-            adjustForceStrength(particleDensity[i]);
+        buildTaskGraph(c, blockCells);
+        taskLayout = layout;
     }
-    debugTimerS.printD("  Update Particle Density :");
+    // the ready lists and timers are sized here so a step does not allocate
+    taskGraph.reserve(omp_get_max_threads());
 
-    // #pragma omp parallel for
-    for (int i = 0; i < particlePosition.size(); ++i)
+    // the stencil of a predicted position has to stay within the neighbouring blocks
+    const int count = static_cast<int>(particlePosition.size());
+    float maxSpeedSquared = 0.0f;
+#pragma omp parallel for reduction(max : maxSpeedSquared)
+    for (int i = 0; i < count; ++i)
+        maxSpeedSquared = std::max(maxSpeedSquared, particleVelocity[i].lengthSquared());
+    if (2.0f * std::sqrt(maxSpeedSquared) * c.timeStep > (blockCells - c.cellReach) * c.cellSize)
+        return false;
+
+    // a particle outside the grid belongs to no block
+    if (count > 0 && (std::get<1>(particleCellIndices.front()) < 0 || std::get<1>(particleCellIndices.back()) >= c.cols * c.rows))
+        return false;
+    auto firstSlot = [this](int cell)
+    {
+        return static_cast<int>(std::lower_bound(particleCellIndices.begin(), particleCellIndices.end(), cell, [](const auto &entry, int cell)
+                                                 { return std::get<1>(entry) < cell; }) -
+                                particleCellIndices.begin());
+    };
+    // the sorted particles of a block are one run per row of its cells
+    blockRanges.clear();
+    blockRangeStart.assign(blocksX * blocksY + 1, 0);
+    for (int block = 0; block < blocksX * blocksY; ++block)
     {
-        if (params.enableGravity)
+        blockRangeStart[block] = static_cast<int>(blockRanges.size());
+        const int x0 = block % blocksX * blockCells;
+        const int x1 = std::min(x0 + blockCells, c.cols);
+        const int y0 = block / blocksX * blockCells;
+        for (int y = y0; y < std::min(y0 + blockCells, c.rows); ++y)
         {
-            particleVelocity[i] += Vector2f(0.0f, params.gravityStrength);
+            int begin = firstSlot(x0 + y * c.cols);
+            int end = firstSlot(x1 + y * c.cols);
+            if (begin < end)
+                blockRanges.push_back({begin, end});
         }
+    }
+    blockRangeStart.back() = static_cast<int>(blockRanges.size());
 
-        sf::Vector2f force = getPushForce(i);
+    // a block starts on the thread whose static chunk holds its first particle. in cell order that
+    // thread first touched the pages of the block's particles
+    const int threads = omp_get_max_threads();
+    for (int block = 0; block < blocksX * blocksY; ++block)
+    {
+        const bool empty = blockRangeStart[block] == blockRangeStart[block + 1];
+        taskGraph.setHome(block, empty ? -1 : staticThread(blockRanges[blockRangeStart[block]].first, threads));
+    }
+    return true;
+}
 
-        Vector2f &velocityI = particleVelocity[i];
-        velocityI += -force / particleDensity[i] * timeStep;
+bool ParticleSystem::prepareTiles(const StepConstants &c)
+{
+    const int count = static_cast<int>(particlePosition.size());
+    if (!params.enableTiling || count == 0 || cellStartIndices.size() != static_cast<size_t>(c.cols * c.rows))
+        return false;
+    // a particle outside the grid belongs to no tile
+    if (std::get<1>(particleCellIndices.front()) < 0 || std::get<1>(particleCellIndices.back()) >= c.cols * c.rows)
+        return false;
+
+    // as many cells as fit the cache share together with their ring, at the fluid's mean occupancy
+    const int occupied = static_cast<int>(cellStartIndices.size()) - static_cast<int>(std::count(cellStartIndices.begin(), cellStartIndices.end(), -1));
+    const float particlesPerCell = static_cast<float>(count) / std::max(occupied, 1);
+    const size_t packedBytes = 3 * sizeof(Vector2f) + sizeof(float) + sizeof(uint8_t) + 2 * sizeof(int);
+    const int side = static_cast<int>(std::sqrt(params.tileCacheKB * 1024.0f / (packedBytes * particlesPerCell)));
+    tileCells = std::clamp(side - 2 * c.cellReach, 1, std::max(c.cols, c.rows));
+    tilesX = (c.cols + tileCells - 1) / tileCells;
+    tilesY = (c.rows + tileCells - 1) / tileCells;
+    if (packedTiles.size() < static_cast<size_t>(omp_get_max_threads()))
+        packedTiles.resize(omp_get_max_threads());
+    return true;
+}
+
+void ParticleSystem::packTile(PackedTile &tile, int index, const StepConstants &c) const
+{
+    const int count = static_cast<int>(particlePosition.size());
+    const int x0 = index % tilesX * tileCells;
+    const int y0 = index / tilesX * tileCells;
+    const int x1 = std::min(x0 + tileCells, c.cols);
+    const int y1 = std::min(y0 + tileCells, c.rows);
+    tile.own.clear();
+    bool empty = true;
+    for (int y = y0; y < y1 && empty; ++y)
+    {
+        for (int x = x0; x < x1 && empty; ++x)
+            empty = cellStartIndices[x + y * c.cols] == -1;
     }
-    debugTimerS.printD("  Update Particle Force :");
+    if (empty)
+        return;
 
-    for (int i = 0; i < particlePosition.size(); ++i)
+    const int ring = c.cellReach;
+    tile.originX = x0 - ring;
+    tile.originY = y0 - ring;
+    tile.width = x1 - x0 + 2 * ring;
+    tile.height = y1 - y0 + 2 * ring;
+    tile.cellStart.resize(tile.width * tile.height + 1);
+    tile.particlePosition.clear();
+    tile.particlePositionPredicted.clear();
+    tile.particleVelocity.clear();
+    tile.particleDensity.clear();
+    tile.particlePhase.clear();
+    tile.particleIndex.clear();
+    for (int y = 0; y < tile.height; ++y)
     {
-        Vector2f &velocityI = particleVelocity[i];
-        Vector2f velocityLossed = velocityI.length() == 0 ? Vector2f(0.0f, 0.0f) : velocityI.normalized();
-        velocityI -= velocityLossed * params.movingDamping * 0.01f * velocityI.lengthSquared() * timeStep;
-        if (velocityI.lengthSquared() > 500.0f * 500.0f)
+        const int gridY = tile.originY + y;
+        for (int x = 0; x < tile.width; ++x)
         {
-            std::cerr << "  - Particle " + std::to_string(i) + " 's velocity is too high: " << velocityI.length() << std::endl;
-            velocityI *= 0.2f;
+            const int gridX = tile.originX + x;
+            tile.cellStart[x + y * tile.width] = static_cast<int>(tile.particleIndex.size());
+            if (gridX < 0 || gridX >= c.cols || gridY < 0 || gridY >= c.rows)
+                continue;
+            const int cell = gridX + gridY * c.cols;
+            const bool own = x >= ring && x < tile.width - ring && y >= ring && y < tile.height - ring;
+            for (int slot = cellStartIndices[cell]; slot >= 0 && slot < count && std::get<1>(particleCellIndices[slot]) == cell; ++slot)
+            {
+                const int i = std::get<0>(particleCellIndices[slot]);
+                if (own)
+                    tile.own.push_back(static_cast<int>(tile.particleIndex.size()));
+                tile.particlePosition.push_back(particlePosition[i]);
+                tile.particlePositionPredicted.push_back(predictedPosition(i));
+                tile.particleVelocity.push_back(particleVelocity[i]);
+                tile.particleDensity.push_back(particleDensity[i]);
+                tile.particlePhase.push_back(particlePhase[i]);
+                tile.particleIndex.push_back(i);
+            }
         }
     }
-    debugTimerS.printD("  Update Particle Velocity :");
+    tile.cellStart.back() = static_cast<int>(tile.particleIndex.size());
+}
 
-    // #pragma omp parallel for
-    for (int i = 0; i < particlePosition.size(); ++i)
+void ParticleSystem::buildTaskGraph(const StepConstants &c, int blockCells)
+{
+    // one task per block and phase. a block's phase waits for the previous phase of its block
+    // and of the eight around it, which covers every particle its neighbour searches can reach
+    taskGraph.clear();
+    blocksX = (c.cols + blockCells - 1) / blockCells;
+    blocksY = (c.rows + blockCells - 1) / blockCells;
+    const int blockCount = blocksX * blocksY;
+    for (int phase = PhasePosition; phase <= PhaseViscosity; ++phase)
     {
-        processVisosity(i);
+        for (int block = 0; block < blockCount; ++block)
+            taskGraph.addTask(phase);
     }
-    debugTimerS.printD("  Update Particle Visosity :");
-    debugTimerT.printD("Update Particles:");
+    auto task = [blockCount](int phase, int block)
+    { return (phase - PhasePosition) * blockCount + block; };
+
+    // a block's searches reach one block span beyond it. across a periodic seam that span wraps by
+    // the domain size, which need not be a whole number of blocks
+    const float span = blockCells * c.cellSize;
+    auto blocksAround = [span](int block, int blocks, float extent, bool periodic)
+    {
+        vector<int> result;
+        for (int other = std::max(block - 1, 0); other <= std::min(block + 1, blocks - 1); ++other)
+            result.push_back(other);
+        const float low = (block - 1) * span;
+        const float high = (block + 2) * span;
+        for (float shift : {-extent, extent})
+        {
+            for (int other = 0; periodic && other < blocks; ++other)
+            {
+                if (other * span < high + shift && (other + 1) * span > low + shift)
+                    result.push_back(other);
+            }
+        }
+        return result;
+    };
 
-    // std::cout << "UP\n";
-    // printDuration();
+    for (int block = 0; block < blockCount; ++block)
+    {
+        vector<int> around;
+        for (int y : blocksAround(block / blocksX, blocksY, c.height, c.periodicY))
+        {
+            for (int x : blocksAround(block % blocksX, blocksX, c.width, c.periodicX))
+                around.push_back(x + y * blocksX);
+        }
+        std::sort(around.begin(), around.end());
+        around.erase(std::unique(around.begin(), around.end()), around.end());
+
+        for (int neighbor : around)
+        {
+            taskGraph.addDependency(task(PhasePosition, neighbor), task(PhaseDensity, block));
+            taskGraph.addDependency(task(PhaseDensity, neighbor), task(PhaseForce, block));
+            taskGraph.addDependency(task(PhaseVelocity, neighbor), task(PhaseViscosity, block));
+            // viscosity updates in place, so neighbouring blocks take turns in block order. that
+            // keeps the result independent of the thread timing
+            if (neighbor < block)
+                taskGraph.addDependency(task(PhaseViscosity, neighbor), task(PhaseViscosity, block));
+        }
+        taskGraph.addDependency(task(PhaseForce, block), task(PhaseVelocity, block));
+    }
 }
 
-void ParticleSystem::processParticleAboutToOutOfBounds(int index, float timeStep)
+void ParticleSystem::markSleepingParticles(const StepConstants &c)
 {
-    Vector2f nextPosition = particlePositionPredicted[index];
-    if (nextPosition.y + particleRadius > params.windowHeight || nextPosition.y - particleRadius < 0)
+    // a cell sleeps once it and the cells its searches reach have been settled for sleepSteps,
+    // so activity wakes the cells around it one reach per step
+    const int cellCount = static_cast<int>(cellStartIndices.size());
+    if (cellQuietSteps.size() != cellStartIndices.size())
     {
-        int b = (nextPosition.y + particleRadius > params.windowHeight ? 1 : 0);
-        float f = 2 * b * params.windowHeight - nextPosition.y;
-        // float err = std::max(std::abs(f - (float)params.windowHeight * b) * 0.005f, 1.0f);
-        particlePosition[index].y = std::clamp(f, particleRadius, (float)params.windowHeight - particleRadius);
-        particleVelocity[index].y *= -params.collisionDamping;
+        cellQuietSteps.assign(cellCount, 0);
+        cellMeanDensity.assign(cellCount, 0.0f);
     }
-    if (nextPosition.x + particleRadius > params.windowWidth || nextPosition.x - particleRadius < 0)
+    particleAsleep.resize(particlePosition.size());
+
+    const int count = static_cast<int>(particlePosition.size());
+    for (int i = 0; i < count;)
     {
-        int b = (nextPosition.x + particleRadius > params.windowWidth ? 1 : 0);
-        float f = 2 * b * params.windowWidth - nextPosition.x;
-        // float err = std::max(std::abs(f - (float)params.windowWidth * b) * 0.005f, 1.0f);
-        particlePosition[index].x = std::clamp(f, particleRadius, (float)params.windowWidth - particleRadius);
-        particleVelocity[index].x *= -params.collisionDamping;
+        int cellIndex = std::get<1>(particleCellIndices[i]);
+        bool asleep = cellIndex >= 0 && cellIndex < cellCount;
+        int x = asleep ? cellIndex % c.cols : 0;
+        int y = asleep ? cellIndex / c.cols : 0;
+        for (int ny = std::max(y - c.cellReach, 0); asleep && ny <= std::min(y + c.cellReach, c.rows - 1); ++ny)
+        {
+            for (int nx = std::max(x - c.cellReach, 0); asleep && nx <= std::min(x + c.cellReach, c.cols - 1); ++nx)
+                asleep = cellQuietSteps[nx + ny * c.cols] >= params.sleepSteps;
+        }
+        for (; i < count && std::get<1>(particleCellIndices[i]) == cellIndex; ++i)
+        {
+            particleAsleep[std::get<0>(particleCellIndices[i])] = asleep;
+            stepStats.sleepingParticles += asleep;
+        }
     }
 }
 
-float ParticleSystem::getDensityAt(Vector2f pos) const
+void ParticleSystem::updateCellActivity(const StepConstants &c)
 {
-    // if (pos.x < 0 || pos.x >= params.windowWidth || pos.y < 0 || pos.y >= params.windowHeight)
-    //     return -1.0f;
-    // return forceFieldImage.getPixel({pos.x, pos.y}).r / 255.0f; // get the density from the texture (0-255)
-    float density = 0.0f;
-    for (int neighbor : getParticlesWithRadius(pos))
+    // empty cells count as settled, a particle can only enter one from an awake neighbour
+    const float maxSpeedSquared = params.sleepSpeed * params.sleepSpeed;
+    const int cellCount = static_cast<int>(cellQuietSteps.size());
+    for (int cell = 0; cell < cellCount; ++cell)
     {
-        sf::Vector2f r = pos - particlePositionPredicted[neighbor];
-        float distanceSquared = r.lengthSquared();
-        density += densityKernel(std::sqrt(distanceSquared)) * params.particleMass;
+        if (cellStartIndices[cell] == -1)
+            cellQuietSteps[cell] = static_cast<uint16_t>(params.sleepSteps);
+    }
+
+    const int count = static_cast<int>(particlePosition.size());
+    for (int i = 0; i < count;)
+    {
+        int cellIndex = std::get<1>(particleCellIndices[i]);
+        bool calm = true;
+        float density = 0.0f;
+        int start = i;
+        for (; i < count && std::get<1>(particleCellIndices[i]) == cellIndex; ++i)
+        {
+            int particle = std::get<0>(particleCellIndices[i]);
+            // particles resting on a wall keep pushing into it without moving
+            Vector2f velocity = particleVelocity[particle];
+            const Vector2f &position = particlePosition[particle];
+            if ((velocity.x < 0 && position.x <= c.particleRadius + 0.5f) || (velocity.x > 0 && position.x >= c.width - c.particleRadius - 0.5f))
+                velocity.x = 0.0f;
+            if ((velocity.y < 0 && position.y <= c.particleRadius + 0.5f) || (velocity.y > 0 && position.y >= c.height - c.particleRadius - 0.5f))
+                velocity.y = 0.0f;
+            calm = calm && velocity.lengthSquared() < maxSpeedSquared;
+            density += particleDensity[particle];
+        }
+        if (cellIndex < 0 || cellIndex >= cellCount)
+            continue;
+        density /= i - start;
+        calm = calm && std::abs(density - cellMeanDensity[cellIndex]) < params.sleepDensityChange * density;
+        uint16_t &quiet = cellQuietSteps[cellIndex];
+        quiet = calm ? static_cast<uint16_t>(std::min(quiet + 1, 65535)) : 0;
+        cellMeanDensity[cellIndex] = density;
     }
-    return density;
 }
 
-sf::Vector2f ParticleSystem::getPushForce(int index) const
+void ParticleSystem::wakeAll()
 {
-    sf::Vector2f pos = particlePositionPredicted[index];
-    sf::Vector2f force = Vector2f(0.0f, 0.0f);
+    cellQuietSteps.clear();
+    cellMeanDensity.clear();
+    std::fill(particleAsleep.begin(), particleAsleep.end(), 0);
+}
+
+void ParticleSystem::resolveBounds(int index, const StepConstants &c)
+{
+    // the predicted position, which is not stored in reduced memory mode
+    Vector2f nextPosition = particlePosition[index] + particleVelocity[index] * c.timeStep;
+    // a periodic axis wraps the particle, the prediction moves with it so the pair offsets stay put
+    if (c.periodicY)
+    {
+        float shift = -std::floor(particlePosition[index].y / c.height) * c.height;
+        particlePosition[index].y += shift;
+        if (!params.reducedMemory)
+            particlePositionPredicted[index].y += shift;
+    }
+    else if (nextPosition.y + c.particleRadius > c.height || nextPosition.y - c.particleRadius < 0)
+    {
+        int b = (nextPosition.y + c.particleRadius > c.height ? 1 : 0);
+        float f = 2 * b * c.height - nextPosition.y;
+        particlePosition[index].y = std::clamp(f, c.particleRadius, c.height - c.particleRadius);
+        particleVelocity[index].y *= -c.collisionDamping;
+    }
+    if (c.periodicX)
+    {
+        float shift = -std::floor(particlePosition[index].x / c.width) * c.width;
+        particlePosition[index].x += shift;
+        if (!params.reducedMemory)
+            particlePositionPredicted[index].x += shift;
+    }
+    else if (nextPosition.x + c.particleRadius > c.width || nextPosition.x - c.particleRadius < 0)
+    {
+        int b = (nextPosition.x + c.particleRadius > c.width ? 1 : 0);
+        float f = 2 * b * c.width - nextPosition.x;
+        particlePosition[index].x = std::clamp(f, c.particleRadius, c.width - c.particleRadius);
+        particleVelocity[index].x *= -c.collisionDamping;
+    }
+}
+
+template <class Kernel, class Source>
+float ParticleSystem::densityAt(const Source &source, Vector2f pos, const StepConstants &c, int &neighborCount, int &candidateCount)
+{
+    float density = 0.0f;
+    neighborCount = 0;
+    candidateCount = source.forEachNeighbor(pos, c, [&](int neighbor, Vector2f shift)
+                                            {
+                                                float distance = (pos - source.predictedPosition(neighbor) - shift).length();
+                                                density += Kernel::density(distance, c);
+                                                neighborCount++; });
+    return density * c.particleMass;
+}
+
+template <class Kernel, bool Multiphase, class Source>
+Vector2f ParticleSystem::pushForce(const Source &source, int index, const StepConstants &c, float pressureScale, bool &clamped)
+{
+    const Vector2f pos = source.predictedPosition(index);
+    const float pressureI = source.particleDensity[index] - (Multiphase ? c.phaseTargetDensity[source.particlePhase[index]] : c.targetDensity);
     const float maxForce = 1000.0f; // max force to prevent explosion
+    Vector2f force(0.0f, 0.0f);
+    source.forEachNeighbor(pos, c, [&](int neighbor, Vector2f shift)
+                           {
+                               Vector2f r = pos - source.predictedPosition(neighbor) - shift;
+                               float distanceSquared = r.lengthSquared();
+                               const float densityJ = source.particleDensity[neighbor];
+                               if (neighbor == index || densityJ == 0.0f || distanceSquared == 0.0f)
+                                   return;
+                               float distance = std::sqrt(distanceSquared);
+                               float targetDensity = c.targetDensity;
+                               float mass = c.particleMass;
+                               if constexpr (Multiphase)
+                               {
+                                   const int phase = source.particlePhase[neighbor];
+                                   targetDensity = c.phaseTargetDensity[phase];
+                                   mass = c.phaseMass[phase];
+                               }
+                               float pressure = (pressureI + densityJ - targetDensity) * pressureScale * 0.5f;
+                               force += r / distance *
+                                        (pressure + Kernel::shortDistPush(distance, c)) *
+                                        Kernel::gradient(distance, c) *
+                                        mass / densityJ; });
+
+    clamped = force.lengthSquared() > maxForce * maxForce;
+    if (clamped)
+        force = force.normalized() * maxForce;
+    return force;
+}
+
+template <class Kernel, bool Multiphase, class Source>
+void ParticleSystem::applyViscosity(Source &source, int index, const StepConstants &c)
+{
+    const Vector2f pos = source.particlePosition[index];
+    Vector2f force(0.0f, 0.0f);
+    source.forEachNeighbor(pos, c, [&](int neighbor, Vector2f shift)
+                           {
+                               if (neighbor == index)
+                                   return;
+                               float f = Kernel::density((pos - source.particlePosition[neighbor] - shift).length(), c);
+                               force += (source.particleVelocity[neighbor] - source.particleVelocity[index]) * f; });
+    const float viscosity = Multiphase ? c.phaseViscosity[source.particlePhase[index]] : c.viscosity;
+    source.particleVelocity[index] += force * 10.0f * viscosity / source.particleDensity[index];
+}
+
+float ParticleSystem::getDensityAt(Vector2f pos, int *neighborCount) const
+{
+    int count = 0, candidates = 0;
+    float density = densityAt<QuadraticKernel>(*this, pos, makeStepConstants(0.0f), count, candidates);
+    if (neighborCount)
+        *neighborCount = count;
+    return density;
+}
+
+float ParticleSystem::densityKernel(float dist) const
+{
+    return QuadraticKernel::density(dist, makeStepConstants(0.0f));
+}
+
+uint32_t ParticleSystem::addParticle(Vector2f pos, Vector2f velocity, uint8_t phase)
+{
+    uint32_t id;
+    if (!freeIds.empty())
+    {
+        id = freeIds.back();
+        freeIds.pop_back();
+    }
+    else
+    {
+        id = static_cast<uint32_t>(idSlots.size());
+        idSlots.push_back(noParticle);
+    }
+    idSlots[id] = static_cast<uint32_t>(particlePosition.size());
+
+    particlePosition.push_back(pos);
+    particleVelocity.push_back(velocity);
+    particleDensity.push_back(0.0f);
+    if (!params.reducedMemory)
+        particlePositionPredicted.push_back(pos);
+    particleCellIndices.push_back({static_cast<int>(particlePosition.size()) - 1, -1});
+    particleId.push_back(id);
+    particleAsleep.push_back(0);
+    particlePhase.push_back(phase);
+    wakeCell(pos);
+    return id;
+}
+
+void ParticleSystem::removeParticle(int index)
+{
+    // the arrays are only reordered by compactParticles, so indices stay valid until then
+    pendingRemovals.push_back(index);
+}
 
-    for (int neighbor : getParticlesWithRadius(pos))
+void ParticleSystem::compactParticles()
+{
+    if (pendingRemovals.empty())
+        return;
+    // descending, so the last particle is never one that is still waiting to be removed
+    std::sort(pendingRemovals.begin(), pendingRemovals.end(), std::greater<int>());
+    pendingRemovals.erase(std::unique(pendingRemovals.begin(), pendingRemovals.end()), pendingRemovals.end());
+    particleAsleep.resize(particlePosition.size());
+    for (int index : pendingRemovals)
     {
-        sf::Vector2f r = pos - particlePositionPredicted[neighbor];
-        if (neighbor == index || particleDensity[neighbor] == 0.0f || r.lengthSquared() == 0.0f)
+        int last = static_cast<int>(particlePosition.size()) - 1;
+        if (index < 0 || index > last)
             continue;
-        float distance = r.length();
-        float scale = gradientKernel(distance);
-        Vector2f f = r / distance *
-                     (getPushForceBetween(index, neighbor) + shortDistPushKernel(distance)) *
-                     scale *
-                     params.particleMass / particleDensity[neighbor];
-        force += f;
+        wakeCell(particlePosition[index]);
+        idSlots[particleId[index]] = noParticle;
+        freeIds.push_back(particleId[index]);
+        if (index != last)
+        {
+            particlePosition[index] = particlePosition[last];
+            if (!params.reducedMemory)
+                particlePositionPredicted[index] = particlePositionPredicted[last];
+            particleVelocity[index] = particleVelocity[last];
+            particleDensity[index] = particleDensity[last];
+            particleId[index] = particleId[last];
+            particleAsleep[index] = particleAsleep[last];
+            particlePhase[index] = particlePhase[last];
+            idSlots[particleId[index]] = static_cast<uint32_t>(index);
+        }
+        particlePosition.pop_back();
+        if (!params.reducedMemory)
+            particlePositionPredicted.pop_back();
+        particleVelocity.pop_back();
+        particleDensity.pop_back();
+        particleId.pop_back();
+        particleAsleep.pop_back();
+        particlePhase.pop_back();
     }
+    pendingRemovals.clear();
+    particleCellIndices.resize(particlePosition.size());
+}
 
-    if (force.lengthSquared() > maxForce * maxForce)
+void ParticleSystem::reorderParticles()
+{
+    // moves the particles into the order of the sorted cells, so the static chunks of indices the
+    // pages were first touched in are strips of grid rows, as are the chunks of sorted slots. slot s
+    // takes particle particleCellIndices[s], one cycle of the permutation at a time, and the slots
+    // already filled are marked by flipping their index
+    struct Particle
     {
-        std::cerr << "  - Particle " + std::to_string(index) + "'s force is too high: " << force.length() << std::endl;
-        force = force.normalized() * maxForce;
-        return force;
+        Vector2f position, predicted, velocity;
+        float density;
+        uint32_t id;
+        uint8_t asleep, phase;
+    };
+    const int count = static_cast<int>(particlePosition.size());
+    const bool predicted = particlePositionPredicted.size() == particlePosition.size();
+    const bool asleep = particleAsleep.size() == particlePosition.size();
+    auto load = [&](int i)
+    {
+        return Particle{particlePosition[i], predicted ? particlePositionPredicted[i] : Vector2f(), particleVelocity[i],
+                        particleDensity[i], particleId[i], static_cast<uint8_t>(asleep && particleAsleep[i]), particlePhase[i]};
+    };
+    auto store = [&](const Particle &particle, int i)
+    {
+        particlePosition[i] = particle.position;
+        if (predicted)
+            particlePositionPredicted[i] = particle.predicted;
+        particleVelocity[i] = particle.velocity;
+        particleDensity[i] = particle.density;
+        particleId[i] = particle.id;
+        if (asleep)
+            particleAsleep[i] = particle.asleep;
+        particlePhase[i] = particle.phase;
+    };
+    for (int slot = 0; slot < count; ++slot)
+    {
+        if (std::get<0>(particleCellIndices[slot]) < 0)
+            continue;
+        const Particle first = load(slot);
+        for (int to = slot;;)
+        {
+            const int from = static_cast<int>(std::get<0>(particleCellIndices[to]));
+            std::get<0>(particleCellIndices[to]) = -1 - from;
+            if (from == slot)
+            {
+                store(first, to);
+                break;
+            }
+            store(load(from), to);
+            to = from;
+        }
+    }
+    for (int slot = 0; slot < count; ++slot)
+    {
+        std::get<0>(particleCellIndices[slot]) = slot;
+        idSlots[particleId[slot]] = static_cast<uint32_t>(slot);
     }
-    return force;
 }
 
-float ParticleSystem::densityKernel(float dist) const
+void ParticleSystem::reserveParticles(size_t capacity)
+{
+    particlePosition.reserve(capacity);
+    if (!params.reducedMemory)
+        particlePositionPredicted.reserve(capacity);
+    particleVelocity.reserve(capacity);
+    particleDensity.reserve(capacity);
+    particleCellIndices.reserve(capacity);
+    particleAsleep.reserve(capacity);
+    particlePhase.reserve(capacity);
+    particleId.reserve(capacity);
+    idSlots.reserve(capacity);
+    freeIds.reserve(capacity);
+    pendingRemovals.reserve(capacity);
+}
+
+size_t ParticleSystem::reservedBytes() const
+{
+    return particlePosition.capacity() * sizeof(Vector2f) +
+           particlePositionPredicted.capacity() * sizeof(Vector2f) +
+           particleVelocity.capacity() * sizeof(Vector2f) +
+           particleDensity.capacity() * sizeof(float) +
+           particleCellIndices.capacity() * sizeof(CellSlot) +
+           cellStartIndices.capacity() * sizeof(ParticleIndex) +
+           cellQuietSteps.capacity() * sizeof(uint16_t) +
+           cellMeanDensity.capacity() * sizeof(float) +
+           particleAsleep.capacity() * sizeof(uint8_t) +
+           particlePhase.capacity() * sizeof(uint8_t) +
+           particleId.capacity() * sizeof(uint32_t) +
+           idSlots.capacity() * sizeof(uint32_t) +
+           freeIds.capacity() * sizeof(uint32_t) +
+           pendingRemovals.capacity() * sizeof(int);
+}
+
+void ParticleSystem::applyMemoryMode()
+{
+    // turning reduced memory off again predicts no motion until the next step moves the particles
+    if (params.reducedMemory)
+    {
+        if (particlePositionPredicted.capacity() > 0)
+        {
+            particlePositionPredicted.clear();
+            particlePositionPredicted.shrink_to_fit();
+        }
+    }
+    else if (particlePositionPredicted.size() != particlePosition.size())
+    {
+        particlePositionPredicted.reserve(particlePosition.capacity());
+        particlePositionPredicted.assign(particlePosition.begin(), particlePosition.end());
+    }
+}
+
+void ParticleSystem::setParticleCount(int count)
 {
-    float a = std::max(params.densitySampleRadius - dist, 0.0f);
-    float v = 3.14159f * std::pow(params.densitySampleRadius, 4) / 6;
-    return a * a / v;
+    // grows by dropping new particles over the top of the domain, shrinks from the newest slots
+    int current = static_cast<int>(particlePosition.size());
+    reserveParticles(std::max<size_t>(count, params.particleCapacity));
+    for (int i = current - 1; i >= count; --i)
+        removeParticle(i);
+    compactParticles();
+    for (int i = current; i < count; ++i)
+    {
+        float x = particleRadius + randomFloat() * (params.windowWidth - 2.0f * particleRadius);
+        float y = particleRadius + randomFloat() * params.windowHeight * 0.25f;
+        addParticle(Vector2f(x, y), Vector2f(0.0f, 0.0f), spawnPhase());
+    }
+    updateParticleCells();
 }
 
-float ParticleSystem::gradientKernel(float dist) const
+uint8_t ParticleSystem::spawnPhase() const
 {
-    float v = 3.14159f * std::pow(params.densitySampleRadius, 4);
-    return 12 * (dist - params.densitySampleRadius) / v;
+    return static_cast<uint8_t>(std::clamp(params.spawnPhase, 0, params.phaseCount - 1));
 }
 
-float ParticleSystem::shortDistPushKernel(float dist) const
+int ParticleSystem::findParticle(uint32_t id) const
 {
-    float v = 3.14159f * std::pow(params.densitySampleRadius, 4) / 6;
-    float a = 16 * (dist - params.densitySampleRadius);
-    return -a * a / v;
+    return id < idSlots.size() && idSlots[id] != noParticle ? static_cast<int>(idSlots[id]) : -1;
 }
 
-float ParticleSystem::getPushForceBetween(int i, int j) const
+void ParticleSystem::resetParticleIds()
 {
-    float f1 = (particleDensity[i] - params.targetDensity) * params.forceStrength * 1000.0f;
-    float f2 = (particleDensity[j] - params.targetDensity) * params.forceStrength * 1000.0f;
-    return (f1 + f2) / 2.0f;
+    vector<uint32_t> ids(particlePosition.size());
+    for (size_t i = 0; i < ids.size(); ++i)
+        ids[i] = static_cast<uint32_t>(i);
+    assignParticleIds(ids);
 }
 
-void ParticleSystem::addParticle(Vector2f pos)
+void ParticleSystem::assignParticleIds(const vector<uint32_t> &ids)
 {
-    particlePosition.push_back(pos);
-    particleVelocity.push_back(Vector2f(0.0f, 0.0f));
-    particleDensity.push_back(0.0f);
-    particlePositionPredicted.push_back(Vector2f(0.0f, 0.0f));
-    particleCellIndices.push_back({particlePosition.size() - 1, -1});
+    // rebuilds the id map and the free list, e.g. after a rollback restored older arrays
+    particleId.assign(ids.begin(), ids.end());
+    uint32_t idCount = 0;
+    for (uint32_t id : particleId)
+        idCount = std::max(idCount, id + 1);
+    idSlots.assign(idCount, noParticle);
+    for (size_t i = 0; i < particleId.size(); ++i)
+        idSlots[particleId[i]] = static_cast<uint32_t>(i);
+    freeIds.clear();
+    for (uint32_t id = idCount; id-- > 0;)
+    {
+        if (idSlots[id] == noParticle)
+            freeIds.push_back(id);
+    }
+    pendingRemovals.clear();
 }
 
-void ParticleSystem::initParticles(int count)
+void ParticleSystem::updateSources(float timeStep)
+{
+    // sinks remove first, so a full pool has room for the emitters in the same step
+    if (!sinks.empty())
+    {
+        for (int i = 0; i < static_cast<int>(particlePosition.size()); ++i)
+        {
+            for (const Sink &sink : sinks)
+            {
+                if ((particlePosition[i] - sink.position).lengthSquared() < sink.radius * sink.radius)
+                {
+                    removeParticle(i);
+                    break;
+                }
+            }
+        }
+    }
+    compactParticles();
+
+    for (Emitter &emitter : emitters)
+    {
+        emitter.pending += emitter.rate * timeStep;
+        for (; emitter.pending >= 1.0f; emitter.pending -= 1.0f)
+        {
+            if (static_cast<int>(particlePosition.size()) >= params.particleCapacity)
+            {
+                emitter.pending = 0.0f;
+                break;
+            }
+            float angle = randomFloat() * 6.28318f;
+            float distance = std::sqrt(randomFloat()) * emitter.spread;
+            Vector2f offset(std::cos(angle) * distance, std::sin(angle) * distance);
+            addParticle(emitter.position + offset, emitter.velocity, std::min<uint8_t>(emitter.phase, static_cast<uint8_t>(params.phaseCount - 1)));
+        }
+    }
+}
+
+void ParticleSystem::clearParticles()
 {
     particlePosition.clear();
-    particleVelocity.clear();
     particlePositionPredicted.clear();
+    particleVelocity.clear();
     particleDensity.clear();
     particleCellIndices.clear();
+    particleAsleep.clear();
+    particlePhase.clear();
+    particleId.clear();
+    idSlots.clear();
+    freeIds.clear();
+    pendingRemovals.clear();
+    std::fill(cellStartIndices.begin(), cellStartIndices.end(), -1);
+    wakeAll();
+}
+
+void ParticleSystem::wakeCell(Vector2f pos)
+{
+    int cellIndex = getCellIndex(pos);
+    if (cellIndex >= 0 && cellIndex < static_cast<int>(cellQuietSteps.size()))
+        cellQuietSteps[cellIndex] = 0;
+}
+
+void ParticleSystem::setParticles(const vector<Vector2f> &positions, const vector<Vector2f> &velocities, const vector<uint8_t> &phases)
+{
+    // replaces the state without simulating, e.g. with a frame of a recording
+    particlePosition.assign(positions.begin(), positions.end());
+    particleVelocity.assign(velocities.begin(), velocities.end());
+    if (!params.reducedMemory)
+        particlePositionPredicted.assign(positions.begin(), positions.end());
+    particleDensity.resize(positions.size(), 0.0f);
+    particleCellIndices.resize(positions.size(), {-1, -1});
+    particleAsleep.assign(positions.size(), 0);
+    // recordings before version 2 carry no phases
+    if (phases.size() == positions.size())
+        particlePhase.assign(phases.begin(), phases.end());
+    else
+        particlePhase.assign(positions.size(), 0);
+    resetParticleIds();
+    updateParticleCells();
+    wakeAll();
+}
+
+void ParticleSystem::initParticles(int count)
+{
+    clearParticles();
+    reserveParticles(std::max(count, params.particleCapacity));
 
     // compute grid dimensions (cols x rows) consistently
-    int cols = static_cast<int>(params.windowWidth / params.densitySampleRadius) + 1;
-    int rows = static_cast<int>(params.windowHeight / params.densitySampleRadius) + 1;
+    int cols = static_cast<int>(params.windowWidth / cellSize()) + 1;
+    int rows = static_cast<int>(params.windowHeight / cellSize()) + 1;
     cellStartIndices.clear();
     cellStartIndices.resize(cols * rows, -1);
 
     float particleSpacing = 15.0f;
 
-    int w = std::sqrt(count);
+    int w = std::max(static_cast<int>(std::sqrt(count)), 1);
     float x0 = params.windowWidth / 2.0f - w * particleSpacing / 2.0f;
     float y0 = params.windowHeight / 2.0f - w * particleSpacing / 2.0f;
+    // a block larger than the domain is made as wide as the domain and packed closer until it fits,
+    // instead of starting with particles outside the grid
+    const float width = params.windowWidth - 2.0f * particleSpacing;
+    const float height = params.windowHeight - 2.0f * particleSpacing;
+    if (count > 0 && (x0 < particleSpacing || y0 < particleSpacing || (count + w - 1) / w * particleSpacing > height))
+    {
+        particleSpacing = std::min(particleSpacing, std::sqrt(width * height / count));
+        int blockRows;
+        while (true)
+        {
+            w = std::clamp(static_cast<int>(width / particleSpacing) + 1, 1, count);
+            blockRows = (count + w - 1) / w;
+            if ((blockRows - 1) * particleSpacing <= height)
+                break;
+            particleSpacing *= 0.98f;
+        }
+        x0 = params.windowWidth / 2.0f - (w - 1) * particleSpacing / 2.0f;
+        y0 = params.windowHeight / 2.0f - (blockRows - 1) * particleSpacing / 2.0f;
+        if (particleSpacing < 15.0f)
+            std::cerr << "The initial block of " << count << " particles is packed " << particleSpacing << " apart to fit the domain" << std::endl;
+    }
     for (int i = 0; i < count; ++i)
     {
         float x = x0 + (i % w) * particleSpacing;
         float y = y0 + (i / w) * particleSpacing;
-        addParticle(Vector2f(x, y));
+        // the block is filled row by row, so this gives each phase a band
+        addParticle(Vector2f(x, y), Vector2f(0.0f, 0.0f), static_cast<uint8_t>(i * params.phaseCount / count));
     }
 
     for (size_t i = 0; i < particlePosition.size(); ++i)
@@ -214,6 +1121,8 @@ void ParticleSystem::initParticles(int count)
     }
 
     params.forceStrength = forceStrengthOriginal;
+    stepCounter = 0;
+    wakeAll();
 }
 
 void ParticleSystem::updateParticleCells()
@@ -236,12 +1145,16 @@ void ParticleSystem::updateParticleCells()
               { return std::get<1>(a) < std::get<1>(b); });
 
     // Update cell start indices
+    int runStart = 0;
     for (size_t i = 0; i < particlePosition.size(); ++i)
     {
         int cellIndex = std::get<1>(particleCellIndices[i]);
         int cellIndexPrev = (i > 0) ? std::get<1>(particleCellIndices[i - 1]) : -1;
         if (cellIndex != cellIndexPrev)
         {
+            if (i > 0)
+                telemetry.recordCell(static_cast<int>(i) - runStart);
+            runStart = static_cast<int>(i);
             // guard against invalid cellIndex
             if (cellIndex >= 0 && cellIndex < static_cast<int>(cellStartIndices.size()))
                 cellStartIndices[cellIndex] = static_cast<int>(i);
@@ -249,55 +1162,29 @@ void ParticleSystem::updateParticleCells()
                 ; // ignore invalid cellIndex
         }
     }
+    if (!particlePosition.empty())
+        telemetry.recordCell(static_cast<int>(particlePosition.size()) - runStart);
 }
 
 int ParticleSystem::getCellIndex(Vector2f pos) const
 {
-    int col = static_cast<int>(pos.x / params.densitySampleRadius);
-    int row = static_cast<int>(pos.y / params.densitySampleRadius);
-    int cols = static_cast<int>(params.windowWidth / params.densitySampleRadius) + 1;
+    int col = static_cast<int>(pos.x / cellSize());
+    int row = static_cast<int>(pos.y / cellSize());
+    int cols = static_cast<int>(params.windowWidth / cellSize()) + 1;
     return col + row * cols;
 }
 
 int ParticleSystem::getCellIndex(sf::Vector2i cellPos) const
 {
-    int cols = static_cast<int>(params.windowWidth / params.densitySampleRadius) + 1;
+    int cols = static_cast<int>(params.windowWidth / cellSize()) + 1;
     return cellPos.x + cellPos.y * cols;
 }
 
-vector<int> ParticleSystem::getParticlesWithRadius(Vector2f pos) const
+std::pmr::vector<int> ParticleSystem::getParticlesWithRadius(Vector2f pos, std::pmr::memory_resource *memory) const
 {
-    vector<int> neighbors;
-    sf::Vector2i centerCell = sf::Vector2i((int)(pos.x / params.densitySampleRadius), (int)(pos.y / params.densitySampleRadius));
-
-    sf::Vector2i offset[9] = {
-        {-1, -1}, {0, -1}, {1, -1}, {-1, 0}, {0, 0}, {1, 0}, {-1, 1}, {0, 1}, {1, 1}};
-    int cols = static_cast<int>(params.windowWidth / params.densitySampleRadius) + 1;
-    int rows = static_cast<int>(params.windowHeight / params.densitySampleRadius) + 1;
-
-    for (auto &off : offset)
-    {
-        sf::Vector2i neighborCell = centerCell + off;
-        if (neighborCell.x < 0 || neighborCell.y < 0 || neighborCell.x >= cols || neighborCell.y >= rows)
-            continue;
-        int cellIndex = getCellIndex(neighborCell);
-        if (cellIndex < 0 || cellIndex >= static_cast<int>(cellStartIndices.size()))
-            continue;
-        int startIndex = cellStartIndices[cellIndex];
-        if (startIndex == -1)
-            continue;
-        for (int i = startIndex; i < static_cast<int>(particlePosition.size()) && std::get<1>(particleCellIndices[i]) == cellIndex; ++i)
-        {
-            int particleIndex = std::get<0>(particleCellIndices[i]);
-            if (particleIndex < 0 || particleIndex >= static_cast<int>(particlePosition.size()))
-                continue;
-            float distanceSquared = (particlePosition[particleIndex] - pos).lengthSquared();
-            if (distanceSquared < params.densitySampleRadius * params.densitySampleRadius)
-            {
-                neighbors.push_back(particleIndex);
-            }
-        }
-    }
+    std::pmr::vector<int> neighbors(memory);
+    forEachNeighbor(pos, makeStepConstants(0.0f), [&](int neighbor, Vector2f)
+                    { neighbors.push_back(neighbor); });
     return neighbors;
 }
 
@@ -309,6 +1196,7 @@ void ParticleSystem::applyCentralForce(Vector2f center, float radius, float stre
         float dist = dir.length();
         if (dist < radius && dist > 0.01f)
         {
+            wakeCell(particlePosition[i]);
             dir /= dist;
             float force = strength * (1.1f - dist / radius);
             particleVelocity[i] += dir * force / particleDensity[i];
@@ -316,25 +1204,124 @@ void ParticleSystem::applyCentralForce(Vector2f center, float radius, float stre
     }
 }
 
-void ParticleSystem::processVisosity(int index)
+void ParticleSystem::updateStepStats()
 {
-    Vector2f force = Vector2f(0.0f, 0.0f);
-    for (int neighbor : getParticlesWithRadius(particlePosition[index]))
+    // each particle carries the mass of its phase
+    const StepConstants c = makeStepConstants(0.0f);
+    const bool phases = particlePhase.size() == particlePosition.size();
+    float energy = 0.0f;
+    float maxSpeedSquared = 0.0f;
+    int nonFinite = 0;
+#pragma omp parallel for reduction(+ : energy, nonFinite) reduction(max : maxSpeedSquared)
+    for (int i = 0; i < static_cast<int>(particlePosition.size()); ++i)
     {
-        if (neighbor == index)
+        float speedSquared = particleVelocity[i].lengthSquared();
+        if (!std::isfinite(speedSquared) || !std::isfinite(particlePosition[i].x) || !std::isfinite(particlePosition[i].y))
+        {
+            nonFinite++;
             continue;
-        sf::Vector2f r = particlePosition[index] - particlePosition[neighbor];
-        float f = densityKernel(std::sqrt(r.lengthSquared()));
-        force += (particleVelocity[neighbor] - particleVelocity[index]) * f;
+        }
+        energy += c.phaseMass[phases ? std::min<int>(particlePhase[i], Parameters::maxPhases - 1) : 0] * speedSquared;
+        maxSpeedSquared = std::max(maxSpeedSquared, speedSquared);
     }
-    particleVelocity[index] += force * 10.0f * params.viscosity / particleDensity[index];
+    stepStats.kineticEnergy = 0.5f * energy;
+    stepStats.maxSpeed = std::sqrt(maxSpeedSquared);
+    stepStats.nonFinite = nonFinite;
+
+    telemetry.current.kineticEnergy = stepStats.kineticEnergy;
+    telemetry.current.maxSpeed = stepStats.maxSpeed;
+    telemetry.current.sleepingParticles = stepStats.sleepingParticles;
+    telemetry.endStep(stepCounter, static_cast<int>(particlePosition.size()));
+    stepStats.forceClamps = telemetry.last.forceClamps;
+    stepStats.velocityClamps = telemetry.last.velocityClamps;
+}
+
+void ParticleSystem::countRemotePages(size_t &remote, size_t &present) const
+{
+    // against the threads the last step ran the particles on: the home of their block in the task
+    // graph, their chunk of sorted slots, or the static chunk of their index
+    const int count = static_cast<int>(particlePosition.size());
+    const int threads = omp_get_max_threads();
+    vector<int> particleThread(count);
+    vector<int> slotThread(count);
+    for (int i = 0; i < count; ++i)
+        particleThread[i] = staticThread(i, threads);
+    for (int slot = 0; slot < count; ++slot)
+        slotThread[slot] = staticThread(slot, threads);
+    if (ranTaskGraph && particleCellIndices.size() == particlePosition.size())
+    {
+        const int cols = taskLayout[0], blockCells = taskLayout[2];
+        for (int slot = 0; slot < count; ++slot)
+        {
+            const int cell = static_cast<int>(std::get<1>(particleCellIndices[slot]));
+            const int block = cell % cols / blockCells + cell / cols / blockCells * blocksX;
+            const int home = block >= 0 && block < blocksX * blocksY ? taskGraph.home(block) : -1;
+            if (home >= 0)
+                particleThread[std::get<0>(particleCellIndices[slot])] = slotThread[slot] = home;
+        }
+    }
+    else if (loadBalancer.chunkCount() == threads && particleCellIndices.size() == particlePosition.size())
+    {
+        for (int thread = 0; thread < threads; ++thread)
+        {
+            for (int slot = loadBalancer.chunkStart[thread]; slot < std::min(loadBalancer.chunkStart[thread + 1], count); ++slot)
+                particleThread[std::get<0>(particleCellIndices[slot])] = slotThread[slot] = thread;
+        }
+    }
+
+    auto countArray = [&](const auto &array, const vector<int> &elementThread)
+    { MemoryPlacement::countRemotePages(array.data(), array.size(), sizeof(array[0]), elementThread, remote, present); };
+    countArray(particlePosition, particleThread);
+    if (!params.reducedMemory)
+        countArray(particlePositionPredicted, particleThread);
+    countArray(particleVelocity, particleThread);
+    countArray(particleDensity, particleThread);
+    countArray(particleCellIndices, slotThread);
+    countArray(cellStartIndices, {});
+    countArray(particleAsleep, particleThread);
+    countArray(particlePhase, particleThread);
+    countArray(particleId, particleThread);
 }
 
 void ParticleSystem::updateCellSizes()
 {
-    int cols = static_cast<int>(params.windowWidth / params.densitySampleRadius) + 1;
-    int rows = static_cast<int>(params.windowHeight / params.densitySampleRadius) + 1;
+    int cols = static_cast<int>(params.windowWidth / cellSize()) + 1;
+    int rows = static_cast<int>(params.windowHeight / cellSize()) + 1;
     cellStartIndices.resize(cols * rows, -1);
+    wakeAll();
+}
+
+void ParticleSystem::chooseCellDivisions()
+{
+    // a search tests every particle in the runs of cells it visits. finer cells follow the circle
+    // closer and test fewer particles, but each search walks more rows. the automatic choice weighs
+    // both at the neighbour count of the last step, and only switches for a clear gain
+    int divisions = std::clamp(params.cellDivisions, 0, 3);
+    if (divisions == 0)
+    {
+        // per division: particles tested per neighbour found and rows walked, from a cellDivisions sweep
+        static constexpr float testsPerNeighbor[4] = {0.0f, 2.7f, 1.9f, 1.65f};
+        static constexpr float rows[4] = {0.0f, 3.0f, 6.0f, 8.0f};
+        const float neighbors = telemetry.last.meanNeighbors;
+        auto cost = [neighbors](int d)
+        { return testsPerNeighbor[d] * neighbors + rowVisitCost * rows[d]; };
+        divisions = cellDivisions;
+        for (int d = 1; d <= 3; ++d)
+        {
+            if (cost(d) < cost(divisions))
+                divisions = d;
+        }
+        if (cost(divisions) > 0.9f * cost(cellDivisions))
+            divisions = cellDivisions;
+    }
+    const float size = params.densitySampleRadius / divisions;
+    const int cols = static_cast<int>(params.windowWidth / size) + 1;
+    const int rows = static_cast<int>(params.windowHeight / size) + 1;
+    if (divisions != cellDivisions || cellStartIndices.size() != static_cast<size_t>(cols * rows))
+    {
+        cellDivisions = divisions;
+        updateCellSizes();
+    }
 }
 
 void ParticleSystem::adjustForceStrength(float density)
@@ -347,4 +1334,12 @@ void ParticleSystem::adjustForceStrength(float density)
         return;
     }
     params.forceStrength *= (1 - ferr * 0.1f);
-}
\ No newline at end of file
+}
+float ParticleSystem::randomFloat()
+{
+    // xorshift64*, the state is part of the checkpoint so runs restart deterministically
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return ((rngState * 0x2545F4914F6CDD1Dull) >> 40) / 16777216.0f;
+}
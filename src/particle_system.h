@@ -1,49 +1,443 @@
+#pragma once
 #include <vector>
+#include <array>
+#include <chrono>
+#include <utility>
 #include <algorithm>
 #include <tuple>
 #include <functional>
+#include <cstdint>
+#include <cmath>
+#include <memory_resource>
 #include <SFML/System.hpp>
 #include "parameters.h"
 #include "utils.h"
+#include "memory_placement.h"
+#include "telemetry.h"
+#include "obstacle_field.h"
+#include "rigid_body.h"
+#include "task_graph.h"
+#include "load_balancer.h"
+#include "particle_index.h"
 
 using sf::Vector2f;
 using std::vector;
 
+struct StepStats
+{
+    float kineticEnergy = 0.0f;
+    float maxSpeed = 0.0f;
+    int forceClamps = 0;
+    int velocityClamps = 0;
+    int nonFinite = 0;
+    int sleepingParticles = 0;
+};
+
+struct StepConstants
+{
+    // parameters copied once per step, the hot loops read these instead of params
+    float timeStep;
+    float radius;
+    float radiusSquared;
+    float kernelScale; // 1 / (pi * radius^4)
+    int cellDivisions; // grid cells per radius. 1 searches the 3x3 cells, finer grids the cells the circle overlaps
+    int cellReach;     // cells a search reaches beyond the centre one on each side
+    float cellSize;
+    float inverseCellSize;
+    float cellSlack; // how far a particle can have moved since it was sorted, widens the finer searches
+    int cols;
+    int rows;
+    float width;
+    float height;
+    float particleRadius;
+    float particleMass;
+    float targetDensity;
+    float gravityStrength;
+    float movingDamping;
+    float collisionDamping;
+    float viscosity;
+    float boundaryDensity; // density of the walls in the volume map, zero when it is off
+    int periodicX;         // 0 or 1, ints keep the struct free of padding for the sleep memcmp
+    int periodicY;
+    // per phase, indexed by particlePhase; only read by the multiphase step
+    float phaseMassScale[Parameters::maxPhases];
+    float phaseMass[Parameters::maxPhases];
+    float phaseTargetDensity[Parameters::maxPhases];
+    float phaseBoundaryDensity[Parameters::maxPhases];
+    float phaseViscosity[Parameters::maxPhases];
+};
+
+struct QuadraticKernel
+{
+    // (h - r)^2 density kernel with its gradient and the short range push
+    static float density(float dist, const StepConstants &c)
+    {
+        float a = std::max(c.radius - dist, 0.0f);
+        return 6.0f * a * a * c.kernelScale;
+    }
+    static float gradient(float dist, const StepConstants &c)
+    {
+        return 12.0f * (dist - c.radius) * c.kernelScale;
+    }
+    static float shortDistPush(float dist, const StepConstants &c)
+    {
+        float a = 16.0f * (dist - c.radius);
+        return -6.0f * a * a * c.kernelScale;
+    }
+};
+
+inline void stencilBounds(Vector2f pos, const StepConstants &c, sf::Vector2i &low, sf::Vector2i &high)
+{
+    // the first and last cells on both axes a search around pos can find neighbours in
+    if (c.cellDivisions == 1)
+    {
+        const sf::Vector2i center(static_cast<int>(pos.x * c.inverseCellSize), static_cast<int>(pos.y * c.inverseCellSize));
+        low = center - sf::Vector2i(1, 1);
+        high = center + sf::Vector2i(1, 1);
+        return;
+    }
+    const float reach = c.radius + c.cellSlack;
+    low = {static_cast<int>(std::floor((pos.x - reach) * c.inverseCellSize)), static_cast<int>(std::floor((pos.y - reach) * c.inverseCellSize))};
+    high = {static_cast<int>(std::floor((pos.x + reach) * c.inverseCellSize)), static_cast<int>(std::floor((pos.y + reach) * c.inverseCellSize))};
+}
+
+template <class Row>
+void forEachStencilRow(Vector2f pos, const StepConstants &c, Row &&row)
+{
+    // row(y, first x, last x) for the rows of cells a search around pos visits, not clipped to the
+    // grid. a radius sized grid visits the 3x3 cells, a finer one only the runs the circle overlaps
+    sf::Vector2i low, high;
+    stencilBounds(pos, c, low, high);
+    const float reachSquared = (c.radius + c.cellSlack) * (c.radius + c.cellSlack);
+    for (int y = low.y; y <= high.y; ++y)
+    {
+        if (c.cellDivisions == 1)
+        {
+            row(y, low.x, high.x);
+            continue;
+        }
+        // the gap between pos and the row leaves a chord of the circle
+        const float gap = std::max({y * c.cellSize - pos.y, pos.y - (y + 1) * c.cellSize, 0.0f});
+        const float half = std::sqrt(std::max(reachSquared - gap * gap, 0.0f));
+        row(y, std::max(static_cast<int>(std::floor((pos.x - half) * c.inverseCellSize)), low.x),
+            std::min(static_cast<int>(std::floor((pos.x + half) * c.inverseCellSize)), high.x));
+    }
+}
+
+struct Emitter
+{
+    Vector2f position;
+    Vector2f velocity;
+    float rate = 20.0f;   // particles per unit of simulated time
+    float spread = 12.0f; // radius of the spawn disk
+    float pending = 0.0f; // fraction of a particle carried to the next step
+    uint8_t phase = 0;
+};
+
+struct Sink
+{
+    Vector2f position;
+    float radius = 40.0f;
+};
+
+struct PackedTile
+{
+    // the particles of a tile of cells and of the ring of cells around it, copied in cell order into
+    // arrays small enough to stay in l2. the names match ParticleSystem's, so the neighbour sums run
+    // on either
+    int originX = 0; // grid cell of local cell 0, one before the tile on both axes
+    int originY = 0;
+    int width = 0; // in cells, with the ring
+    int height = 0;
+    vector<int> cellStart; // per local cell into the packed particles, width * height + 1 entries
+    vector<Vector2f> particlePosition;
+    vector<Vector2f> particlePositionPredicted;
+    vector<Vector2f> particleVelocity;
+    vector<float> particleDensity;
+    vector<uint8_t> particlePhase;
+    vector<int> particleIndex; // into the system's arrays
+    vector<int> own;           // packed particles in the tile's own cells
+
+    const Vector2f &predictedPosition(int k) const { return particlePositionPredicted[k]; }
+
+    bool covers(Vector2f pos, const StepConstants &c) const
+    {
+        // the stencil around pos has to lie in the packed cells and not wrap around a periodic seam
+        const float reach = c.radius + c.cellSlack;
+        if (c.periodicX && (pos.x < reach || pos.x > c.width - reach))
+            return false;
+        if (c.periodicY && (pos.y < reach || pos.y > c.height - reach))
+            return false;
+        sf::Vector2i low, high;
+        stencilBounds(pos, c, low, high);
+        return low.x >= originX && high.x < originX + width && low.y >= originY && high.y < originY + height;
+    }
+
+    template <class Visit>
+    int forEachNeighbor(Vector2f pos, const StepConstants &c, Visit &&visit) const
+    {
+        // the same cells in the same order as the system's query, for a pos the tile covers
+        int tested = 0;
+        forEachStencilRow(pos, c, [&](int y, int x0, int x1)
+                          {
+                              const int row = (y - originY) * width - originX;
+                              tested += cellStart[row + x1 + 1] - cellStart[row + x0];
+                              for (int k = cellStart[row + x0]; k < cellStart[row + x1 + 1]; ++k)
+                              {
+                                  if ((particlePosition[k] - pos).lengthSquared() < c.radiusSquared)
+                                      visit(k, Vector2f(0.0f, 0.0f));
+                              } });
+        return tested;
+    }
+};
+
 class ParticleSystem
 {
 public:
-    vector<sf::Vector2f> particlePosition;
-    vector<sf::Vector2f> particlePositionPredicted;
-    vector<sf::Vector2f> particleVelocity;
-    vector<float> particleDensity;
-    vector<std::tuple<int, int>> particleCellIndices;
-    vector<int> cellStartIndices;
+    PlacedVector<sf::Vector2f> particlePosition;
+    PlacedVector<sf::Vector2f> particlePositionPredicted;
+    PlacedVector<sf::Vector2f> particleVelocity;
+    PlacedVector<float> particleDensity;
+    PlacedVector<CellSlot> particleCellIndices;
+    PlacedVector<ParticleIndex> cellStartIndices;
+    vector<uint16_t> cellQuietSteps;       // steps each cell has been settled, empty while sleeping is off
+    vector<float> cellMeanDensity;         // for the settle test of the next step
+    PlacedVector<uint8_t> particleAsleep;  // taken from the cells at the start of each step
+    PlacedVector<uint8_t> particlePhase;   // index into params.phases
+    PlacedVector<uint32_t> particleId;     // stable across the swap-removes that reorder the arrays
+    vector<Emitter> emitters;
+    vector<Sink> sinks;
+    ObstacleField obstacles;
+    RigidBodySystem rigidBodies;
+    TaskGraph taskGraph; // schedules the solver phases per block of cells, see prepareTaskGraph
+    LoadBalancer loadBalancer; // splits the parallel loops when the task graph is not used
+    std::function<void(TelemetryPhase)> phaseHook; // after the density and velocity phases, refreshes halo particles
     float particleRadius;
     float forceStrengthOriginal;
+    size_t stepCounter = 0;
+    StepStats stepStats;
+    Telemetry telemetry;
+    uint64_t rngState = 0x2545F4914F6CDD1Dull;
+    int cellDivisions = 1; // of the grid in use, params.cellDivisions or the one chosen for the density
 
-    DebugTimer debugTimerT;
     DebugTimer debugTimerS;
 
-    Parameters &params;
+    Parameters params; // owned, so independent instances can run side by side
 
-    ParticleSystem(Parameters &params);
-    void addParticle(Vector2f pos);
+    ParticleSystem(const Parameters &params);
+    uint32_t addParticle(Vector2f pos, Vector2f velocity = Vector2f(0.0f, 0.0f), uint8_t phase = 0);
+    void removeParticle(int index);
+    void compactParticles();
+    void reorderParticles();
+    void reserveParticles(size_t capacity);
+    void setParticleCount(int count);
+    int findParticle(uint32_t id) const;
+    void applyMemoryMode();
+    // where density and pressure are evaluated, the moved position when reducedMemory drops the predictions
+    const Vector2f &predictedPosition(int i) const { return params.reducedMemory ? particlePosition[i] : particlePositionPredicted[i]; }
+    uint8_t spawnPhase() const;
+    void resetParticleIds();
+    void assignParticleIds(const vector<uint32_t> &ids);
+    void updateSources(float timeStep);
     void updateParticles(float timeStep);
     void clearParticles();
+    void setParticles(const vector<Vector2f> &positions, const vector<Vector2f> &velocities, const vector<uint8_t> &phases);
     void updateParticleCells();
     void initParticles(int count);
     void applyCentralForce(Vector2f center, float radius, float strength);
-    void processVisosity(int index);
-    void processParticleAboutToOutOfBounds(int index, float timeStep);
+    void wakeAll();
+    void wakeCell(Vector2f pos);
+    void prepareObstacles();
     void updateCellSizes();
+    void chooseCellDivisions();
+    float cellSize() const { return params.densitySampleRadius / cellDivisions; }
+    void updateStepStats();
+    void countRemotePages(size_t &remote, size_t &present) const;
+    size_t reservedBytes() const; // of the particle and cell arrays
     void adjustForceStrength(float density);
-    float getDensityAt(Vector2f pos) const;
-    sf::Vector2f getPushForce(int i) const;
-    float gradientKernel(float distance) const;
-    float getPushForceBetween(int i, int j) const;
+    float getDensityAt(Vector2f pos, int *neighborCount = nullptr) const;
     float densityKernel(float distance) const;
-    float shortDistPushKernel(float distance) const;
+    StepConstants makeStepConstants(float timeStep) const;
     int getCellIndex(Vector2f pos) const;
     int getCellIndex(sf::Vector2i cellPos) const;
-    vector<int> getParticlesWithRadius(Vector2f pos) const;
+    std::pmr::vector<int> getParticlesWithRadius(Vector2f pos, std::pmr::memory_resource *memory = std::pmr::get_default_resource()) const;
+    float randomFloat();
+
+    template <class Visit>
+    int forEachNeighbor(Vector2f pos, const StepConstants &c, Visit &&visit) const
+    {
+        // visits the particles within the sample radius of pos without building a list. visit also
+        // gets the shift that moves the neighbour to its nearest periodic image, zero without wrapping.
+        // returns how many particles were tested against the radius
+        if (!c.periodicX && !c.periodicY)
+            return forEachNeighborInCells(pos, Vector2f(0.0f, 0.0f), c, visit);
+        // on a periodic axis the query is wrapped into the domain and repeated on the far side of a
+        // nearby seam, so the stencil wraps without ghost particles
+        // the finer grids widen the stencil by the slack, so the seam test widens with it
+        const float reach = c.radius + c.cellSlack;
+        Vector2f home = pos;
+        float imagesX[2] = {0.0f, 0.0f};
+        float imagesY[2] = {0.0f, 0.0f};
+        int countX = 1, countY = 1;
+        if (c.periodicX)
+        {
+            home.x -= std::floor(pos.x / c.width) * c.width;
+            if (home.x < reach)
+                imagesX[countX++] = c.width;
+            else if (home.x > c.width - reach)
+                imagesX[countX++] = -c.width;
+        }
+        if (c.periodicY)
+        {
+            home.y -= std::floor(pos.y / c.height) * c.height;
+            if (home.y < reach)
+                imagesY[countY++] = c.height;
+            else if (home.y > c.height - reach)
+                imagesY[countY++] = -c.height;
+        }
+        int tested = 0;
+        for (int iy = 0; iy < countY; ++iy)
+        {
+            for (int ix = 0; ix < countX; ++ix)
+            {
+                Vector2f query = home + Vector2f(imagesX[ix], imagesY[iy]);
+                tested += forEachNeighborInCells(query, pos - query, c, visit);
+            }
+        }
+        return tested;
+    }
+
+    template <class Visit>
+    int forEachNeighborInCells(Vector2f pos, Vector2f shift, const StepConstants &c, Visit &visit) const
+    {
+        // the stencil around pos, cells outside the grid are skipped. the cells of a row are
+        // consecutive in the sorted particles, so each row is one run of them
+        const int count = static_cast<int>(particlePosition.size());
+        const int cellCount = static_cast<int>(cellStartIndices.size());
+        int tested = 0;
+        forEachStencilRow(pos, c, [&](int y, int x0, int x1)
+                          {
+                              if (y < 0 || y >= c.rows)
+                                  return;
+                              const int first = std::max(x0, 0) + y * c.cols;
+                              const int last = std::min({x1, c.cols - 1, cellCount - 1 - y * c.cols}) + y * c.cols;
+                              int startIndex = -1;
+                              for (int cellIndex = first; cellIndex <= last && startIndex == -1; ++cellIndex)
+                                  startIndex = cellStartIndices[cellIndex];
+                              if (startIndex == -1)
+                                  return;
+                              for (int i = startIndex; i < count && std::get<1>(particleCellIndices[i]) <= last; ++i, ++tested)
+                              {
+                                  int particleIndex = std::get<0>(particleCellIndices[i]);
+                                  if ((particlePosition[particleIndex] - pos).lengthSquared() < c.radiusSquared)
+                                      visit(particleIndex, shift);
+                              } });
+        return tested;
+    }
+
+private:
+    struct SleepSettings
+    {
+        StepConstants constants;
+        int variant;
+        float forceStrength;
+        uint32_t obstacleVersion;
+    };
+    SleepSettings sleepSettings{}; // settings the sleeping cells settled under
+
+    static constexpr float rowVisitCost = 6.0f; // of a row of cells in particle tests, for chooseCellDivisions
+    static constexpr uint32_t noParticle = 0xFFFFFFFFu;
+    vector<uint32_t> idSlots;     // id -> index, noParticle for free ids
+    vector<uint32_t> freeIds;     // recycled before new ids are handed out
+    vector<int> pendingRemovals;  // indices removed by the next compactParticles
+
+    std::array<int, 5> taskLayout{}; // grid and block size the task graph was built for
+    bool ranTaskGraph = false;       // in the last step, for countRemotePages
+    int blocksX = 0;
+    int blocksY = 0;
+    vector<int> blockRangeStart;             // per block, into blockRanges
+    vector<std::pair<int, int>> blockRanges; // runs of particleCellIndices, one per row of cells
+
+    int tileCells = 0; // side of the tiles the neighbour phases are packed in, 0 while tiling is off
+    int tilesX = 0;
+    int tilesY = 0;
+    vector<PackedTile> packedTiles; // one per thread, reused between steps
+
+    using StepFunction = void (ParticleSystem::*)(const StepConstants &);
+    template <size_t... Variants>
+    static constexpr std::array<StepFunction, sizeof...(Variants)> makeStepTable(std::index_sequence<Variants...>);
+    template <bool Gravity, bool AdjustingForce, bool Sleeping, bool Boundaries, bool Multiphase, class Kernel>
+    void step(const StepConstants &c);
+    // the thread a static omp loop over the particles runs index i on
+    int staticThread(int i, int threads) const
+    {
+        const int count = static_cast<int>(particlePosition.size());
+        return i / std::max((count + threads - 1) / threads, 1);
+    }
+    bool prepareTaskGraph(const StepConstants &c);
+    void buildTaskGraph(const StepConstants &c, int blockCells);
+    template <class Body>
+    void forEachBlockParticle(int block, Body &body) const
+    {
+        for (int range = blockRangeStart[block]; range < blockRangeStart[block + 1]; ++range)
+        {
+            for (int slot = blockRanges[range].first; slot < blockRanges[range].second; ++slot)
+                body(std::get<0>(particleCellIndices[slot]));
+        }
+    }
+    template <class Body>
+    void forEachBalancedParticle(Body &body, bool parallel)
+    {
+        // each thread runs its own chunk of the sorted particles and times it; without chunks for
+        // every thread the loop falls back to static chunks of indices
+        const int count = static_cast<int>(particlePosition.size());
+#pragma omp parallel if (parallel)
+        {
+            const int thread = omp_get_thread_num();
+            const int threads = omp_get_num_threads();
+            auto start = std::chrono::steady_clock::now();
+            if (loadBalancer.chunkCount() == threads)
+            {
+                for (int slot = loadBalancer.chunkStart[thread]; slot < loadBalancer.chunkStart[thread + 1]; ++slot)
+                    body(std::get<0>(particleCellIndices[slot]));
+            }
+            else
+            {
+#pragma omp for schedule(static) nowait
+                for (int i = 0; i < count; ++i)
+                    body(i);
+            }
+            if (parallel)
+                loadBalancer.record(thread, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+    }
+    void markSleepingParticles(const StepConstants &c);
+    void updateCellActivity(const StepConstants &c);
+    // the neighbour sums read the particles of a source, this system or a packed tile
+    template <class Kernel, class Source>
+    static float densityAt(const Source &source, Vector2f pos, const StepConstants &c, int &neighborCount, int &candidateCount);
+    template <class Kernel, bool Multiphase, class Source>
+    static Vector2f pushForce(const Source &source, int index, const StepConstants &c, float pressureScale, bool &clamped);
+    template <class Kernel, bool Multiphase, class Source>
+    static void applyViscosity(Source &source, int index, const StepConstants &c);
+    bool prepareTiles(const StepConstants &c);
+    void packTile(PackedTile &tile, int index, const StepConstants &c) const;
+    template <class Body>
+    void forEachTileParticle(const StepConstants &c, bool parallel, Body &body)
+    {
+        // body(tile, packed index) for the particles of every tile, each tile packed just before
+#pragma omp parallel for schedule(dynamic) if (parallel)
+        for (int t = 0; t < tilesX * tilesY; ++t)
+        {
+            const int thread = omp_get_thread_num();
+            auto start = std::chrono::steady_clock::now();
+            PackedTile &tile = packedTiles[thread];
+            packTile(tile, t, c);
+            for (int k : tile.own)
+                body(tile, k);
+            if (parallel)
+                loadBalancer.record(thread, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+    }
+    void resolveBounds(int index, const StepConstants &c);
 };
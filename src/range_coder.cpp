@@ -0,0 +1,141 @@
+#include "range_coder.h"
+#include <algorithm>
+
+static constexpr int probBits = 11;
+static constexpr int moveBits = 5;
+static constexpr uint32_t topValue = 1u << 24;
+
+ByteModel::ByteModel()
+{
+    std::fill(std::begin(probs), std::end(probs), uint16_t(1 << (probBits - 1)));
+}
+
+void RangeEncoder::encodeBit(uint16_t &prob, int bit)
+{
+    uint32_t bound = (range >> probBits) * prob;
+    if (bit == 0)
+    {
+        range = bound;
+        prob += ((1 << probBits) - prob) >> moveBits;
+    }
+    else
+    {
+        low += bound;
+        range -= bound;
+        prob -= prob >> moveBits;
+    }
+    while (range < topValue)
+    {
+        range <<= 8;
+        shiftLow();
+    }
+}
+
+void RangeEncoder::shiftLow()
+{
+    // carries are held back in cache until the next byte can no longer change
+    if (static_cast<uint32_t>(low) < 0xFF000000u || (low >> 32) != 0)
+    {
+        uint8_t carry = static_cast<uint8_t>(low >> 32);
+        uint8_t temp = cache;
+        do
+        {
+            bytes.push_back(static_cast<uint8_t>(temp + carry));
+            temp = 0xFF;
+        } while (--cacheSize != 0);
+        cache = static_cast<uint8_t>(low >> 24);
+    }
+    cacheSize++;
+    low = (low & 0x00FFFFFF) << 8;
+}
+
+void RangeEncoder::encodeByte(ByteModel &model, uint8_t value)
+{
+    int node = 1;
+    for (int i = 7; i >= 0; --i)
+    {
+        int bit = (value >> i) & 1;
+        encodeBit(model.probs[node], bit);
+        node = (node << 1) | bit;
+    }
+}
+
+void RangeEncoder::encodeVarint(ByteModel *models, int modelCount, uint64_t value)
+{
+    // 7 bits per byte, the n-th byte of a value is coded with models[min(n, modelCount - 1)]
+    for (int n = 0;; ++n)
+    {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        encodeByte(models[std::min(n, modelCount - 1)], byte | (value ? 0x80 : 0));
+        if (!value)
+            break;
+    }
+}
+
+void RangeEncoder::flush()
+{
+    for (int i = 0; i < 5; ++i)
+        shiftLow();
+}
+
+void RangeEncoder::reset()
+{
+    bytes.clear();
+    low = 0;
+    range = 0xFFFFFFFF;
+    cache = 0;
+    cacheSize = 1;
+}
+
+RangeDecoder::RangeDecoder(const uint8_t *data, size_t size) : data(data), size(size)
+{
+    for (int i = 0; i < 5; ++i)
+        code = (code << 8) | nextByte();
+}
+
+int RangeDecoder::decodeBit(uint16_t &prob)
+{
+    uint32_t bound = (range >> probBits) * prob;
+    int bit;
+    if (code < bound)
+    {
+        range = bound;
+        prob += ((1 << probBits) - prob) >> moveBits;
+        bit = 0;
+    }
+    else
+    {
+        code -= bound;
+        range -= bound;
+        prob -= prob >> moveBits;
+        bit = 1;
+    }
+    while (range < topValue)
+    {
+        range <<= 8;
+        code = (code << 8) | nextByte();
+    }
+    return bit;
+}
+
+uint8_t RangeDecoder::decodeByte(ByteModel &model)
+{
+    int node = 1;
+    for (int i = 0; i < 8; ++i)
+        node = (node << 1) | decodeBit(model.probs[node]);
+    return static_cast<uint8_t>(node);
+}
+
+uint64_t RangeDecoder::decodeVarint(ByteModel *models, int modelCount)
+{
+    uint64_t value = 0;
+    for (int n = 0; n < 10; ++n)
+    {
+        uint8_t byte = decodeByte(models[std::min(n, modelCount - 1)]);
+        value |= static_cast<uint64_t>(byte & 0x7F) << (7 * n);
+        if (!(byte & 0x80))
+            break;
+    }
+    return value;
+}
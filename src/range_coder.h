@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+struct ByteModel
+{
+    // adaptive probabilities of a byte, coded msb first along a binary tree
+    uint16_t probs[256];
+    ByteModel();
+};
+
+class RangeEncoder
+{
+    // adaptive binary range coder in the style of lzma
+public:
+    std::vector<uint8_t> bytes;
+
+    void encodeByte(ByteModel &model, uint8_t value);
+    void encodeVarint(ByteModel *models, int modelCount, uint64_t value);
+    void flush();
+    void reset();
+
+private:
+    uint64_t low = 0;
+    uint32_t range = 0xFFFFFFFF;
+    uint8_t cache = 0;
+    uint64_t cacheSize = 1;
+
+    void encodeBit(uint16_t &prob, int bit);
+    void shiftLow();
+};
+
+class RangeDecoder
+{
+public:
+    RangeDecoder(const uint8_t *data, size_t size);
+    uint8_t decodeByte(ByteModel &model);
+    uint64_t decodeVarint(ByteModel *models, int modelCount);
+    bool overrun() const { return position > size + 4; }
+
+private:
+    const uint8_t *data;
+    size_t size;
+    size_t position = 0;
+    uint32_t range = 0xFFFFFFFF;
+    uint32_t code = 0;
+
+    int decodeBit(uint16_t &prob);
+    uint8_t nextByte() { return position < size ? data[position++] : (position++, 0); }
+};
+
+inline uint64_t zigzagEncode(int64_t value)
+{
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t zigzagDecode(uint64_t value)
+{
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
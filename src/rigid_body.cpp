@@ -0,0 +1,328 @@
+#include "rigid_body.h"
+#include <algorithm>
+#include <cmath>
+#include "particle_system.h"
+
+static float cross(Vector2f a, Vector2f b)
+{
+    return a.x * b.y - a.y * b.x;
+}
+
+static Vector2f rotate(Vector2f v, float angle)
+{
+    float c = std::cos(angle);
+    float s = std::sin(angle);
+    return Vector2f(v.x * c - v.y * s, v.x * s + v.y * c);
+}
+
+Vector2f RigidBody::toWorld(Vector2f local) const
+{
+    return position + rotate(local, angle);
+}
+
+Vector2f RigidBody::velocityAt(Vector2f point) const
+{
+    Vector2f r = point - position;
+    return velocity + Vector2f(-r.y, r.x) * angularVelocity;
+}
+
+float RigidBody::signedDistance(Vector2f point, Vector2f &normal) const
+{
+    Vector2f q = point - position;
+    if (shape == BodyShape::Circle)
+    {
+        float length = q.length();
+        normal = length > 0.0f ? q / length : Vector2f(0.0f, -1.0f);
+        return length - radius;
+    }
+
+    // the polygon is convex: inside, the nearest edge is the one with the largest plane
+    // distance; outside, the nearest point on the outline
+    q = rotate(q, -angle);
+    float largestPlane = -1e9f;
+    Vector2f planeNormal(0.0f, -1.0f);
+    float nearest = 1e9f;
+    Vector2f nearestOffset(0.0f, -1.0f);
+    for (size_t i = 0; i < vertices.size(); ++i)
+    {
+        Vector2f a = vertices[i];
+        Vector2f edge = vertices[(i + 1) % vertices.size()] - a;
+        Vector2f outward = Vector2f(edge.y, -edge.x).normalized();
+        float plane = (q - a).dot(outward);
+        if (plane > largestPlane)
+        {
+            largestPlane = plane;
+            planeNormal = outward;
+        }
+        float t = std::clamp((q - a).dot(edge) / edge.lengthSquared(), 0.0f, 1.0f);
+        Vector2f offset = q - (a + edge * t);
+        if (offset.lengthSquared() < nearest)
+        {
+            nearest = offset.lengthSquared();
+            nearestOffset = offset;
+        }
+    }
+    if (largestPlane <= 0.0f || nearest == 0.0f)
+    {
+        normal = rotate(planeNormal, angle);
+        return largestPlane;
+    }
+    nearest = std::sqrt(nearest);
+    normal = rotate(nearestOffset / nearest, angle);
+    return nearest;
+}
+
+void RigidBody::applyImpulse(Vector2f impulse, Vector2f point)
+{
+    velocity += impulse * inverseMass;
+    angularVelocity += cross(point - position, impulse) * inverseInertia;
+}
+
+void RigidBodySystem::addCircle(Vector2f position, float radius, float density)
+{
+    RigidBody body;
+    body.shape = BodyShape::Circle;
+    body.radius = radius;
+    body.position = position;
+    float mass = density * 3.14159f * radius * radius;
+    body.inverseMass = 1.0f / mass;
+    body.inverseInertia = 1.0f / (0.5f * mass * radius * radius);
+    bodies.push_back(body);
+}
+
+void RigidBodySystem::addBox(Vector2f position, Vector2f halfSize, float density)
+{
+    addPolygon(position, {{-halfSize.x, -halfSize.y}, {halfSize.x, -halfSize.y}, {halfSize.x, halfSize.y}, {-halfSize.x, halfSize.y}}, density);
+}
+
+void RigidBodySystem::addPolygon(Vector2f position, std::vector<Vector2f> vertices, float density)
+{
+    // moves the vertices around the centroid and makes the winding counter clockwise
+    float area = 0.0f;
+    Vector2f centroid(0.0f, 0.0f);
+    for (size_t i = 0; i < vertices.size(); ++i)
+    {
+        Vector2f a = vertices[i];
+        Vector2f b = vertices[(i + 1) % vertices.size()];
+        float c = cross(a, b);
+        area += c * 0.5f;
+        centroid += (a + b) * (c / 6.0f);
+    }
+    if (vertices.size() < 3 || std::abs(area) < 1e-3f)
+        return;
+    centroid /= area;
+    if (area < 0.0f)
+    {
+        std::reverse(vertices.begin(), vertices.end());
+        area = -area;
+    }
+
+    RigidBody body;
+    body.shape = BodyShape::Polygon;
+    body.position = position;
+    float inertia = 0.0f;
+    for (Vector2f &v : vertices)
+    {
+        v -= centroid;
+        body.radius = std::max(body.radius, v.length());
+    }
+    for (size_t i = 0; i < vertices.size(); ++i)
+    {
+        Vector2f a = vertices[i];
+        Vector2f b = vertices[(i + 1) % vertices.size()];
+        inertia += cross(a, b) * (a.dot(a) + a.dot(b) + b.dot(b)) / 12.0f;
+    }
+    body.vertices = std::move(vertices);
+    body.inverseMass = 1.0f / (density * area);
+    body.inverseInertia = 1.0f / (density * inertia);
+    bodies.push_back(std::move(body));
+}
+
+void RigidBodySystem::step(ParticleSystem &particleSystem, const StepConstants &c, float gravity)
+{
+    contacts = 0;
+    for (RigidBody &body : bodies)
+        integrate(body, c, gravity);
+    for (RigidBody &body : bodies)
+        coupleParticles(body, particleSystem, c);
+    for (size_t i = 0; i < bodies.size(); ++i)
+    {
+        for (size_t j = i + 1; j < bodies.size(); ++j)
+            collideBodies(bodies[i], bodies[j]);
+    }
+    for (RigidBody &body : bodies)
+        collideWorld(body, particleSystem, c);
+}
+
+void RigidBodySystem::integrate(RigidBody &body, const StepConstants &c, float gravity)
+{
+    // gravity is a velocity per step, the same as for the particles
+    body.velocity.y += gravity;
+    body.position += body.velocity * c.timeStep;
+    // wrapped like the particles; coupling does not reach across the seam, so a body there only
+    // sees the fluid on its own side
+    if (c.periodicX)
+        body.position.x -= std::floor(body.position.x / c.width) * c.width;
+    if (c.periodicY)
+        body.position.y -= std::floor(body.position.y / c.height) * c.height;
+    body.angle += body.angularVelocity * c.timeStep;
+    body.angularVelocity *= 0.999f;
+}
+
+void RigidBodySystem::coupleParticles(RigidBody &body, ParticleSystem &particleSystem, const StepConstants &c)
+{
+    // the cells under the bounding box plus a search's reach, particles may have moved since the sort
+    float reach = body.radius + c.particleRadius;
+    int x0 = std::max(static_cast<int>((body.position.x - reach) * c.inverseCellSize) - c.cellReach, 0);
+    int x1 = std::min(static_cast<int>((body.position.x + reach) * c.inverseCellSize) + c.cellReach, c.cols - 1);
+    int y0 = std::max(static_cast<int>((body.position.y - reach) * c.inverseCellSize) - c.cellReach, 0);
+    int y1 = std::min(static_cast<int>((body.position.y + reach) * c.inverseCellSize) + c.cellReach, c.rows - 1);
+
+    // heavier phases push harder, the same per phase mass the neighbour sums use
+    float phaseInverseMass[Parameters::maxPhases];
+    for (int phase = 0; phase < Parameters::maxPhases; ++phase)
+        phaseInverseMass[phase] = 1.0f / c.phaseMass[phase];
+    const int count = static_cast<int>(particleSystem.particlePosition.size());
+    for (int y = y0; y <= y1; ++y)
+    {
+        for (int x = x0; x <= x1; ++x)
+        {
+            int cellIndex = x + y * c.cols;
+            int start = cellIndex < static_cast<int>(particleSystem.cellStartIndices.size()) ? particleSystem.cellStartIndices[cellIndex] : -1;
+            if (start == -1)
+                continue;
+            for (int i = start; i < count && std::get<1>(particleSystem.particleCellIndices[i]) == cellIndex; ++i)
+            {
+                int p = std::get<0>(particleSystem.particleCellIndices[i]);
+                Vector2f &position = particleSystem.particlePosition[p];
+                Vector2f &velocity = particleSystem.particleVelocity[p];
+                Vector2f normal;
+                float depth = c.particleRadius - body.signedDistance(position, normal);
+                if (depth <= 0.0f)
+                    continue;
+                contacts++;
+
+                // a sleeping particle holds still unless it is hit hard enough to wake it
+                Vector2f point = position - normal * c.particleRadius;
+                float normalSpeed = (velocity - body.velocityAt(point)).dot(normal);
+                bool asleep = p < static_cast<int>(particleSystem.particleAsleep.size()) && particleSystem.particleAsleep[p];
+                if (asleep && -normalSpeed > particleSystem.params.sleepSpeed)
+                {
+                    particleSystem.wakeCell(position);
+                    asleep = false;
+                }
+                const int phase = p < static_cast<int>(particleSystem.particlePhase.size()) ? particleSystem.particlePhase[p] : 0;
+                float inverseMass = asleep ? 0.0f : phaseInverseMass[phase];
+
+                if (normalSpeed < 0.0f)
+                {
+                    float rn = cross(point - body.position, normal);
+                    float k = inverseMass + body.inverseMass + rn * rn * body.inverseInertia;
+                    float j = -(1.0f + restitution) * normalSpeed / k;
+                    velocity += normal * (j * inverseMass);
+                    body.applyImpulse(-normal * j, point);
+                }
+                // the particle is moved out, unless it is asleep and the body has to give way
+                if (asleep)
+                    body.position -= normal * depth;
+                else
+                    position += normal * depth;
+            }
+        }
+    }
+}
+
+void RigidBodySystem::collideWorld(RigidBody &body, const ParticleSystem &particleSystem, const StepConstants &c)
+{
+    // window edges and static obstacles, sampled at the circle or at the polygon corners
+    const ObstacleField &obstacles = particleSystem.obstacles;
+    auto collidePoint = [&](Vector2f point, float radius)
+    {
+        if (!c.periodicX && point.x - radius < 0.0f)
+            resolveContact(body, nullptr, Vector2f(0.0f, point.y), Vector2f(1.0f, 0.0f), radius - point.x);
+        if (!c.periodicX && point.x + radius > c.width)
+            resolveContact(body, nullptr, Vector2f(c.width, point.y), Vector2f(-1.0f, 0.0f), point.x + radius - c.width);
+        if (!c.periodicY && point.y - radius < 0.0f)
+            resolveContact(body, nullptr, Vector2f(point.x, 0.0f), Vector2f(0.0f, 1.0f), radius - point.y);
+        if (!c.periodicY && point.y + radius > c.height)
+            resolveContact(body, nullptr, Vector2f(point.x, c.height), Vector2f(0.0f, -1.0f), point.y + radius - c.height);
+        if (obstacles.hasSolid())
+        {
+            float depth = radius - obstacles.sampleDistance(point);
+            if (depth > 0.0f)
+            {
+                Vector2f normal = obstacles.sampleNormal(point);
+                resolveContact(body, nullptr, point - normal * radius, normal, depth);
+            }
+        }
+    };
+    if (body.shape == BodyShape::Circle)
+        collidePoint(body.position, body.radius);
+    else
+    {
+        for (Vector2f vertex : body.vertices)
+            collidePoint(body.toWorld(vertex), 0.0f);
+    }
+}
+
+void RigidBodySystem::collideBodies(RigidBody &a, RigidBody &b)
+{
+    if ((a.position - b.position).lengthSquared() > (a.radius + b.radius) * (a.radius + b.radius))
+        return;
+    // the points of one body against the distance of the other, both ways round
+    auto collideInto = [](RigidBody &from, RigidBody &into)
+    {
+        Vector2f normal;
+        if (from.shape == BodyShape::Circle)
+        {
+            float depth = from.radius - into.signedDistance(from.position, normal);
+            if (depth > 0.0f)
+                resolveContact(from, &into, from.position - normal * from.radius, normal, depth);
+            return;
+        }
+        for (Vector2f vertex : from.vertices)
+        {
+            Vector2f point = from.toWorld(vertex);
+            float depth = -into.signedDistance(point, normal);
+            if (depth > 0.0f)
+                resolveContact(from, &into, point, normal, depth);
+        }
+    };
+    collideInto(a, b);
+    if (a.shape != BodyShape::Circle || b.shape != BodyShape::Circle)
+        collideInto(b, a);
+}
+
+void RigidBodySystem::resolveContact(RigidBody &a, RigidBody *b, Vector2f point, Vector2f normal, float depth)
+{
+    // normal points from b (or the world) towards a
+    Vector2f relative = a.velocityAt(point) - (b ? b->velocityAt(point) : Vector2f(0.0f, 0.0f));
+    float normalSpeed = relative.dot(normal);
+    float ra = cross(point - a.position, normal);
+    float k = a.inverseMass + ra * ra * a.inverseInertia;
+    float rb = b ? cross(point - b->position, normal) : 0.0f;
+    if (b)
+        k += b->inverseMass + rb * rb * b->inverseInertia;
+
+    if (normalSpeed < 0.0f && k > 0.0f)
+    {
+        float j = -(1.0f + restitution) * normalSpeed / k;
+        Vector2f tangent(-normal.y, normal.x);
+        float ta = cross(point - a.position, tangent);
+        float tb = b ? cross(point - b->position, tangent) : 0.0f;
+        float kt = a.inverseMass + ta * ta * a.inverseInertia + (b ? b->inverseMass + tb * tb * b->inverseInertia : 0.0f);
+        float jt = std::clamp(-relative.dot(tangent) / kt, -friction * j, friction * j);
+        Vector2f impulse = normal * j + tangent * jt;
+        a.applyImpulse(impulse, point);
+        if (b)
+            b->applyImpulse(-impulse, point);
+    }
+
+    // split most of the overlap between the bodies by their inverse mass
+    float total = a.inverseMass + (b ? b->inverseMass : 0.0f);
+    if (total <= 0.0f)
+        return;
+    a.position += normal * (depth * 0.8f * a.inverseMass / total);
+    if (b)
+        b->position -= normal * (depth * 0.8f * b->inverseMass / total);
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <SFML/System.hpp>
+#include <vector>
+
+class ParticleSystem;
+struct StepConstants;
+
+enum class BodyShape
+{
+    Circle,
+    Polygon
+};
+
+struct RigidBody
+{
+    BodyShape shape = BodyShape::Circle;
+    std::vector<sf::Vector2f> vertices; // convex, counter clockwise, around the centre of mass
+    float radius = 0.0f;                // of the circle, or the bounding circle of a polygon
+    sf::Vector2f position;
+    sf::Vector2f velocity;
+    float angle = 0.0f;
+    float angularVelocity = 0.0f;
+    float inverseMass = 0.0f;
+    float inverseInertia = 0.0f;
+
+    sf::Vector2f toWorld(sf::Vector2f local) const;
+    sf::Vector2f velocityAt(sf::Vector2f point) const;
+    float signedDistance(sf::Vector2f point, sf::Vector2f &normal) const;
+    void applyImpulse(sf::Vector2f impulse, sf::Vector2f point);
+};
+
+class RigidBodySystem
+{
+    // dynamic bodies that trade impulses with the particles. the broadphase is the fluid's
+    // own cell grid: each body only visits the cells under its bounding box, so coupling
+    // costs in proportion to the particles near bodies
+public:
+    std::vector<RigidBody> bodies;
+    int contacts = 0; // particle contacts in the last step
+
+    void addCircle(sf::Vector2f position, float radius, float density);
+    void addBox(sf::Vector2f position, sf::Vector2f halfSize, float density);
+    void addPolygon(sf::Vector2f position, std::vector<sf::Vector2f> vertices, float density);
+    bool empty() const { return bodies.empty(); }
+    void clear() { bodies.clear(); }
+
+    // one substep, called from inside the solver step after the particles have moved
+    void step(ParticleSystem &particleSystem, const StepConstants &c, float gravity);
+
+private:
+    static constexpr float restitution = 0.2f;
+    static constexpr float friction = 0.3f;
+
+    void integrate(RigidBody &body, const StepConstants &c, float gravity);
+    void coupleParticles(RigidBody &body, ParticleSystem &particleSystem, const StepConstants &c);
+    void collideWorld(RigidBody &body, const ParticleSystem &particleSystem, const StepConstants &c);
+    void collideBodies(RigidBody &a, RigidBody &b);
+    static void resolveContact(RigidBody &a, RigidBody *b, sf::Vector2f point, sf::Vector2f normal, float depth);
+};
@@ -0,0 +1,270 @@
+#include "sweep.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+#include <thread>
+#include <omp.h>
+#include "particle_system.h"
+#include "watchdog.h"
+
+WorkStealingPool::WorkStealingPool(int workerCount)
+    : workerCount(std::max(workerCount, 1)), queues(std::max(workerCount, 1))
+{
+}
+
+void WorkStealingPool::run(const std::vector<double> &taskCosts, const Work &work)
+{
+    // deal the largest tasks first to the least loaded worker, stealing fixes the estimate errors
+    std::vector<size_t> order(taskCosts.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b)
+              { return taskCosts[a] > taskCosts[b]; });
+    std::vector<double> load(workerCount, 0.0);
+    for (size_t task : order)
+    {
+        int worker = static_cast<int>(std::min_element(load.begin(), load.end()) - load.begin());
+        queues[worker].tasks.push_back(task);
+        load[worker] += taskCosts[task];
+    }
+
+    stolenTasks.assign(workerCount, 0);
+    std::vector<std::thread> threads;
+    for (int worker = 0; worker < workerCount; ++worker)
+    {
+        threads.emplace_back([this, worker, &work]()
+                             {
+                                 size_t task;
+                                 while (pop(worker, task) || steal(worker, task))
+                                     work(task, worker); });
+    }
+    for (auto &thread : threads)
+        thread.join();
+}
+
+bool WorkStealingPool::pop(int worker, size_t &task)
+{
+    std::lock_guard<std::mutex> lock(queues[worker].mutex);
+    if (queues[worker].tasks.empty())
+        return false;
+    task = queues[worker].tasks.front();
+    queues[worker].tasks.pop_front();
+    return true;
+}
+
+bool WorkStealingPool::steal(int thief, size_t &task)
+{
+    for (int i = 1; i < workerCount; ++i)
+    {
+        Queue &victim = queues[(thief + i) % workerCount];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (victim.tasks.empty())
+            continue;
+        task = victim.tasks.back();
+        victim.tasks.pop_back();
+        stolenTasks[thief]++;
+        return true;
+    }
+    return false;
+}
+
+bool SweepRunner::setParameter(Parameters &params, const std::string &name, float value)
+{
+    if (name == "targetDensity")
+        params.targetDensity = value;
+    else if (name == "forceStrength")
+        params.forceStrength = value;
+    else if (name == "viscosity")
+        params.viscosity = value;
+    else if (name == "densitySampleRadius")
+        params.densitySampleRadius = value;
+    else if (name == "cellDivisions")
+        params.cellDivisions = static_cast<int>(value);
+    else if (name == "particleCount")
+        params.particleCount = static_cast<int>(value);
+    else if (name == "particleMass")
+        params.particleMass = value;
+    else if (name == "gravityStrength")
+        params.gravityStrength = value;
+    else if (name == "movingDamping")
+        params.movingDamping = value;
+    else if (name == "collisionDamping")
+        params.collisionDamping = value;
+    else if (name == "timeScale")
+        params.timeScale = value;
+    else if (name == "stepCount")
+        params.stepCount = static_cast<int>(value);
+    else if (name == "periodicX")
+        params.periodicX = value != 0.0f;
+    else if (name == "periodicY")
+        params.periodicY = value != 0.0f;
+    else
+        return false;
+    return true;
+}
+
+bool SweepRunner::loadGrid(const std::string &path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        std::cerr << "Failed to open sweep grid " << path << std::endl;
+        return false;
+    }
+
+    int frames = 300;
+    std::vector<std::pair<std::string, std::vector<float>>> axes;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        line = line.substr(0, line.find('#'));
+        size_t equals = line.find('=');
+        if (equals == std::string::npos)
+            continue;
+        std::string name = line.substr(0, equals);
+        name.erase(std::remove_if(name.begin(), name.end(), ::isspace), name.end());
+        std::string list = line.substr(equals + 1);
+        std::replace(list.begin(), list.end(), ',', ' ');
+        std::istringstream values(list);
+        std::vector<float> axis;
+        for (float v; values >> v;)
+            axis.push_back(v);
+        if (axis.empty())
+            continue;
+
+        Parameters probe;
+        if (name == "frames")
+            frames = static_cast<int>(axis.front());
+        else if (setParameter(probe, name, axis.front()))
+            axes.push_back({name, axis});
+        else
+            std::cerr << "Unknown sweep parameter: " << name << std::endl;
+    }
+
+    cases.clear();
+    size_t total = 1;
+    for (auto &axis : axes)
+        total *= axis.second.size();
+    for (size_t index = 0; index < total; ++index)
+    {
+        SweepCase sweepCase;
+        sweepCase.params = base;
+        sweepCase.frames = frames;
+        size_t rest = index;
+        for (auto &axis : axes)
+        {
+            float value = axis.second[rest % axis.second.size()];
+            rest /= axis.second.size();
+            setParameter(sweepCase.params, axis.first, value);
+            sweepCase.values.push_back({axis.first, value});
+        }
+        cases.push_back(sweepCase);
+    }
+    return !cases.empty();
+}
+
+SweepResult SweepRunner::runCase(const SweepCase &sweepCase) const
+{
+    ParticleSystem particleSystem(sweepCase.params);
+    StabilityWatchdog watchdog;
+    const Parameters &params = particleSystem.params;
+    particleSystem.particleRadius = 8.0f; // half the particle texture, as in the window
+    particleSystem.initParticles(params.particleCount);
+
+    SweepResult result;
+    float timeStep = params.timeScale * (1000.0f / params.targetFps) / 100.0f / params.stepCount;
+    double densityError = 0.0;
+    double neighbors = 0.0;
+    double candidates = 0.0;
+    int steps = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < sweepCase.frames; ++frame)
+    {
+        for (int i = 0; i < params.stepCount; ++i, ++steps)
+        {
+            watchdog.step(particleSystem, timeStep);
+            const TelemetryFrame &t = particleSystem.telemetry.last;
+            result.forceClamps += t.forceClamps;
+            result.velocityClamps += t.velocityClamps;
+            result.maxSpeed = std::max(result.maxSpeed, t.maxSpeed);
+            densityError += t.meanDensityError;
+            neighbors += t.meanNeighbors;
+            candidates += t.candidatesPerNeighbor;
+        }
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    result.rollbacks = watchdog.rollbackCount;
+    result.stable = watchdog.rollbackCount == 0 && particleSystem.stepStats.nonFinite == 0;
+    result.finalKineticEnergy = particleSystem.stepStats.kineticEnergy;
+    result.meanDensityError = static_cast<float>(densityError / std::max(steps, 1));
+    result.meanNeighbors = static_cast<float>(neighbors / std::max(steps, 1));
+    result.candidatesPerNeighbor = static_cast<float>(candidates / std::max(steps, 1));
+    result.cellDivisions = particleSystem.cellDivisions;
+    result.stepsPerSecond = steps / std::max(result.seconds, 1e-9);
+    result.nanosecondsPerParticleStep = result.seconds * 1e9 / std::max<double>(1.0, (double)steps * particleSystem.particlePosition.size());
+    return result;
+}
+
+int SweepRunner::run(const std::string &outputPath, int threadCount)
+{
+    if (threadCount <= 0)
+        threadCount = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+
+    // rough cost model: neighbour work grows with particles, steps and the sample area
+    std::vector<double> costs;
+    for (auto &c : cases)
+        costs.push_back((double)c.params.particleCount * c.frames * c.params.stepCount *
+                        c.params.densitySampleRadius * c.params.densitySampleRadius);
+
+    std::vector<SweepResult> results(cases.size());
+    std::mutex printMutex;
+    size_t finished = 0;
+    WorkStealingPool pool(threadCount);
+    auto start = std::chrono::steady_clock::now();
+    pool.run(costs, [&](size_t task, int worker)
+             {
+                 // one case per core, the solver's own omp loops stay single threaded
+                 omp_set_num_threads(1);
+                 results[task] = runCase(cases[task]);
+                 results[task].worker = worker;
+                 std::lock_guard<std::mutex> lock(printMutex);
+                 std::cout << "[" << ++finished << "/" << cases.size() << "] case " << task
+                           << (results[task].stable ? " stable" : " unstable") << ", "
+                           << results[task].stepsPerSecond << " steps/s" << std::endl; });
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::ofstream out(outputPath);
+    if (!out)
+    {
+        std::cerr << "Failed to open " << outputPath << std::endl;
+        return 1;
+    }
+    out << "case";
+    if (!cases.empty())
+    {
+        for (auto &value : cases.front().values)
+            out << ',' << value.first;
+    }
+    out << ",frames,stable,rollbacks,force_clamps,velocity_clamps,max_speed,final_kinetic_energy,"
+           "mean_density_error,mean_neighbors,candidates_per_neighbor,cell_divisions,seconds,steps_per_second,"
+           "ns_per_particle_step,worker\n";
+    for (size_t i = 0; i < cases.size(); ++i)
+    {
+        const SweepResult &r = results[i];
+        out << i;
+        for (auto &value : cases[i].values)
+            out << ',' << value.second;
+        out << ',' << cases[i].frames << ',' << r.stable << ',' << r.rollbacks << ',' << r.forceClamps << ','
+            << r.velocityClamps << ',' << r.maxSpeed << ',' << r.finalKineticEnergy << ',' << r.meanDensityError << ','
+            << r.meanNeighbors << ',' << r.candidatesPerNeighbor << ',' << r.cellDivisions << ',' << r.seconds << ',' << r.stepsPerSecond << ',' << r.nanosecondsPerParticleStep << ','
+            << r.worker << '\n';
+    }
+
+    size_t stolen = std::accumulate(pool.stolenTasks.begin(), pool.stolenTasks.end(), size_t(0));
+    std::cout << "Swept " << cases.size() << " cases on " << threadCount << " threads in " << seconds
+              << " s (" << stolen << " stolen), results in " << outputPath << std::endl;
+    return 0;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "parameters.h"
+
+class WorkStealingPool
+{
+    // every worker owns a deque of task indices. owners take from the front, idle workers
+    // steal from the back of another deque, so a few long tasks cannot leave cores idle
+public:
+    using Work = std::function<void(size_t task, int worker)>;
+
+    explicit WorkStealingPool(int workerCount);
+    void run(const std::vector<double> &taskCosts, const Work &work);
+
+    int workerCount;
+    std::vector<size_t> stolenTasks; // per worker, from the last run
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+    std::vector<Queue> queues;
+
+    bool pop(int worker, size_t &task);
+    bool steal(int thief, size_t &task);
+};
+
+struct SweepCase
+{
+    Parameters params;
+    std::vector<std::pair<std::string, float>> values; // the swept values, in grid order
+    int frames = 300;
+};
+
+struct SweepResult
+{
+    bool stable = false;
+    int rollbacks = 0;
+    uint64_t forceClamps = 0;
+    uint64_t velocityClamps = 0;
+    float maxSpeed = 0.0f;
+    float finalKineticEnergy = 0.0f;
+    float meanDensityError = 0.0f;
+    float meanNeighbors = 0.0f;
+    float candidatesPerNeighbor = 0.0f; // particles the density searches tested per neighbour found
+    int cellDivisions = 1;              // of the grid at the end of the case
+    double seconds = 0.0;
+    double stepsPerSecond = 0.0;
+    double nanosecondsPerParticleStep = 0.0;
+    int worker = -1;
+};
+
+class SweepRunner
+{
+    // runs the cartesian product of a parameter grid, one ParticleSystem per case.
+    // the grid file has one "name = v1, v2, ..." line per swept parameter, plus
+    // an optional "frames = n" line
+public:
+    SweepRunner(const Parameters &base) : base(base) {}
+    bool loadGrid(const std::string &path);
+    int run(const std::string &outputPath, int threadCount);
+
+    std::vector<SweepCase> cases;
+
+private:
+    Parameters base;
+
+    SweepResult runCase(const SweepCase &sweepCase) const;
+    static bool setParameter(Parameters &params, const std::string &name, float value);
+};
@@ -0,0 +1,158 @@
+#include "task_graph.h"
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <omp.h>
+
+int TaskGraph::addTask(int kind)
+{
+    kinds.push_back(kind);
+    homes.push_back(-1);
+    successors.emplace_back();
+    dependencyCount.push_back(0);
+    reservedTasks = -1;
+    return static_cast<int>(kinds.size()) - 1;
+}
+
+void TaskGraph::addDependency(int before, int after)
+{
+    successors[before].push_back(after);
+    dependencyCount[after]++;
+}
+
+void TaskGraph::clear()
+{
+    kinds.clear();
+    homes.clear();
+    successors.clear();
+    dependencyCount.clear();
+    reservedTasks = -1;
+}
+
+void TaskGraph::reserve(int threads)
+{
+    const int count = taskCount();
+    if (count == reservedTasks && threads == readyCount)
+        return;
+    remaining.reset(new std::atomic<int>[count]);
+    ready.reset(new ReadyList[threads]);
+    for (int thread = 0; thread < threads; ++thread)
+        ready[thread].tasks.resize(count);
+    threadBusy.resize(threads);
+    threadSeconds.resize(threads);
+    readyCount = threads;
+    reservedTasks = count;
+}
+
+void TaskGraph::runTasks(void (*work)(const void *context, int task), const void *context)
+{
+    const int count = taskCount();
+    threadCount = omp_get_max_threads();
+    reserve(threadCount);
+    for (int thread = 0; thread < threadCount; ++thread)
+    {
+        ready[thread].head = 0;
+        ready[thread].size = 0;
+        threadBusy[thread].fill(0.0);
+    }
+    // the tasks without dependencies go to their home or are dealt round robin, the rest are
+    // readied as they unlock
+    int next = 0;
+    for (int task = 0; task < count; ++task)
+    {
+        remaining[task].store(dependencyCount[task], std::memory_order_relaxed);
+        if (dependencyCount[task] == 0)
+        {
+            ReadyList &list = ready[homes[task] >= 0 ? homes[task] % threadCount : next++ % threadCount];
+            list.tasks[list.size++] = task;
+        }
+    }
+
+    std::atomic<int> finished{0};
+    auto start = std::chrono::steady_clock::now();
+#pragma omp parallel num_threads(threadCount)
+    {
+        const int thread = omp_get_thread_num();
+        std::array<double, maxKinds> &busy = threadBusy[thread];
+        int task;
+        while (finished.load(std::memory_order_acquire) < count)
+        {
+            if (!pop(thread, task))
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            auto taskStart = std::chrono::steady_clock::now();
+            work(context, task);
+            busy[kinds[task]] += std::chrono::duration<double>(std::chrono::steady_clock::now() - taskStart).count();
+            // the last dependency to finish readies the task, acq_rel hands over the writes of all of them
+            for (int successor : successors[task])
+            {
+                if (remaining[successor].fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    push(thread, successor);
+            }
+            finished.fetch_add(1, std::memory_order_release);
+        }
+    }
+    wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::fill(threadSeconds.begin(), threadSeconds.end(), 0.0);
+    for (int kind = 0; kind < maxKinds; ++kind)
+    {
+        busySeconds[kind] = 0.0;
+        for (int thread = 0; thread < threadCount; ++thread)
+        {
+            busySeconds[kind] += threadBusy[thread][kind];
+            threadSeconds[thread] += threadBusy[thread][kind];
+        }
+    }
+}
+
+float TaskGraph::utilization() const
+{
+    double busy = 0.0;
+    for (double seconds : busySeconds)
+        busy += seconds;
+    return wallSeconds > 0.0 ? static_cast<float>(busy / (wallSeconds * threadCount)) : 0.0f;
+}
+
+float TaskGraph::imbalance() const
+{
+    if (threadSeconds.empty())
+        return 1.0f;
+    double busy = 0.0, busiest = 0.0;
+    for (double seconds : threadSeconds)
+    {
+        busy += seconds;
+        busiest = std::max(busiest, seconds);
+    }
+    return busy > 0.0 ? static_cast<float>(busiest * threadSeconds.size() / busy) : 1.0f;
+}
+
+void TaskGraph::push(int thread, int task)
+{
+    ReadyList &list = ready[thread];
+    std::lock_guard<std::mutex> lock(list.mutex);
+    list.tasks[(list.head + list.size++) % reservedTasks] = task;
+}
+
+bool TaskGraph::pop(int thread, int &task)
+{
+    // newest first from the own list, oldest first from the others
+    for (int i = 0; i < readyCount; ++i)
+    {
+        ReadyList &list = ready[(thread + i) % readyCount];
+        std::lock_guard<std::mutex> lock(list.mutex);
+        if (list.size == 0)
+            continue;
+        list.size--;
+        if (i == 0)
+            task = list.tasks[(list.head + list.size) % reservedTasks];
+        else
+        {
+            task = list.tasks[list.head];
+            list.head = (list.head + 1) % reservedTasks;
+        }
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class TaskGraph
+{
+    // tasks that only wait for the tasks they depend on, run by the omp threads. each thread keeps
+    // its own ready list and steals from the others when it runs dry. a finished task readies its
+    // successors on the same thread, which likely still holds their data in cache. tasks without
+    // dependencies start on their home thread, or round robin without one
+public:
+    static constexpr int maxKinds = 8;
+
+    int addTask(int kind);
+    void addDependency(int before, int after);
+    void clear();
+    bool empty() const { return kinds.empty(); }
+    int taskCount() const { return static_cast<int>(kinds.size()); }
+    void setHome(int task, int thread) { homes[task] = thread; }
+    int home(int task) const { return homes[task]; }
+    // sizes the per-thread state for the current tasks, a no-op until the graph or the thread count changes
+    void reserve(int threads);
+    // work is only borrowed for the run, so a capturing lambda costs no allocation
+    template <typename Work>
+    void run(const Work &work)
+    {
+        runTasks([](const void *context, int task)
+                 { (*static_cast<const Work *>(context))(task); },
+                 &work);
+    }
+
+    // from the last run
+    double busySeconds[maxKinds] = {}; // per task kind, summed over the threads
+    double wallSeconds = 0.0;
+    int threadCount = 1;
+    float utilization() const;
+    float imbalance() const; // busiest thread over the mean, 1 when even
+
+private:
+    // a ring over a fixed slot per task, no list can hold more than all of them
+    struct ReadyList
+    {
+        std::mutex mutex;
+        std::vector<int> tasks;
+        int head = 0;
+        int size = 0;
+    };
+    std::vector<int> kinds;
+    std::vector<int> homes; // -1 without one
+    std::vector<std::vector<int>> successors;
+    std::vector<int> dependencyCount;
+    std::unique_ptr<std::atomic<int>[]> remaining;
+    std::unique_ptr<ReadyList[]> ready;
+    std::vector<std::array<double, maxKinds>> threadBusy;
+    std::vector<double> threadSeconds;
+    int readyCount = 0;
+    int reservedTasks = -1;
+
+    void runTasks(void (*work)(const void *context, int task), const void *context);
+    void push(int thread, int task);
+    bool pop(int thread, int &task);
+};
@@ -0,0 +1,110 @@
+#include "telemetry.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+const char *telemetryPhaseNames[PhaseCount] = {"grid", "position", "density", "force", "velocity", "viscosity", "bodies"};
+
+void TelemetryCounters::clear()
+{
+    std::memset(this, 0, sizeof(*this));
+}
+
+int TelemetryFrame::neighborBin(int count)
+{
+    return std::min(count / neighborBinWidth, binCount - 1);
+}
+
+int TelemetryFrame::densityErrorBin(float density, float targetDensity)
+{
+    float error = (density - targetDensity) / targetDensity;
+    int bin = static_cast<int>(std::floor((error - densityErrorMin) / (densityErrorMax - densityErrorMin) * binCount));
+    return std::clamp(bin, 0, binCount - 1);
+}
+
+void TelemetryFrame::writeCsvHeader(std::ostream &out)
+{
+    out << "step,particles,sleeping_particles,kinetic_energy,max_speed,force_clamps,velocity_clamps,mean_neighbors,mean_density_error,occupied_cells,load_imbalance,partition_imbalance,candidates_per_neighbor,cell_divisions";
+    for (const char *name : telemetryPhaseNames)
+        out << ",time_" << name << "_us";
+    for (int i = 0; i < binCount; ++i)
+        out << ",neighbors_" << i * neighborBinWidth;
+    for (int i = 0; i < binCount; ++i)
+        out << ",density_error_" << i;
+    for (int i = 0; i < binCount; ++i)
+        out << ",cells_with_" << i + 1;
+    out << '\n';
+}
+
+void TelemetryFrame::writeCsv(std::ostream &out) const
+{
+    out << step << ',' << particleCount << ',' << sleepingParticles << ',' << kineticEnergy << ',' << maxSpeed << ','
+        << forceClamps << ',' << velocityClamps << ',' << meanNeighbors << ',' << meanDensityError << ',' << occupiedCells
+        << ',' << loadImbalance << ',' << partitionImbalance << ',' << candidatesPerNeighbor << ',' << cellDivisions;
+    for (float time : phaseTime)
+        out << ',' << time;
+    for (uint32_t count : neighborHistogram)
+        out << ',' << count;
+    for (uint32_t count : densityErrorHistogram)
+        out << ',' << count;
+    for (uint32_t count : cellOccupancyHistogram)
+        out << ',' << count;
+    out << '\n';
+}
+
+void Telemetry::beginStep()
+{
+    counters.resize(omp_get_max_threads());
+    for (auto &c : counters)
+        c.clear();
+    current = TelemetryFrame();
+}
+
+void Telemetry::recordNeighbors(int count, int candidates)
+{
+    TelemetryCounters &c = local();
+    c.neighborHistogram[TelemetryFrame::neighborBin(count)]++;
+    c.neighborTotal += count;
+    c.candidateTotal += candidates;
+}
+
+void Telemetry::recordDensity(float density, float targetDensity)
+{
+    TelemetryCounters &c = local();
+    c.densityErrorHistogram[TelemetryFrame::densityErrorBin(density, targetDensity)]++;
+    c.densityErrorTotal += std::abs(density - targetDensity) / targetDensity;
+}
+
+void Telemetry::recordCell(int particleCount)
+{
+    current.occupiedCells++;
+    current.cellOccupancyHistogram[std::min(particleCount, TelemetryFrame::binCount) - 1]++;
+}
+
+void Telemetry::endStep(uint64_t step, int particleCount)
+{
+    uint64_t neighborTotal = 0;
+    uint64_t candidateTotal = 0;
+    double densityErrorTotal = 0.0;
+    for (auto &c : counters)
+    {
+        for (int i = 0; i < TelemetryFrame::binCount; ++i)
+        {
+            current.neighborHistogram[i] += c.neighborHistogram[i];
+            current.densityErrorHistogram[i] += c.densityErrorHistogram[i];
+        }
+        current.forceClamps += c.forceClamps;
+        current.velocityClamps += c.velocityClamps;
+        neighborTotal += c.neighborTotal;
+        candidateTotal += c.candidateTotal;
+        densityErrorTotal += c.densityErrorTotal;
+    }
+    current.step = step;
+    current.particleCount = particleCount;
+    // sleeping particles skip the neighbour search and keep their density
+    int awake = particleCount - current.sleepingParticles;
+    current.meanNeighbors = awake ? static_cast<float>(neighborTotal) / awake : 0.0f;
+    current.candidatesPerNeighbor = neighborTotal ? static_cast<float>(candidateTotal) / neighborTotal : 0.0f;
+    current.meanDensityError = particleCount ? static_cast<float>(densityErrorTotal / particleCount) : 0.0f;
+    last = current;
+}
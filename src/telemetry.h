@@ -0,0 +1,85 @@
+#pragma once
+#include <cstdint>
+#include <ostream>
+#include <vector>
+#include <omp.h>
+
+enum TelemetryPhase
+{
+    PhaseGrid,
+    PhasePosition,
+    PhaseDensity,
+    PhaseForce,
+    PhaseVelocity,
+    PhaseViscosity,
+    PhaseBodies,
+    PhaseCount
+};
+
+extern const char *telemetryPhaseNames[PhaseCount];
+
+struct alignas(64) TelemetryCounters
+{
+    // one per thread, padded so threads never share a cache line
+    static constexpr int binCount = 32;
+    uint32_t neighborHistogram[binCount];
+    uint32_t densityErrorHistogram[binCount];
+    uint32_t forceClamps;
+    uint32_t velocityClamps;
+    uint64_t neighborTotal;
+    uint64_t candidateTotal; // particles the searches tested against the radius
+    double densityErrorTotal;
+
+    void clear();
+};
+
+struct TelemetryFrame
+{
+    static constexpr int binCount = TelemetryCounters::binCount;
+    static constexpr int neighborBinWidth = 4;
+    // relative density error covered by the histogram, the fluid usually sits above its target
+    static constexpr float densityErrorMin = -1.0f;
+    static constexpr float densityErrorMax = 3.0f;
+
+    uint64_t step = 0;
+    int particleCount = 0;
+    int sleepingParticles = 0;
+    uint32_t neighborHistogram[binCount] = {};
+    uint32_t densityErrorHistogram[binCount] = {};
+    uint32_t cellOccupancyHistogram[binCount] = {}; // bin i counts cells holding i + 1 particles
+    int occupiedCells = 0;
+    int forceClamps = 0;
+    int velocityClamps = 0;
+    float meanNeighbors = 0.0f;
+    float meanDensityError = 0.0f;
+    float kineticEnergy = 0.0f;
+    float maxSpeed = 0.0f;
+    float phaseTime[PhaseCount] = {}; // us
+    float loadImbalance = 1.0f;      // busiest thread over the mean of the parallel phases
+    float partitionImbalance = 0.0f; // largest chunk over the mean by estimated cost, 0 without chunks
+    float candidatesPerNeighbor = 0.0f; // particles the density searches tested per one in range
+    int cellDivisions = 1;             // neighbour grid cells per sample radius
+
+    static int neighborBin(int count);
+    static int densityErrorBin(float density, float targetDensity);
+    static void writeCsvHeader(std::ostream &out);
+    void writeCsv(std::ostream &out) const;
+};
+
+class Telemetry
+{
+    // counters are collected per thread inside the step and merged once at its end
+public:
+    TelemetryFrame last;
+    TelemetryFrame current;
+
+    void beginStep();
+    TelemetryCounters &local() { return counters[omp_get_thread_num()]; }
+    void recordNeighbors(int count, int candidates);
+    void recordDensity(float density, float targetDensity);
+    void recordCell(int particleCount);
+    void endStep(uint64_t step, int particleCount);
+
+private:
+    std::vector<TelemetryCounters> counters;
+};
@@ -0,0 +1,535 @@
+#include "trajectory.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+static int floorShift(int value, int bits)
+{
+    // floor division by 2^bits for negative values too
+    return value >= 0 ? value >> bits : -((-value + (1 << bits) - 1) >> bits);
+}
+
+TrajectoryCodec::TrajectoryCodec(const TrajectoryHeader &header) : header(header)
+{
+    scale = (1 << header.fractionBits) / header.cellSize;
+}
+
+void TrajectoryCodec::beginChunk()
+{
+    // chunks are decodable on their own, so every chunk starts from fresh models
+    models = Models();
+    keyframe = true;
+}
+
+int64_t TrajectoryCodec::cellKey(sf::Vector2i q) const
+{
+    int bits = header.fractionBits;
+    return (static_cast<int64_t>(floorShift(q.y, bits)) << 32) + static_cast<uint32_t>(floorShift(q.x, bits) + (1 << 30));
+}
+
+void TrajectoryCodec::sortByPreviousCell()
+{
+    // both sides know the previous frame, so the order never has to be stored
+    order.resize(previousPosition.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = static_cast<int>(i);
+    std::sort(order.begin(), order.end(), [this](int a, int b)
+              {
+                  int64_t ka = cellKey(previousPosition[a]);
+                  int64_t kb = cellKey(previousPosition[b]);
+                  return ka != kb ? ka < kb : a < b; });
+}
+
+void TrajectoryCodec::encodeFrame(RangeEncoder &encoder, const TrajectoryFrame &frame)
+{
+    size_t count = frame.position.size();
+    const bool phases = header.version >= 2;
+    quantizedPosition.resize(count);
+    quantizedVelocity.resize(count);
+    quantizedPhase.resize(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        quantizedPosition[i] = sf::Vector2i((int)std::floor(frame.position[i].x * scale), (int)std::floor(frame.position[i].y * scale));
+        quantizedVelocity[i] = sf::Vector2i((int)std::lround(frame.velocity[i].x * header.velocityScale), (int)std::lround(frame.velocity[i].y * header.velocityScale));
+        quantizedPhase[i] = i < frame.phase.size() ? std::min<uint8_t>(frame.phase[i], Parameters::maxPhases - 1) : 0;
+    }
+
+    bool key = keyframe || count != previousPosition.size();
+    encoder.encodeByte(models.flags, key ? 1 : 0);
+    encoder.encodeVarint(models.count, 3, count);
+    encoder.encodeVarint(models.step, 3, key ? frame.step : frame.step - previousStep);
+
+    int bits = header.fractionBits;
+    if (key)
+    {
+        sf::Vector2i previousCell(0, 0);
+        uint8_t lastPhase = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            sf::Vector2i q = quantizedPosition[i];
+            sf::Vector2i cell(floorShift(q.x, bits), floorShift(q.y, bits));
+            sf::Vector2i offset(q.x - (cell.x << bits), q.y - (cell.y << bits));
+            encoder.encodeVarint(models.cell[0], 3, zigzagEncode(cell.x - previousCell.x));
+            encoder.encodeVarint(models.cell[1], 3, zigzagEncode(cell.y - previousCell.y));
+            encoder.encodeVarint(models.offset[0], 2, offset.x);
+            encoder.encodeVarint(models.offset[1], 2, offset.y);
+            encoder.encodeVarint(models.velocity[0], 3, zigzagEncode(quantizedVelocity[i].x));
+            encoder.encodeVarint(models.velocity[1], 3, zigzagEncode(quantizedVelocity[i].y));
+            if (phases)
+                encoder.encodeByte(models.phase[lastPhase], quantizedPhase[i]);
+            previousCell = cell;
+            lastPhase = quantizedPhase[i];
+        }
+    }
+    else
+    {
+        sortByPreviousCell();
+        int64_t lastCell = -1;
+        sf::Vector2i lastMotion, lastAcceleration;
+        for (int i : order)
+        {
+            // neighbours in a cell move alike, so only their difference is coded
+            int64_t cell = cellKey(previousPosition[i]);
+            if (cell != lastCell)
+                lastMotion = lastAcceleration = sf::Vector2i(0, 0);
+            sf::Vector2i motion = quantizedPosition[i] - previousPosition[i];
+            sf::Vector2i acceleration = quantizedVelocity[i] - previousVelocity[i];
+            encoder.encodeVarint(models.motion[0], 3, zigzagEncode(motion.x - lastMotion.x));
+            encoder.encodeVarint(models.motion[1], 3, zigzagEncode(motion.y - lastMotion.y));
+            encoder.encodeVarint(models.acceleration[0], 3, zigzagEncode(acceleration.x - lastAcceleration.x));
+            encoder.encodeVarint(models.acceleration[1], 3, zigzagEncode(acceleration.y - lastAcceleration.y));
+            if (phases)
+                encoder.encodeByte(models.phase[previousPhase[i]], quantizedPhase[i]);
+            lastCell = cell;
+            lastMotion = motion;
+            lastAcceleration = acceleration;
+        }
+    }
+
+    previousPosition.swap(quantizedPosition);
+    previousVelocity.swap(quantizedVelocity);
+    previousPhase.swap(quantizedPhase);
+    previousStep = frame.step;
+    keyframe = false;
+}
+
+bool TrajectoryCodec::decodeFrame(RangeDecoder &decoder, TrajectoryFrame &frame)
+{
+    bool key = decoder.decodeByte(models.flags) != 0;
+    size_t count = decoder.decodeVarint(models.count, 3);
+    uint64_t step = decoder.decodeVarint(models.step, 3);
+    if ((!key && (keyframe || count != previousPosition.size())) || decoder.overrun())
+        return false;
+    frame.step = key ? step : previousStep + step;
+
+    int bits = header.fractionBits;
+    const bool phases = header.version >= 2;
+    quantizedPosition.resize(count);
+    quantizedVelocity.resize(count);
+    quantizedPhase.assign(count, 0);
+    if (key)
+    {
+        sf::Vector2i cell(0, 0);
+        uint8_t lastPhase = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            cell.x += (int)zigzagDecode(decoder.decodeVarint(models.cell[0], 3));
+            cell.y += (int)zigzagDecode(decoder.decodeVarint(models.cell[1], 3));
+            int offsetX = (int)decoder.decodeVarint(models.offset[0], 2);
+            int offsetY = (int)decoder.decodeVarint(models.offset[1], 2);
+            quantizedPosition[i] = sf::Vector2i((cell.x << bits) + offsetX, (cell.y << bits) + offsetY);
+            quantizedVelocity[i].x = (int)zigzagDecode(decoder.decodeVarint(models.velocity[0], 3));
+            quantizedVelocity[i].y = (int)zigzagDecode(decoder.decodeVarint(models.velocity[1], 3));
+            if (phases)
+                quantizedPhase[i] = lastPhase = std::min<uint8_t>(decoder.decodeByte(models.phase[lastPhase]), Parameters::maxPhases - 1);
+        }
+    }
+    else
+    {
+        sortByPreviousCell();
+        int64_t lastCell = -1;
+        sf::Vector2i lastMotion, lastAcceleration;
+        for (int i : order)
+        {
+            int64_t cell = cellKey(previousPosition[i]);
+            if (cell != lastCell)
+                lastMotion = lastAcceleration = sf::Vector2i(0, 0);
+            sf::Vector2i motion = lastMotion;
+            sf::Vector2i acceleration = lastAcceleration;
+            motion.x += (int)zigzagDecode(decoder.decodeVarint(models.motion[0], 3));
+            motion.y += (int)zigzagDecode(decoder.decodeVarint(models.motion[1], 3));
+            acceleration.x += (int)zigzagDecode(decoder.decodeVarint(models.acceleration[0], 3));
+            acceleration.y += (int)zigzagDecode(decoder.decodeVarint(models.acceleration[1], 3));
+            quantizedPosition[i] = previousPosition[i] + motion;
+            quantizedVelocity[i] = previousVelocity[i] + acceleration;
+            if (phases)
+                quantizedPhase[i] = std::min<uint8_t>(decoder.decodeByte(models.phase[previousPhase[i]]), Parameters::maxPhases - 1);
+            lastCell = cell;
+            lastMotion = motion;
+            lastAcceleration = acceleration;
+        }
+    }
+    if (decoder.overrun())
+        return false;
+
+    frame.position.resize(count);
+    frame.velocity.resize(count);
+    frame.phase.assign(quantizedPhase.begin(), quantizedPhase.end());
+    for (size_t i = 0; i < count; ++i)
+    {
+        // centre of the quantization bin
+        frame.position[i] = (Vector2f(quantizedPosition[i]) + Vector2f(0.5f, 0.5f)) / scale;
+        frame.velocity[i] = Vector2f(quantizedVelocity[i]) / header.velocityScale;
+    }
+
+    previousPosition.swap(quantizedPosition);
+    previousVelocity.swap(quantizedVelocity);
+    previousPhase.swap(quantizedPhase);
+    previousStep = frame.step;
+    keyframe = false;
+    return true;
+}
+
+bool TrajectoryRecorder::start(const std::string &path, const Parameters &params, size_t maxQueuedFrames)
+{
+    stop();
+    file.open(path, std::ios::binary | std::ios::trunc);
+    if (!file)
+    {
+        std::cerr << "Failed to open trajectory " << path << std::endl;
+        return false;
+    }
+
+    header = TrajectoryHeader();
+    header.cellSize = params.densitySampleRadius;
+    header.domainWidth = params.windowWidth;
+    header.domainHeight = params.windowHeight;
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    codec = TrajectoryCodec(header);
+    index.clear();
+    frameCount = 0;
+    chunkFrameCount = 0;
+    framesWritten = 0;
+    bytesWritten = sizeof(header);
+    this->maxQueuedFrames = std::max<size_t>(maxQueuedFrames, 1);
+    stopping = false;
+    recording = true;
+    worker = std::thread(&TrajectoryRecorder::run, this);
+    return true;
+}
+
+void TrajectoryRecorder::recordFrame(const ParticleSystem &particleSystem)
+{
+    if (!recording)
+        return;
+
+    TrajectoryFrame *frame;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        queueChanged.wait(lock, [this]
+                          { return queue.size() < maxQueuedFrames; });
+        if (freeFrames.empty())
+        {
+            framePool.emplace_back();
+            freeFrames.push_back(&framePool.back());
+        }
+        frame = freeFrames.back();
+        freeFrames.pop_back();
+    }
+
+    // pooled frames keep their capacity, so steady recording does not allocate
+    frame->step = particleSystem.stepCounter;
+    frame->position.assign(particleSystem.particlePosition.begin(), particleSystem.particlePosition.end());
+    frame->velocity.assign(particleSystem.particleVelocity.begin(), particleSystem.particleVelocity.end());
+    frame->phase.assign(particleSystem.particlePhase.begin(), particleSystem.particlePhase.end());
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(frame);
+    }
+    queueChanged.notify_all();
+}
+
+void TrajectoryRecorder::stop()
+{
+    if (!recording)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    queueChanged.notify_all();
+    worker.join();
+
+    flushChunk();
+    writeIndex();
+    file.close();
+    recording = false;
+}
+
+void TrajectoryRecorder::run()
+{
+    while (true)
+    {
+        TrajectoryFrame *frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queueChanged.wait(lock, [this]
+                              { return !queue.empty() || stopping; });
+            if (queue.empty())
+                return;
+            frame = queue.front();
+        }
+
+        encode(*frame);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.pop_front();
+            freeFrames.push_back(frame);
+        }
+        queueChanged.notify_all();
+    }
+}
+
+void TrajectoryRecorder::encode(const TrajectoryFrame &frame)
+{
+    if (chunkFrameCount == 0)
+    {
+        codec.beginChunk();
+        encoder.reset();
+    }
+    codec.encodeFrame(encoder, frame);
+    chunkFrameCount++;
+    frameCount++;
+    framesWritten = frameCount;
+    if (chunkFrameCount == header.chunkFrames)
+        flushChunk();
+}
+
+void TrajectoryRecorder::flushChunk()
+{
+    if (chunkFrameCount == 0)
+        return;
+    encoder.flush();
+
+    TrajectoryChunkHeader chunk;
+    chunk.firstFrame = frameCount - chunkFrameCount;
+    chunk.frameCount = chunkFrameCount;
+    chunk.size = static_cast<uint32_t>(encoder.bytes.size());
+    file.write(reinterpret_cast<const char *>(&chunk), sizeof(chunk));
+
+    TrajectoryIndexEntry entry;
+    entry.firstFrame = chunk.firstFrame;
+    entry.offset = static_cast<uint64_t>(file.tellp());
+    entry.frameCount = chunk.frameCount;
+    entry.size = chunk.size;
+    index.push_back(entry);
+
+    file.write(reinterpret_cast<const char *>(encoder.bytes.data()), encoder.bytes.size());
+    bytesWritten += sizeof(chunk) + encoder.bytes.size();
+    chunkFrameCount = 0;
+}
+
+void TrajectoryRecorder::writeIndex()
+{
+    TrajectoryFooter footer;
+    footer.indexOffset = static_cast<uint64_t>(file.tellp());
+    footer.chunkCount = index.size();
+    footer.frameCount = frameCount;
+    file.write(reinterpret_cast<const char *>(index.data()), index.size() * sizeof(TrajectoryIndexEntry));
+    file.write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+    bytesWritten += index.size() * sizeof(TrajectoryIndexEntry) + sizeof(footer);
+}
+
+bool TrajectoryPlayer::open(const std::string &path)
+{
+    close();
+    if (!file.open(path))
+    {
+        std::cerr << "Failed to open trajectory " << path << std::endl;
+        return false;
+    }
+    if (file.size() >= sizeof(header))
+        std::memcpy(&header, file.data(), sizeof(header));
+    if (file.size() < sizeof(header) || std::memcmp(header.magic, "FLTR", 4) != 0 || (header.version != 1 && header.version != 2))
+    {
+        std::cerr << "Trajectory " << path << " has an unsupported format" << std::endl;
+        file.close();
+        return false;
+    }
+    if (!readIndex() || index.empty())
+    {
+        std::cerr << "Trajectory " << path << " has no frames" << std::endl;
+        file.close();
+        return false;
+    }
+
+    stopping = false;
+    requestedChunk = SIZE_MAX;
+    for (auto &cached : cache)
+        cached = DecodedChunk();
+    prefetcher = std::thread(&TrajectoryPlayer::prefetch, this);
+    return true;
+}
+
+void TrajectoryPlayer::close()
+{
+    if (prefetcher.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        prefetchRequested.notify_all();
+        prefetcher.join();
+    }
+    file.close();
+    index.clear();
+    frameCount = 0;
+}
+
+bool TrajectoryPlayer::readIndex()
+{
+    index.clear();
+    TrajectoryFooter footer;
+    if (file.size() >= sizeof(header) + sizeof(footer))
+        std::memcpy(&footer, file.data() + file.size() - sizeof(footer), sizeof(footer));
+    if (std::memcmp(footer.magic, "FLTI", 4) == 0 && footer.indexOffset + footer.chunkCount * sizeof(TrajectoryIndexEntry) <= file.size())
+    {
+        index.resize(footer.chunkCount);
+        std::memcpy(index.data(), file.data() + footer.indexOffset, footer.chunkCount * sizeof(TrajectoryIndexEntry));
+        frameCount = footer.frameCount;
+        return true;
+    }
+
+    // no footer, the recording was interrupted: rebuild the index from the chunk headers
+    size_t offset = sizeof(header);
+    frameCount = 0;
+    while (offset + sizeof(TrajectoryChunkHeader) <= file.size())
+    {
+        TrajectoryChunkHeader chunk;
+        std::memcpy(&chunk, file.data() + offset, sizeof(chunk));
+        offset += sizeof(chunk);
+        if (chunk.firstFrame != frameCount || offset + chunk.size > file.size())
+            break;
+        index.push_back({chunk.firstFrame, offset, chunk.frameCount, chunk.size});
+        frameCount += chunk.frameCount;
+        offset += chunk.size;
+    }
+    return true;
+}
+
+size_t TrajectoryPlayer::findChunk(uint64_t frame) const
+{
+    auto it = std::upper_bound(index.begin(), index.end(), frame, [](uint64_t f, const TrajectoryIndexEntry &entry)
+                               { return f < entry.firstFrame; });
+    return static_cast<size_t>(it - index.begin()) - 1;
+}
+
+bool TrajectoryPlayer::decodeChunk(size_t chunk, DecodedChunk &out) const
+{
+    const TrajectoryIndexEntry &entry = index[chunk];
+    TrajectoryCodec codec(header);
+    codec.beginChunk();
+    RangeDecoder decoder(reinterpret_cast<const uint8_t *>(file.data()) + entry.offset, entry.size);
+    out.frames.resize(entry.frameCount);
+    for (auto &frame : out.frames)
+    {
+        if (!codec.decodeFrame(decoder, frame))
+            return false;
+    }
+    out.chunk = chunk;
+    return true;
+}
+
+TrajectoryPlayer::DecodedChunk *TrajectoryPlayer::findCached(size_t chunk)
+{
+    for (auto &cached : cache)
+    {
+        if (cached.chunk == chunk)
+        {
+            cached.lastUse = ++useCounter;
+            return &cached;
+        }
+    }
+    return nullptr;
+}
+
+void TrajectoryPlayer::storeCached(DecodedChunk &decoded)
+{
+    if (findCached(decoded.chunk))
+        return;
+    DecodedChunk *oldest = &cache[0];
+    for (auto &cached : cache)
+    {
+        if (cached.lastUse < oldest->lastUse)
+            oldest = &cached;
+    }
+    // swapping keeps the evicted frame buffers around for the next decode
+    std::swap(*oldest, decoded);
+    oldest->lastUse = ++useCounter;
+}
+
+bool TrajectoryPlayer::getFrame(uint64_t frame, TrajectoryFrame &out)
+{
+    if (!isOpen())
+        return false;
+    frame = std::min(frame, frameCount - 1);
+    size_t chunk = findChunk(frame);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    DecodedChunk *cached = findCached(chunk);
+    if (!cached)
+    {
+        // a seek outside the prefetched chunks decodes on the caller's thread
+        lock.unlock();
+        DecodedChunk decoded;
+        if (!decodeChunk(chunk, decoded))
+            return false;
+        chunksDecoded++;
+        lock.lock();
+        storeCached(decoded);
+        cached = findCached(chunk);
+    }
+    const TrajectoryFrame &source = cached->frames[frame - index[chunk].firstFrame];
+    out.step = source.step;
+    out.position.assign(source.position.begin(), source.position.end());
+    out.velocity.assign(source.velocity.begin(), source.velocity.end());
+    out.phase.assign(source.phase.begin(), source.phase.end());
+
+    if (chunk + 1 < index.size() && !findCached(chunk + 1))
+    {
+        requestedChunk = chunk + 1;
+        prefetchRequested.notify_all();
+    }
+    return true;
+}
+
+void TrajectoryPlayer::prefetch()
+{
+    DecodedChunk decoded;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        prefetchRequested.wait(lock, [this]
+                               { return stopping || requestedChunk != SIZE_MAX; });
+        if (stopping)
+            return;
+        size_t chunk = requestedChunk;
+        requestedChunk = SIZE_MAX;
+        if (findCached(chunk))
+            continue;
+
+        lock.unlock();
+        bool ok = decodeChunk(chunk, decoded);
+        lock.lock();
+        if (ok)
+        {
+            chunksDecoded++;
+            storeCached(decoded);
+        }
+    }
+}
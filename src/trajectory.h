@@ -0,0 +1,189 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <SFML/System/Vector2.hpp>
+#include "particle_system.h"
+#include "range_coder.h"
+#include "utils.h"
+
+// file layout: header, chunks (each a chunk header plus range coded frames that start
+// with a keyframe), the seek index and a footer pointing at the index
+struct TrajectoryHeader
+{
+    char magic[4] = {'F', 'L', 'T', 'R'};
+    uint32_t version = 2; // 1 has no phases
+    uint32_t chunkFrames = 60;
+    uint32_t fractionBits = 8;
+    float cellSize = 50.0f;
+    float velocityScale = 16.0f;
+    uint32_t domainWidth = 0;
+    uint32_t domainHeight = 0;
+};
+
+struct TrajectoryChunkHeader
+{
+    uint64_t firstFrame = 0;
+    uint32_t frameCount = 0;
+    uint32_t size = 0;
+};
+
+struct TrajectoryIndexEntry
+{
+    uint64_t firstFrame = 0;
+    uint64_t offset = 0; // of the chunk data, just after its chunk header
+    uint32_t frameCount = 0;
+    uint32_t size = 0;
+};
+
+struct TrajectoryFooter
+{
+    uint64_t indexOffset = 0;
+    uint64_t chunkCount = 0;
+    uint64_t frameCount = 0;
+    char magic[4] = {'F', 'L', 'T', 'I'};
+    uint32_t padding = 0;
+};
+
+struct TrajectoryFrame
+{
+    uint64_t step = 0;
+    vector<Vector2f> position;
+    vector<Vector2f> velocity;
+    vector<uint8_t> phase;
+};
+
+class TrajectoryCodec
+{
+    // positions are fixed point in cell units: a cell coordinate plus a fractionBits wide
+    // offset from the cell origin. a keyframe stores cell deltas and offsets in particle order,
+    // other frames store each particle's motion since the previous frame, visited in the cell
+    // order of the previous frame and predicted from the previous particle of the same cell. a
+    // particle's phase is coded in the context of its previous one, which it nearly always keeps
+public:
+    TrajectoryCodec(const TrajectoryHeader &header = TrajectoryHeader());
+    void beginChunk();
+    void encodeFrame(RangeEncoder &encoder, const TrajectoryFrame &frame);
+    bool decodeFrame(RangeDecoder &decoder, TrajectoryFrame &frame);
+
+private:
+    struct Models
+    {
+        ByteModel flags;
+        ByteModel count[3];
+        ByteModel step[3];
+        ByteModel cell[2][3];
+        ByteModel offset[2][2];
+        ByteModel velocity[2][3];
+        ByteModel motion[2][3];
+        ByteModel acceleration[2][3];
+        ByteModel phase[Parameters::maxPhases];
+    };
+
+    TrajectoryHeader header;
+    float scale; // fixed point units per pixel
+    Models models;
+    bool keyframe = true;
+    uint64_t previousStep = 0;
+    vector<sf::Vector2i> previousPosition;
+    vector<sf::Vector2i> previousVelocity;
+    vector<uint8_t> previousPhase;
+    vector<sf::Vector2i> quantizedPosition;
+    vector<sf::Vector2i> quantizedVelocity;
+    vector<uint8_t> quantizedPhase;
+    vector<int> order;
+
+    void sortByPreviousCell();
+    int64_t cellKey(sf::Vector2i q) const;
+};
+
+class TrajectoryRecorder
+{
+    // frames are copied on the simulation thread and quantized, coded and written on a worker.
+    // at most maxQueuedFrames frames wait in memory, recordFrame blocks when the worker falls behind
+public:
+    ~TrajectoryRecorder() { stop(); }
+    bool start(const std::string &path, const Parameters &params, size_t maxQueuedFrames = 8);
+    void recordFrame(const ParticleSystem &particleSystem);
+    void stop();
+    bool isRecording() const { return recording; }
+
+    std::atomic<uint64_t> framesWritten{0};
+    std::atomic<uint64_t> bytesWritten{0};
+
+private:
+    bool recording = false;
+    size_t maxQueuedFrames = 8;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable queueChanged;
+    std::deque<TrajectoryFrame *> queue;
+    vector<TrajectoryFrame *> freeFrames;
+    std::deque<TrajectoryFrame> framePool;
+    bool stopping = false;
+
+    std::ofstream file;
+    TrajectoryHeader header;
+    TrajectoryCodec codec;
+    RangeEncoder encoder;
+    vector<TrajectoryIndexEntry> index;
+    uint64_t frameCount = 0;
+    uint32_t chunkFrameCount = 0;
+
+    void run();
+    void encode(const TrajectoryFrame &frame);
+    void flushChunk();
+    void writeIndex();
+};
+
+class TrajectoryPlayer
+{
+    // memory maps a recording and decodes whole chunks, the chunk after the one being
+    // shown is decoded ahead on a prefetch thread. seeking starts from the chunk keyframe
+public:
+    static constexpr size_t cachedChunks = 3;
+
+    ~TrajectoryPlayer() { close(); }
+    bool open(const std::string &path);
+    void close();
+    bool isOpen() const { return file.data() != nullptr; }
+    uint64_t getFrameCount() const { return frameCount; }
+    const TrajectoryHeader &getHeader() const { return header; }
+    bool getFrame(uint64_t frame, TrajectoryFrame &out);
+
+    std::atomic<uint64_t> chunksDecoded{0};
+
+private:
+    struct DecodedChunk
+    {
+        size_t chunk = SIZE_MAX;
+        uint64_t lastUse = 0;
+        vector<TrajectoryFrame> frames;
+    };
+
+    MappedFile file;
+    TrajectoryHeader header;
+    vector<TrajectoryIndexEntry> index;
+    uint64_t frameCount = 0;
+
+    std::thread prefetcher;
+    std::mutex mutex;
+    std::condition_variable prefetchRequested;
+    DecodedChunk cache[cachedChunks];
+    uint64_t useCounter = 0;
+    size_t requestedChunk = SIZE_MAX;
+    bool stopping = false;
+
+    bool readIndex();
+    size_t findChunk(uint64_t frame) const;
+    bool decodeChunk(size_t chunk, DecodedChunk &out) const;
+    DecodedChunk *findCached(size_t chunk);
+    void storeCached(DecodedChunk &decoded);
+    void prefetch();
+};
@@ -0,0 +1,293 @@
+#include "transport.h"
+#include <SFML/Network.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+bool Transport::exchange(int peer, const std::vector<char> &out, std::vector<char> &in)
+{
+    if (rank < peer)
+        return send(peer, out) && receive(peer, in);
+    return receive(peer, in) && send(peer, out);
+}
+
+bool Transport::barrier()
+{
+    std::vector<char> token(1, 0);
+    if (rank != 0)
+        return send(0, token) && receive(0, token);
+    for (int peer = 1; peer < size; ++peer)
+    {
+        if (!receive(peer, token))
+            return false;
+    }
+    for (int peer = 1; peer < size; ++peer)
+    {
+        if (!send(peer, token))
+            return false;
+    }
+    return true;
+}
+
+struct SharedMemoryTransport::Channel
+{
+    // written and read only grow, the difference is the fill level of the ring
+    alignas(64) std::atomic<uint64_t> written;
+    alignas(64) std::atomic<uint64_t> read;
+    alignas(64) char data[channelCapacity];
+};
+
+bool SharedMemoryTransport::open(const std::string &session, int rank, int size)
+{
+    close();
+    this->rank = rank;
+    this->size = size;
+    mappedSize = sizeof(Channel) * size * size;
+#ifdef _WIN32
+    std::string name = "Local\\" + session;
+    HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                        static_cast<DWORD>(static_cast<uint64_t>(mappedSize) >> 32),
+                                        static_cast<DWORD>(mappedSize), name.c_str());
+    if (mapping == NULL)
+    {
+        std::cerr << "Failed to create shared memory " << name << std::endl;
+        return false;
+    }
+    void *view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, mappedSize);
+    if (view == NULL)
+    {
+        CloseHandle(mapping);
+        std::cerr << "Failed to map shared memory " << name << std::endl;
+        return false;
+    }
+    mappingHandle = mapping;
+    mapped = static_cast<char *>(view);
+#else
+    std::string name = "/" + session;
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+    if (fd < 0 || ftruncate(fd, static_cast<off_t>(mappedSize)) != 0)
+    {
+        if (fd >= 0)
+            ::close(fd);
+        std::cerr << "Failed to create shared memory " << name << std::endl;
+        return false;
+    }
+    void *view = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (view == MAP_FAILED)
+    {
+        std::cerr << "Failed to map shared memory " << name << std::endl;
+        return false;
+    }
+    mapped = static_cast<char *>(view);
+#endif
+    return true;
+}
+
+void SharedMemoryTransport::close()
+{
+    if (mapped == nullptr)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(mapped);
+    CloseHandle(mappingHandle);
+#else
+    munmap(mapped, mappedSize);
+#endif
+    mapped = nullptr;
+    mappingHandle = nullptr;
+}
+
+void SharedMemoryTransport::remove(const std::string &session)
+{
+    // windows frees the mapping with its last handle, posix keeps it until it is unlinked
+#ifndef _WIN32
+    shm_unlink(("/" + session).c_str());
+#else
+    (void)session;
+#endif
+}
+
+SharedMemoryTransport::Channel &SharedMemoryTransport::channel(int from, int to)
+{
+    return reinterpret_cast<Channel *>(mapped)[from * size + to];
+}
+
+bool SharedMemoryTransport::send(int to, const std::vector<char> &message)
+{
+    Channel &c = channel(rank, to);
+    uint64_t length = message.size();
+    bytesSent += sizeof(length) + length;
+    return write(c, reinterpret_cast<const char *>(&length), sizeof(length)) && write(c, message.data(), message.size());
+}
+
+bool SharedMemoryTransport::receive(int from, std::vector<char> &message)
+{
+    Channel &c = channel(from, rank);
+    uint64_t length = 0;
+    if (!read(c, reinterpret_cast<char *>(&length), sizeof(length)))
+        return false;
+    message.resize(length);
+    return read(c, message.data(), length);
+}
+
+bool SharedMemoryTransport::write(Channel &c, const char *data, size_t size)
+{
+    // streams through the ring, so a message may be larger than the channel
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeoutSeconds);
+    int spins = 0;
+    while (size > 0)
+    {
+        uint64_t written = c.written.load(std::memory_order_relaxed);
+        uint64_t free = channelCapacity - (written - c.read.load(std::memory_order_acquire));
+        if (free == 0)
+        {
+            if (++spins > 64)
+                std::this_thread::yield();
+            if (std::chrono::steady_clock::now() > deadline)
+            {
+                std::cerr << "Shared memory transport: rank " << rank << " timed out sending" << std::endl;
+                return false;
+            }
+            continue;
+        }
+        size_t offset = written % channelCapacity;
+        size_t chunk = std::min<size_t>({size, free, channelCapacity - offset});
+        std::memcpy(c.data + offset, data, chunk);
+        c.written.store(written + chunk, std::memory_order_release);
+        data += chunk;
+        size -= chunk;
+        spins = 0;
+        deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeoutSeconds);
+    }
+    return true;
+}
+
+bool SharedMemoryTransport::read(Channel &c, char *data, size_t size)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeoutSeconds);
+    int spins = 0;
+    while (size > 0)
+    {
+        uint64_t read = c.read.load(std::memory_order_relaxed);
+        uint64_t available = c.written.load(std::memory_order_acquire) - read;
+        if (available == 0)
+        {
+            if (++spins > 64)
+                std::this_thread::yield();
+            if (std::chrono::steady_clock::now() > deadline)
+            {
+                std::cerr << "Shared memory transport: rank " << rank << " timed out receiving" << std::endl;
+                return false;
+            }
+            continue;
+        }
+        size_t offset = read % channelCapacity;
+        size_t chunk = std::min<size_t>({size, available, channelCapacity - offset});
+        std::memcpy(data, c.data + offset, chunk);
+        c.read.store(read + chunk, std::memory_order_release);
+        data += chunk;
+        size -= chunk;
+        spins = 0;
+        deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeoutSeconds);
+    }
+    return true;
+}
+
+TcpTransport::TcpTransport() = default;
+TcpTransport::~TcpTransport() = default;
+
+bool TcpTransport::open(unsigned short basePort, int rank, int size)
+{
+    this->rank = rank;
+    this->size = size;
+    sockets.clear();
+    sockets.resize(size);
+
+    sf::TcpListener listener;
+    if (rank + 1 < size && listener.listen(static_cast<unsigned short>(basePort + rank), sf::IpAddress::LocalHost) != sf::Socket::Status::Done)
+    {
+        std::cerr << "TCP transport: rank " << rank << " failed to listen on port " << basePort + rank << std::endl;
+        return false;
+    }
+
+    // the lower ranks may still be starting, so connecting is retried until the timeout
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeoutSeconds);
+    for (int peer = 0; peer < rank; ++peer)
+    {
+        auto socket = std::make_unique<sf::TcpSocket>();
+        while (socket->connect(sf::IpAddress::LocalHost, static_cast<unsigned short>(basePort + peer), sf::milliseconds(500)) != sf::Socket::Status::Done)
+        {
+            if (std::chrono::steady_clock::now() > deadline)
+            {
+                std::cerr << "TCP transport: rank " << rank << " could not reach rank " << peer << std::endl;
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        uint32_t id = static_cast<uint32_t>(rank);
+        if (socket->send(&id, sizeof(id)) != sf::Socket::Status::Done)
+            return false;
+        sockets[peer] = std::move(socket);
+    }
+
+    // the higher ranks introduce themselves, they may connect in any order
+    for (int accepted = rank + 1; accepted < size; ++accepted)
+    {
+        auto socket = std::make_unique<sf::TcpSocket>();
+        uint32_t id = 0;
+        if (listener.accept(*socket) != sf::Socket::Status::Done || !receiveAll(*socket, reinterpret_cast<char *>(&id), sizeof(id)) ||
+            id <= static_cast<uint32_t>(rank) || id >= static_cast<uint32_t>(size) || sockets[id])
+        {
+            std::cerr << "TCP transport: rank " << rank << " got a bad connection" << std::endl;
+            return false;
+        }
+        sockets[id] = std::move(socket);
+    }
+    return true;
+}
+
+bool TcpTransport::send(int to, const std::vector<char> &message)
+{
+    uint64_t length = message.size();
+    bytesSent += sizeof(length) + length;
+    sf::TcpSocket &socket = *sockets[to];
+    return socket.send(&length, sizeof(length)) == sf::Socket::Status::Done &&
+           (length == 0 || socket.send(message.data(), message.size()) == sf::Socket::Status::Done);
+}
+
+bool TcpTransport::receive(int from, std::vector<char> &message)
+{
+    sf::TcpSocket &socket = *sockets[from];
+    uint64_t length = 0;
+    if (!receiveAll(socket, reinterpret_cast<char *>(&length), sizeof(length)))
+        return false;
+    message.resize(length);
+    return receiveAll(socket, message.data(), length);
+}
+
+bool TcpTransport::receiveAll(sf::TcpSocket &socket, char *data, size_t size)
+{
+    while (size > 0)
+    {
+        std::size_t received = 0;
+        if (socket.receive(data, size, received) != sf::Socket::Status::Done)
+        {
+            std::cerr << "TCP transport: rank " << rank << " lost a connection" << std::endl;
+            return false;
+        }
+        data += received;
+        size -= received;
+    }
+    return true;
+}
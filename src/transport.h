@@ -0,0 +1,77 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace sf
+{
+    class TcpSocket;
+}
+
+class Transport
+{
+    // ordered byte messages between the ranks of a distributed run, one channel per pair of ranks.
+    // send and receive block until done, a peer that stalls for timeoutSeconds or hangs up is an error
+public:
+    virtual ~Transport() = default;
+    virtual bool send(int to, const std::vector<char> &message) = 0;
+    virtual bool receive(int from, std::vector<char> &message) = 0;
+
+    // the lower rank sends first, so a chain of exchanges cannot deadlock on full buffers
+    bool exchange(int peer, const std::vector<char> &out, std::vector<char> &in);
+    // every rank reports to rank 0, which releases them all
+    bool barrier();
+
+    int rank = 0;
+    int size = 1;
+    uint64_t bytesSent = 0;
+    static constexpr double timeoutSeconds = 30.0;
+};
+
+class SharedMemoryTransport : public Transport
+{
+    // one mapping shared by all local ranks, holding a ring buffer per ordered pair of ranks.
+    // the pages start zeroed, which is the empty state, so no rank has to set the mapping up
+public:
+    SharedMemoryTransport() = default;
+    SharedMemoryTransport(const SharedMemoryTransport &) = delete;
+    SharedMemoryTransport &operator=(const SharedMemoryTransport &) = delete;
+    ~SharedMemoryTransport() override { close(); }
+
+    bool open(const std::string &session, int rank, int size);
+    void close();
+    static void remove(const std::string &session);
+    bool send(int to, const std::vector<char> &message) override;
+    bool receive(int from, std::vector<char> &message) override;
+
+    static constexpr size_t channelCapacity = 1 << 20;
+
+private:
+    struct Channel;
+    char *mapped = nullptr;
+    size_t mappedSize = 0;
+    void *mappingHandle = nullptr;
+
+    Channel &channel(int from, int to);
+    bool write(Channel &channel, const char *data, size_t size);
+    bool read(Channel &channel, char *data, size_t size);
+};
+
+class TcpTransport : public Transport
+{
+    // a full mesh of localhost connections, rank r listens on basePort + r. higher ranks
+    // connect to lower ones, so every rank only waits for ranks that are already listening
+public:
+    TcpTransport();
+    ~TcpTransport() override;
+
+    bool open(unsigned short basePort, int rank, int size);
+    bool send(int to, const std::vector<char> &message) override;
+    bool receive(int from, std::vector<char> &message) override;
+
+private:
+    std::vector<std::unique_ptr<sf::TcpSocket>> sockets;
+
+    bool receiveAll(sf::TcpSocket &socket, char *data, size_t size);
+};
@@ -3,13 +3,21 @@
 #include <string>
 #include <SFML/Graphics.hpp>
 #include <algorithm>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 void DebugTimer::reset()
 {
     timeStart = std::chrono::high_resolution_clock::now();
 }
 
-void DebugTimer::printD(std::string msg)
+void DebugTimer::printD(const char *msg)
 {
     auto end = std::chrono::high_resolution_clock::now();
     auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - timeStart);
@@ -17,6 +25,15 @@ void DebugTimer::printD(std::string msg)
     std::cout << msg << elapsed.count() << "us(" << elapsed.count() / 1000.0f << " ms)" << std::endl;
 }
 
+float DebugTimer::lap()
+{
+    // microseconds since the last reset, then resets
+    auto end = std::chrono::high_resolution_clock::now();
+    auto elapsed = std::chrono::duration<float, std::micro>(end - timeStart);
+    timeStart = end;
+    return elapsed.count();
+}
+
 sf::Color operator*(const sf::Color &color, float factor)
 {
     return sf::Color(
@@ -25,3 +42,69 @@ sf::Color operator*(const sf::Color &color, float factor)
         std::clamp((int)(color.b * factor), 0, 255),
         color.a);
 }
+
+bool MappedFile::open(const std::string &path)
+{
+    close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL)
+    {
+        CloseHandle(file);
+        return false;
+    }
+    mapped = static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (mapped == nullptr)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    fileHandle = file;
+    mappingHandle = mapping;
+    mappedSize = static_cast<size_t>(fileSize.QuadPart);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        ::close(fd);
+        return false;
+    }
+    void *view = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (view == MAP_FAILED)
+        return false;
+    mapped = static_cast<const char *>(view);
+    mappedSize = static_cast<size_t>(st.st_size);
+#endif
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (mapped == nullptr)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(mapped);
+    CloseHandle(mappingHandle);
+    CloseHandle(fileHandle);
+#else
+    munmap(const_cast<char *>(mapped), mappedSize);
+#endif
+    mapped = nullptr;
+    mappedSize = 0;
+    fileHandle = nullptr;
+    mappingHandle = nullptr;
+}
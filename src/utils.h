@@ -1,3 +1,4 @@
+#pragma once
 #include <chrono>
 #include <string>
 #include <SFML/Graphics.hpp>
@@ -14,7 +15,28 @@ public:
         timeStart = timer.now();
     };
     void reset();
-    void printD(std::string msg);
+    void printD(const char *msg);
+    float lap();
+};
+
+class MappedFile
+{
+    // read-only memory mapping of a whole file
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile() { close(); }
+    bool open(const std::string &path);
+    void close();
+    const char *data() const { return mapped; }
+    size_t size() const { return mappedSize; }
+
+private:
+    const char *mapped = nullptr;
+    size_t mappedSize = 0;
+    void *fileHandle = nullptr;
+    void *mappingHandle = nullptr;
 };
 
 sf::Color operator*(const sf::Color &color, float factor);
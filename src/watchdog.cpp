@@ -0,0 +1,118 @@
+#include "watchdog.h"
+#include <cstdio>
+#include <iostream>
+
+void StabilityWatchdog::step(ParticleSystem &particleSystem, float timeStep)
+{
+    if (newestSnapshot < 0)
+        capture(particleSystem);
+
+    particleSystem.updateParticles(timeStep * timeStepScale);
+
+    if (isUnstable(particleSystem))
+    {
+        rollbackCount++;
+        timeStepScale = std::max(timeStepScale * 0.5f, minTimeStepScale);
+        stableSteps = 0;
+        if (rollback(particleSystem))
+            std::cerr << "Watchdog: " << lastReason << ", rolled back to step " << particleSystem.stepCounter
+                      << " with dt x" << timeStepScale << std::endl;
+        return;
+    }
+
+    if (forcedStepsLeft > 0)
+        forcedStepsLeft--;
+    lastEnergy = forcedStepsLeft > 0 ? -1.0f : particleSystem.stepStats.kineticEnergy;
+    if (++stableSteps >= recoverySteps && timeStepScale < 1.0f)
+    {
+        timeStepScale = std::min(timeStepScale * 2.0f, 1.0f);
+        stableSteps = 0;
+    }
+    if (particleSystem.stepCounter % snapshotInterval == 0)
+        capture(particleSystem);
+}
+
+void StabilityWatchdog::reset()
+{
+    for (auto &snapshot : snapshots)
+        snapshot.valid = false;
+    newestSnapshot = -1;
+    stableSteps = 0;
+    lastEnergy = -1.0f;
+    forcedStepsLeft = 0;
+    timeStepScale = 1.0f;
+}
+
+bool StabilityWatchdog::isUnstable(const ParticleSystem &particleSystem)
+{
+    const StepStats &stats = particleSystem.stepStats;
+    const Parameters &params = particleSystem.params;
+    int count = static_cast<int>(particleSystem.particlePosition.size());
+
+    if (stats.nonFinite > 0)
+        std::snprintf(lastReason, sizeof(lastReason), "non-finite particle state");
+    else if (forcedStepsLeft > 0)
+        return false;
+    else if (stats.maxSpeed > params.watchdogMaxSpeed)
+        std::snprintf(lastReason, sizeof(lastReason), "max speed %d", static_cast<int>(stats.maxSpeed));
+    else if (stats.forceClamps + stats.velocityClamps > params.watchdogClampFraction * count)
+        std::snprintf(lastReason, sizeof(lastReason), "%d clamped particles", stats.forceClamps + stats.velocityClamps);
+    // the floor keeps a fluid at rest from tripping over tiny relative changes
+    else if (lastEnergy >= 0.0f && stats.kineticEnergy > params.watchdogEnergyGrowth * lastEnergy + count * params.particleMass * 100.0f)
+        std::snprintf(lastReason, sizeof(lastReason), "kinetic energy jump");
+    else
+        return false;
+    return true;
+}
+
+void StabilityWatchdog::capture(const ParticleSystem &particleSystem)
+{
+    newestSnapshot = (newestSnapshot + 1) % snapshotCount;
+    Snapshot &snapshot = snapshots[newestSnapshot];
+    // assign reuses the snapshot buffers, the ring does not allocate once it is warm
+    snapshot.position.assign(particleSystem.particlePosition.begin(), particleSystem.particlePosition.end());
+    snapshot.positionPredicted.assign(particleSystem.particlePositionPredicted.begin(), particleSystem.particlePositionPredicted.end());
+    snapshot.velocity.assign(particleSystem.particleVelocity.begin(), particleSystem.particleVelocity.end());
+    snapshot.density.assign(particleSystem.particleDensity.begin(), particleSystem.particleDensity.end());
+    snapshot.id.assign(particleSystem.particleId.begin(), particleSystem.particleId.end());
+    snapshot.phase.assign(particleSystem.particlePhase.begin(), particleSystem.particlePhase.end());
+    snapshot.bodies = particleSystem.rigidBodies.bodies;
+    snapshot.stepCounter = particleSystem.stepCounter;
+    snapshot.rngState = particleSystem.rngState;
+    snapshot.forceStrength = particleSystem.params.forceStrength;
+    snapshot.valid = true;
+}
+
+bool StabilityWatchdog::rollback(ParticleSystem &particleSystem)
+{
+    // a snapshot that keeps failing even at the smallest dt is dropped for an older one
+    if (timeStepScale <= minTimeStepScale && newestSnapshot >= 0)
+    {
+        int older = (newestSnapshot + snapshotCount - 1) % snapshotCount;
+        if (snapshots[older].valid)
+        {
+            snapshots[newestSnapshot].valid = false;
+            newestSnapshot = older;
+        }
+    }
+    if (newestSnapshot < 0 || !snapshots[newestSnapshot].valid)
+        return false;
+
+    const Snapshot &snapshot = snapshots[newestSnapshot];
+    particleSystem.particlePosition.assign(snapshot.position.begin(), snapshot.position.end());
+    particleSystem.particlePositionPredicted.assign(snapshot.positionPredicted.begin(), snapshot.positionPredicted.end());
+    particleSystem.particleVelocity.assign(snapshot.velocity.begin(), snapshot.velocity.end());
+    particleSystem.particleDensity.assign(snapshot.density.begin(), snapshot.density.end());
+    particleSystem.particleCellIndices.resize(snapshot.position.size(), {-1, -1});
+    particleSystem.particleAsleep.assign(snapshot.position.size(), 0);
+    particleSystem.particlePhase.assign(snapshot.phase.begin(), snapshot.phase.end());
+    particleSystem.assignParticleIds(snapshot.id);
+    particleSystem.rigidBodies.bodies = snapshot.bodies;
+    particleSystem.stepCounter = snapshot.stepCounter;
+    particleSystem.rngState = snapshot.rngState;
+    particleSystem.params.forceStrength = snapshot.forceStrength;
+    particleSystem.applyMemoryMode(); // the mode may have changed since the snapshot
+    particleSystem.wakeAll();
+    lastEnergy = -1.0f;
+    return true;
+}
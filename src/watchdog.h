@@ -0,0 +1,54 @@
+#pragma once
+#include <string>
+#include "particle_system.h"
+
+class StabilityWatchdog
+{
+    // checks every step for a blow-up and rolls back to a recent snapshot, then keeps
+    // simulating with a smaller time step until the run has been stable for a while
+public:
+    static constexpr int snapshotCount = 4;
+    static constexpr int snapshotInterval = 30; // steps
+    static constexpr int recoverySteps = 120;   // stable steps before dt is raised again
+    static constexpr float minTimeStepScale = 1.0f / 16.0f;
+    static constexpr int forcedSteps = 60; // after an external force, only non-finite state counts as a blow-up
+
+    float timeStepScale = 1.0f;
+    int rollbackCount = 0;
+    char lastReason[64] = {}; // fixed buffer, checked every step without allocating
+
+    void step(ParticleSystem &particleSystem, float timeStep);
+    void reset();
+    // the interaction force legitimately drives particles past the speed, clamp and energy limits
+    void externalForceApplied()
+    {
+        lastEnergy = -1.0f;
+        forcedStepsLeft = forcedSteps;
+    }
+
+private:
+    struct Snapshot
+    {
+        bool valid = false;
+        size_t stepCounter = 0;
+        uint64_t rngState = 0;
+        float forceStrength = 0.0f;
+        vector<Vector2f> position;
+        vector<Vector2f> positionPredicted;
+        vector<Vector2f> velocity;
+        vector<float> density;
+        vector<uint32_t> id;
+        vector<uint8_t> phase;
+        vector<RigidBody> bodies;
+    };
+
+    Snapshot snapshots[snapshotCount];
+    int newestSnapshot = -1;
+    int stableSteps = 0;
+    float lastEnergy = -1.0f;
+    int forcedStepsLeft = 0;
+
+    bool isUnstable(const ParticleSystem &particleSystem);
+    void capture(const ParticleSystem &particleSystem);
+    bool rollback(ParticleSystem &particleSystem);
+};